@@ -0,0 +1,137 @@
+// Times the character class scanners against each other.
+//
+//   char_class_bench            runs of each class, 1 to 128 bytes long
+//   char_class_bench FILE...    walks each file the way the lexer does
+//
+// Prints MB/s for every scanner this CPU can run, best of REPEATS.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/char_class.h"
+
+#define REPEATS 7
+#define BUFFER_SIZE (16 << 20)
+
+static const char *const scanner_names[] = {"scalar", "sse2", "avx2", "neon"};
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// What the lexer does between tokens: skip a run with the matching class,
+// or step over a single byte that isn't in any of them.
+static size_t Walk(const char *p, const char *end) {
+  size_t tokens = 0;
+  while (p < end) {
+    if (IsClass(*p, CC_SPACE)) {
+      p = SkipSpace(p, end);
+    } else if (IsClass(*p, CC_ALPHA)) {
+      p = SkipAlpha(p, end);
+    } else if (IsClass(*p, CC_DIGIT)) {
+      p = SkipDigits(p, end);
+    } else {
+      p++;
+    }
+    tokens++;
+  }
+  return tokens;
+}
+
+static double Time(const char *buffer, size_t size) {
+  double best = 1e30;
+  volatile size_t sink = 0;
+  for (int i = 0; i < REPEATS; ++i) {
+    double start = Now();
+    sink += Walk(buffer, buffer + size);
+    double elapsed = Now() - start;
+    if (elapsed < best) {
+      best = elapsed;
+    }
+  }
+  (void) sink;
+  return size / best / 1e6;
+}
+
+static void Row(const char *label, const char *buffer, size_t size) {
+  printf("%-22s", label);
+  for (size_t i = 0; i < sizeof(scanner_names) / sizeof(scanner_names[0]); ++i) {
+    if (UseScanner(scanner_names[i])) {
+      printf(" %8.0f", Time(buffer, size));
+    } else {
+      printf(" %8s", "-");
+    }
+  }
+  printf("\n");
+}
+
+static void Header(void) {
+  printf("%-22s", "MB/s");
+  for (size_t i = 0; i < sizeof(scanner_names) / sizeof(scanner_names[0]); ++i) {
+    printf(" %8s", scanner_names[i]);
+  }
+  printf("\n");
+}
+
+// Runs of `run` bytes from `fill`, each followed by a ';'.
+static void FillRuns(char *buffer, size_t size, const char *fill, size_t run) {
+  size_t fill_length = strlen(fill);
+  for (size_t i = 0; i < size; ++i) {
+    size_t at = i % (run + 1);
+    buffer[i] = at == run ? ';' : fill[at % fill_length];
+  }
+}
+
+static char *ReadFile(const char *file_name, size_t *size) {
+  FILE *f = fopen(file_name, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Can't open %s\n", file_name);
+    exit(1);
+  }
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *buffer = malloc(*size);
+  if (buffer == NULL || fread(buffer, 1, *size, f) != *size) {
+    fprintf(stderr, "Can't read %s\n", file_name);
+    exit(1);
+  }
+  fclose(f);
+  return buffer;
+}
+
+int main(int argc, char **argv) {
+  Header();
+  if (argc > 1) {
+    for (int i = 1; i < argc; ++i) {
+      size_t size;
+      char *buffer = ReadFile(argv[i], &size);
+      Row(argv[i], buffer, size);
+      free(buffer);
+    }
+    return 0;
+  }
+  char *buffer = malloc(BUFFER_SIZE);
+  if (buffer == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 2;
+  }
+  static const struct {
+    const char *name;
+    const char *fill;
+  } classes[] = {{"space", " \t \n"}, {"alpha", "abcXYZ"}, {"digits", "0123456789"}};
+  static const size_t runs[] = {1, 2, 4, 8, 16, 32, 64, 128};
+  for (size_t c = 0; c < sizeof(classes) / sizeof(classes[0]); ++c) {
+    for (size_t r = 0; r < sizeof(runs) / sizeof(runs[0]); ++r) {
+      char label[32];
+      snprintf(label, sizeof(label), "%s x%zu", classes[c].name, runs[r]);
+      FillRuns(buffer, BUFFER_SIZE, classes[c].fill, runs[r]);
+      Row(label, buffer, BUFFER_SIZE);
+    }
+  }
+  free(buffer);
+  return 0;
+}
@@ -1,32 +1,246 @@
 #include "arena.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
 
-Arena allocate_arena(int size_in_bytes) {
-  Arena arena = {
-      .next_ptr= malloc(size_in_bytes),
-      .used = 0,
-      .size = size_in_bytes
-  };
-  if (arena.next_ptr == NULL) {
+#define ALIGN_UP(n) (((n) + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1))
+#define CHUNK_HEADER ALIGN_UP(sizeof(ArenaChunk))
+// Reserved chunks are committed in steps of this many bytes.
+#define COMMIT_GRANULE ((size_t) 64 * 1024)
+#define HUGE_PAGE_SIZE ((size_t) 2 * 1024 * 1024)
+
+static char* ChunkData(ArenaChunk* chunk) {
+  return (char*) chunk + CHUNK_HEADER;
+}
+
+static ArenaChunk* NewChunk(size_t size_in_bytes, ArenaChunk* prev) {
+  ArenaChunk* chunk = malloc(CHUNK_HEADER + size_in_bytes);
+  if (chunk == NULL) {
     fprintf(stderr, "failed to allocate memory");
     exit(2);
   }
-  arena.to_free_ptr = arena.next_ptr;
+  chunk->prev = prev;
+  chunk->size = size_in_bytes;
+  chunk->used = 0;
+  chunk->committed = size_in_bytes;
+  chunk->commit_granule = 0;
+  return chunk;
+}
+
+// Maps the whole range PROT_NONE so it costs nothing but address space, the
+// header page is committed straight away.
+static ArenaChunk* ReserveChunk(size_t reserve_bytes, int flags) {
+  size_t granule = flags & ARENA_HUGE_PAGES ? HUGE_PAGE_SIZE : COMMIT_GRANULE;
+  reserve_bytes = (reserve_bytes + granule - 1) & ~(granule - 1);
+  void* base = mmap(NULL, reserve_bytes, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+#ifdef MADV_HUGEPAGE
+  if (flags & ARENA_HUGE_PAGES) {
+    madvise(base, reserve_bytes, MADV_HUGEPAGE);
+  }
+#endif
+  if (mprotect(base, granule, PROT_READ | PROT_WRITE) != 0) {
+    munmap(base, reserve_bytes);
+    return NULL;
+  }
+  ArenaChunk* chunk = base;
+  chunk->prev = NULL;
+  chunk->size = reserve_bytes - CHUNK_HEADER;
+  chunk->used = 0;
+  chunk->committed = granule - CHUNK_HEADER;
+  chunk->commit_granule = granule;
+  return chunk;
+}
+
+// Commits enough of a reserved chunk to hold `needed` bytes, returns false if
+// the chunk is out of reserved space.
+static int CommitChunk(ArenaChunk* chunk, size_t needed) {
+  if (chunk->commit_granule == 0 || needed > chunk->size) {
+    return 0;
+  }
+  size_t granule = chunk->commit_granule;
+  size_t end = CHUNK_HEADER + needed;
+  end = (end + granule - 1) & ~(granule - 1);
+  if (end - CHUNK_HEADER > chunk->size) {
+    end = CHUNK_HEADER + chunk->size;
+  }
+  char* from = ChunkData(chunk) + chunk->committed;
+  if (mprotect(from, (char*) chunk + end - from, PROT_READ | PROT_WRITE) != 0) {
+    return 0;
+  }
+  chunk->committed = end - CHUNK_HEADER;
+  return 1;
+}
+
+Arena allocate_arena(size_t size_in_bytes) {
+  size_in_bytes = ALIGN_UP(size_in_bytes);
+  Arena arena = {
+      .head = NewChunk(size_in_bytes, NULL),
+      .spare = NULL,
+      .next_chunk_size = size_in_bytes * 2,
+  };
   return arena;
 }
 
-void* arena_alloc(Arena* arena, int size_in_bytes) {
-  if (arena->used + size_in_bytes > arena->size) {
-    fprintf(stderr, "out of memory in arena");
-    exit(2);
+Arena reserve_arena(size_t reserve_bytes, int flags) {
+  ArenaChunk* chunk = ReserveChunk(reserve_bytes, flags);
+  if (chunk == NULL) {
+    return allocate_arena(COMMIT_GRANULE);
   }
-  void* ret = arena->next_ptr;
-  arena->next_ptr += size_in_bytes;
+  Arena arena = {
+      .head = chunk,
+      .spare = NULL,
+      .next_chunk_size = COMMIT_GRANULE * 16,
+  };
+  return arena;
+}
+
+// Slow path, the current chunk is full so commit more of it if it is
+// reserved, or chain on a new one. Grows geometrically so the number of
+// chunks stays logarithmic in total usage.
+static void* GrowArena(Arena* arena, size_t size_in_bytes) {
+  ArenaChunk* head = arena->head;
+  if (CommitChunk(head, head->used + size_in_bytes)) {
+    void* ret = ChunkData(head) + head->used;
+    head->used += size_in_bytes;
+    return ret;
+  }
+  ArenaChunk* spare = arena->spare;
+  if (spare != NULL && spare->size >= size_in_bytes) {
+    arena->spare = spare->prev;
+    spare->prev = arena->head;
+    arena->head = spare;
+  } else {
+    size_t chunk_size = arena->next_chunk_size;
+    while (chunk_size < size_in_bytes) {
+      chunk_size *= 2;
+    }
+    arena->head = NewChunk(chunk_size, arena->head);
+    arena->next_chunk_size = chunk_size * 2;
+  }
+  arena->head->used = size_in_bytes;
+  return ChunkData(arena->head);
+}
+
+void* arena_alloc(Arena* arena, size_t size_in_bytes) {
+  size_in_bytes = ALIGN_UP(size_in_bytes);
+  ArenaChunk* chunk = arena->head;
+  if (size_in_bytes > chunk->committed - chunk->used) {
+    return GrowArena(arena, size_in_bytes);
+  }
+  void* ret = ChunkData(chunk) + chunk->used;
+  chunk->used += size_in_bytes;
   return ret;
 }
 
+void* arena_realloc(Arena* arena, void* ptr, size_t old_size, size_t new_size) {
+  if (ptr == NULL) {
+    return arena_alloc(arena, new_size);
+  }
+  old_size = ALIGN_UP(old_size);
+  new_size = ALIGN_UP(new_size);
+  if (new_size <= old_size) {
+    return ptr;
+  }
+  ArenaChunk* chunk = arena->head;
+  char* top = ChunkData(chunk) + chunk->used;
+  if ((char*) ptr + old_size == top &&
+      (new_size - old_size <= chunk->committed - chunk->used ||
+          CommitChunk(chunk, chunk->used + new_size - old_size))) {
+    chunk->used += new_size - old_size;
+    return ptr;
+  }
+  void* ret = arena_alloc(arena, new_size);
+  memcpy(ret, ptr, old_size);
+  return ret;
+}
+
+char* arena_strdup(Arena* arena, const char* str) {
+  size_t len = strlen(str) + 1;
+  return memcpy(arena_alloc(arena, len), str, len);
+}
+
+char* arena_strndup(Arena* arena, const char* str, size_t length) {
+  char* copy = arena_alloc(arena, length + 1);
+  memcpy(copy, str, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+ArenaMark arena_mark(Arena* arena) {
+  return (ArenaMark) {.chunk = arena->head, .used = arena->head->used};
+}
+
+// Chunks newer than the mark are kept on the spare list rather than freed, so
+// a pass that rewinds and allocates again does not go back to malloc.
+void arena_rewind(Arena* arena, ArenaMark mark) {
+  size_t used = arena_used(arena);
+  if (used > arena->peak) {
+    arena->peak = used;
+  }
+  while (arena->head != mark.chunk) {
+    ArenaChunk* chunk = arena->head;
+    arena->head = chunk->prev;
+    chunk->prev = arena->spare;
+    arena->spare = chunk;
+  }
+  arena->head->used = mark.used;
+}
+
+void arena_reset(Arena* arena) {
+  ArenaChunk* bottom = arena->head;
+  while (bottom->prev != NULL) {
+    bottom = bottom->prev;
+  }
+  arena_rewind(arena, (ArenaMark) {.chunk = bottom, .used = 0});
+}
+
+static void FreeChunks(ArenaChunk* chunk) {
+  while (chunk != NULL) {
+    ArenaChunk* prev = chunk->prev;
+    if (chunk->commit_granule != 0) {
+      munmap(chunk, CHUNK_HEADER + chunk->size);
+    } else {
+      free(chunk);
+    }
+    chunk = prev;
+  }
+}
+
 void release(Arena* arena) {
-  free(arena->to_free_ptr);
+  FreeChunks(arena->head);
+  FreeChunks(arena->spare);
+  arena->head = NULL;
+  arena->spare = NULL;
 }
 
+size_t arena_used(const Arena* arena) {
+  size_t used = 0;
+  for (ArenaChunk* chunk = arena->head; chunk != NULL; chunk = chunk->prev) {
+    used += chunk->used;
+  }
+  return used;
+}
+
+bool arena_owns(const Arena* arena, const void* ptr) {
+  for (ArenaChunk* chunk = arena->head; chunk != NULL; chunk = chunk->prev) {
+    const char* data = ChunkData(chunk);
+    if ((const char*) ptr >= data && (const char*) ptr < data + chunk->used) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t arena_peak(const Arena* arena) {
+  size_t used = arena_used(arena);
+  return used > arena->peak ? used : arena->peak;
+}
+
+void arena_reset_peak(Arena* arena) {
+  arena->peak = arena_used(arena);
+}
@@ -1,17 +1,71 @@
 #ifndef BCC_SRC_ARENA_H
 #define BCC_SRC_ARENA_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 
+// Every allocation is aligned to this, enough for any type we put in an arena.
+#define ARENA_ALIGNMENT 16
+
+// Flags for reserve_arena.
+#define ARENA_HUGE_PAGES 1
+
+// A chunk header, the usable memory follows directly after it. Chunks are
+// chained newest first so that the bump pointer always lives in `head`.
+typedef struct ArenaChunk ArenaChunk;
+struct ArenaChunk {
+  ArenaChunk* prev;
+  size_t size;
+  size_t used;
+  // bytes that are backed by memory, only less than size for reserved chunks.
+  size_t committed;
+  // step size for committing a reserved mmap region, 0 for malloc chunks.
+  size_t commit_granule;
+};
+
 typedef struct {
-  void* to_free_ptr;
-  const int size;
-  int used;
-  void* next_ptr;
+  ArenaChunk* head;
+  // chunks given back by arena_rewind, reused before we malloc again.
+  ArenaChunk* spare;
+  // size of the next chunk to be allocated, doubles each time we grow.
+  size_t next_chunk_size;
+  // most bytes in use at any rewind since arena_reset_peak. Only rewinds can
+  // lower usage, so together with the current usage this is the high water
+  // mark without any cost to arena_alloc.
+  size_t peak;
 } Arena;
 
-Arena allocate_arena(int size_in_bytes);
-void* arena_alloc(Arena* arena, int size_in_bytes);
+// A savepoint, everything allocated after it is dropped by arena_rewind.
+typedef struct {
+  ArenaChunk* chunk;
+  size_t used;
+} ArenaMark;
+
+Arena allocate_arena(size_t size_in_bytes);
+// Reserves a virtual range up front and commits pages as they are needed,
+// falling back to malloc chunks if the reservation fails or fills up.
+Arena reserve_arena(size_t reserve_bytes, int flags);
+void* arena_alloc(Arena* arena, size_t size_in_bytes);
+// Grows `ptr` to `new_size`, in place when it is the most recent allocation
+// and there is still room in the chunk, otherwise by copying.
+void* arena_realloc(Arena* arena, void* ptr, size_t old_size, size_t new_size);
+char* arena_strdup(Arena* arena, const char* str);
+// Copies `length` bytes of `str` and NUL terminates the copy.
+char* arena_strndup(Arena* arena, const char* str, size_t length);
+ArenaMark arena_mark(Arena* arena);
+// Pointers handed out after `mark` must not be used once this returns.
+void arena_rewind(Arena* arena, ArenaMark mark);
+// Drops every allocation but keeps the memory, committed pages stay faulted
+// in so the next compile does not pay for them again.
+void arena_reset(Arena* arena);
 void release(Arena* arena);
+// Bytes handed out and not yet rewound.
+size_t arena_used(const Arena* arena);
+// Whether `ptr` is in memory the arena has handed out, for debug checks.
+bool arena_owns(const Arena* arena, const void* ptr);
+// The high water mark of arena_used since the last arena_reset_peak.
+size_t arena_peak(const Arena* arena);
+void arena_reset_peak(Arena* arena);
 
 #endif
@@ -0,0 +1,430 @@
+#include "cache.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Evicting goes down to this share of the limit, so we aren't evicting again
+// on the very next store.
+#define EVICT_TO_PERCENT 90
+
+typedef struct {
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long stores;
+  unsigned long long evictions;
+  // bytes in entries, only recounted when evicting.
+  unsigned long long size;
+} CacheStats;
+
+// Hashing, 16 bytes a step. The two halves of the key are two lanes that
+// each take in every byte, with their own seed and multiplier, so a
+// collision has to beat both of them at once.
+
+static inline uint64_t Mix(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t) a * b;
+  return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+static inline uint64_t Load64(const char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+#define HASH_K0 0xa0761d6478bd642full
+#define HASH_K1 0xe7037ed1a0b428dbull
+#define HASH_K2 0x8ebc6af09c88c6e3ull
+
+static void HashBytes(uint64_t *low, uint64_t *high, const char *text,
+                      size_t length) {
+  uint64_t a = *low;
+  uint64_t b = *high;
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    uint64_t w0 = Load64(text + i);
+    uint64_t w1 = Load64(text + i + 8);
+    a = Mix(a ^ w0, HASH_K1 ^ w1);
+    b = Mix(b ^ w1, HASH_K2 ^ w0);
+  }
+  uint64_t tail[2] = {0, 0};
+  memcpy(tail, text + i, length - i);
+  a = Mix(a ^ tail[0], HASH_K1 ^ tail[1] ^ length);
+  b = Mix(b ^ tail[1], HASH_K2 ^ tail[0] ^ length);
+  *low = Mix(a, HASH_K0);
+  *high = Mix(b, HASH_K0 ^ HASH_K2);
+}
+
+// The build is keyed on a hash of the compiler binary itself. Rebuilding an
+// unchanged compiler, or building it reproducibly elsewhere, keeps the cache
+// and any change at all starts it afresh.
+static CacheKey build_key;
+static pthread_once_t build_once = PTHREAD_ONCE_INIT;
+
+static void HashCompiler(void) {
+  build_key = (CacheKey) {HASH_K0, HASH_K1};
+  bool hashed = false;
+  int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      HashBytes(&build_key.low, &build_key.high, map, st.st_size);
+      munmap(map, st.st_size);
+      hashed = true;
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  // Without the binary there's no telling builds apart, so nothing outside
+  // this process can be trusted and entries are keyed to it alone.
+  if (!hashed) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t unique[3] = {getpid(), now.tv_sec, now.tv_nsec};
+    HashBytes(&build_key.low, &build_key.high, (const char *) unique,
+              sizeof(unique));
+  }
+}
+
+CacheKey HashSource(const char *text, size_t length, uint64_t salt) {
+  pthread_once(&build_once, HashCompiler);
+  uint64_t low = build_key.low ^ salt;
+  uint64_t high = build_key.high ^ salt;
+  HashBytes(&low, &high, text, length);
+  return (CacheKey) {low, high};
+}
+
+// Paths
+
+// Whether snprintf's result fit a PATH_MAX buffer.
+static bool FitsPath(int length) {
+  return length >= 0 && length < PATH_MAX;
+}
+
+const char *DefaultCacheDir(void) {
+  static _Thread_local char path[PATH_MAX];
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int n;
+  if (xdg != NULL && xdg[0] != '\0') {
+    n = snprintf(path, sizeof(path), "%s/bcc", xdg);
+  } else if (home != NULL && home[0] != '\0') {
+    n = snprintf(path, sizeof(path), "%s/.cache/bcc", home);
+  } else {
+    return NULL;
+  }
+  return FitsPath(n) ? path : NULL;
+}
+
+// False if the path didn't fit in PATH_MAX, paths here always get that much.
+static bool EntryPath(char *path, const char *dir, CacheKey key,
+                      char extension) {
+  return FitsPath(snprintf(path, PATH_MAX, "%s/%02x/%014llx%016llx.%c", dir,
+                           (unsigned) (key.high >> 56),
+                           (unsigned long long) (key.high & 0x00ffffffffffffffull),
+                           (unsigned long long) key.low, extension));
+}
+
+// Makes every missing directory in `path` up to its last slash.
+static void MakeParents(const char *path) {
+  char buf[PATH_MAX];
+  if (!FitsPath(snprintf(buf, sizeof(buf), "%s", path))) {
+    return;
+  }
+  for (char *p = buf + 1; *p != '\0'; ++p) {
+    if (*p == '/') {
+      *p = '\0';
+      mkdir(buf, 0777);
+      *p = '/';
+    }
+  }
+}
+
+// Stats, kept in a small text file and only changed holding the lock. A
+// process counts its own lookups and stores and adds them in when it exits,
+// or sooner once it has stored enough that the cache may need evicting.
+
+static int LockCache(const char *dir) {
+  char path[PATH_MAX];
+  if (!FitsPath(snprintf(path, sizeof(path), "%s/lock", dir))) {
+    return -1;
+  }
+  MakeParents(path);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd >= 0) {
+    flock(fd, LOCK_EX);
+  }
+  return fd;
+}
+
+static void UnlockCache(int fd) {
+  if (fd >= 0) {
+    flock(fd, LOCK_UN);
+    close(fd);
+  }
+}
+
+static CacheStats ReadStats(const char *dir) {
+  CacheStats stats = {0};
+  char path[PATH_MAX];
+  FILE *f = FitsPath(snprintf(path, sizeof(path), "%s/stats", dir))
+                ? fopen(path, "r")
+                : NULL;
+  if (f != NULL) {
+    if (fscanf(f, "hits %llu misses %llu stores %llu evictions %llu size %llu",
+               &stats.hits, &stats.misses, &stats.stores, &stats.evictions,
+               &stats.size) != 5) {
+      stats = (CacheStats) {0};
+    }
+    fclose(f);
+  }
+  return stats;
+}
+
+static void WriteStats(const char *dir, const CacheStats *stats) {
+  char path[PATH_MAX];
+  char tmp[PATH_MAX];
+  if (!FitsPath(snprintf(path, sizeof(path), "%s/stats", dir)) ||
+      !FitsPath(snprintf(tmp, sizeof(tmp), "%s/stats.%d", dir, (int) getpid()))) {
+    return;
+  }
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL) {
+    return;
+  }
+  fprintf(f, "hits %llu\nmisses %llu\nstores %llu\nevictions %llu\nsize %llu\n",
+          stats->hits, stats->misses, stats->stores, stats->evictions,
+          stats->size);
+  fclose(f);
+  rename(tmp, path);
+}
+
+// Eviction
+
+typedef struct {
+  char *path;
+  struct timespec mtime;
+  off_t size;
+} Entry;
+
+static int CompareAge(const void *a, const void *b) {
+  const struct timespec *x = &((const Entry *) a)->mtime;
+  const struct timespec *y = &((const Entry *) b)->mtime;
+  if (x->tv_sec != y->tv_sec) {
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  }
+  return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+// Recounts the cache and drops the least recently used entries until it is
+// back under the limit. Called holding the lock.
+static void Evict(const char *dir, size_t limit, CacheStats *stats) {
+  Entry *entries = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  unsigned long long total = 0;
+  for (unsigned bucket = 0; bucket < 256; ++bucket) {
+    char sub[PATH_MAX];
+    if (!FitsPath(snprintf(sub, sizeof(sub), "%s/%02x", dir, bucket))) {
+      break;
+    }
+    DIR *d = opendir(sub);
+    if (d == NULL) {
+      continue;
+    }
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+      // another compile's store in flight is left for it to rename.
+      size_t name_length = strlen(e->d_name);
+      if (e->d_name[0] == '.' ||
+          (name_length >= 4 && strcmp(e->d_name + name_length - 4, ".tmp") == 0)) {
+        continue;
+      }
+      char path[PATH_MAX];
+      struct stat st;
+      if (!FitsPath(snprintf(path, sizeof(path), "%s/%s", sub, e->d_name)) ||
+          stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        continue;
+      }
+      if (count == capacity) {
+        capacity = capacity == 0 ? 256 : capacity * 2;
+        Entry *grown = realloc(entries, sizeof(Entry) * capacity);
+        if (grown == NULL) {
+          break;
+        }
+        entries = grown;
+      }
+      entries[count++] = (Entry) {strdup(path), st.st_mtim, st.st_size};
+      total += st.st_size;
+    }
+    closedir(d);
+  }
+  qsort(entries, count, sizeof(Entry), CompareAge);
+  unsigned long long target = (unsigned long long) limit * EVICT_TO_PERCENT / 100;
+  for (size_t i = 0; i < count; ++i) {
+    if (total > target && entries[i].path != NULL && unlink(entries[i].path) == 0) {
+      total -= entries[i].size;
+      stats->evictions++;
+    }
+    free(entries[i].path);
+  }
+  free(entries);
+  stats->size = total;
+}
+
+// Not yet added to the stats file. Every compile in a process uses the same
+// cache directory.
+static struct {
+  pthread_mutex_t lock;
+  const char *dir;
+  size_t limit;
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long stores;
+  // bytes stored less the bytes of the entries they replaced.
+  long long grown;
+} pending = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void FlushStats(void) {
+  pthread_mutex_lock(&pending.lock);
+  const char *dir = pending.dir;
+  size_t limit = pending.limit;
+  CacheStats add = {.hits = pending.hits, .misses = pending.misses,
+                    .stores = pending.stores};
+  long long grown = pending.grown;
+  pending.hits = pending.misses = pending.stores = 0;
+  pending.grown = 0;
+  pthread_mutex_unlock(&pending.lock);
+  if (add.hits == 0 && add.misses == 0 && add.stores == 0) {
+    return;
+  }
+  int lock = LockCache(dir);
+  CacheStats stats = ReadStats(dir);
+  stats.hits += add.hits;
+  stats.misses += add.misses;
+  stats.stores += add.stores;
+  stats.size = grown < 0 && (unsigned long long) -grown > stats.size
+                   ? 0
+                   : stats.size + grown;
+  if (limit != 0 && stats.size > limit) {
+    Evict(dir, limit, &stats);
+  }
+  WriteStats(dir, &stats);
+  UnlockCache(lock);
+}
+
+static void StartCounting(const char *dir) {
+  if (pending.dir == NULL) {
+    pending.dir = dir;
+    atexit(FlushStats);
+  }
+}
+
+static void CountLookup(const char *dir, bool hit) {
+  pthread_mutex_lock(&pending.lock);
+  StartCounting(dir);
+  if (hit) {
+    pending.hits++;
+  } else {
+    pending.misses++;
+  }
+  pthread_mutex_unlock(&pending.lock);
+}
+
+// Whether enough has been stored since the last flush that the cache may
+// have gone over its limit.
+static bool CountStore(const char *dir, size_t limit, long long grown) {
+  pthread_mutex_lock(&pending.lock);
+  StartCounting(dir);
+  pending.limit = limit;
+  pending.stores++;
+  pending.grown += grown;
+  bool due = limit != 0 && pending.grown > (long long) (limit / 16);
+  pthread_mutex_unlock(&pending.lock);
+  return due;
+}
+
+// Lookup and store
+
+char *CacheLookup(const char *dir, CacheKey key, char extension,
+                  size_t *length) {
+  char path[PATH_MAX];
+  char *text = NULL;
+  int fd = EntryPath(path, dir, key, extension)
+               ? open(path, O_RDONLY | O_CLOEXEC)
+               : -1;
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && (text = malloc(st.st_size + 1)) != NULL) {
+    ssize_t n = read(fd, text, st.st_size);
+    if (n != st.st_size) {
+      free(text);
+      text = NULL;
+    } else {
+      text[n] = '\0';
+      *length = n;
+      // most recently used goes last when evicting.
+      futimens(fd, NULL);
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  CountLookup(dir, text != NULL);
+  return text;
+}
+
+void CacheStore(const char *dir, size_t limit, CacheKey key, char extension,
+                const char *text, size_t length) {
+  char path[PATH_MAX];
+  char tmp[PATH_MAX];
+  if (!EntryPath(path, dir, key, extension) ||
+      !FitsPath(snprintf(tmp, sizeof(tmp), "%s.%d.%lx.tmp", path, (int) getpid(),
+                         (unsigned long) pthread_self()))) {
+    return;
+  }
+  MakeParents(path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    return;
+  }
+  bool written = (size_t) write(fd, text, length) == length;
+  close(fd);
+  // An entry stored over only adds what it grew by. Two stores of one key
+  // at once can both miss the other, eviction recounts anyway.
+  struct stat old;
+  off_t replaced = stat(path, &old) == 0 ? old.st_size : 0;
+  if (!written || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return;
+  }
+  if (CountStore(dir, limit, (long long) length - replaced)) {
+    FlushStats();
+  }
+}
+
+void PrintCacheStats(const char *dir) {
+  int lock = LockCache(dir);
+  CacheStats stats = ReadStats(dir);
+  UnlockCache(lock);
+  unsigned long long lookups = stats.hits + stats.misses;
+  printf("cache directory: %s\n", dir);
+  printf("hits:            %llu\n", stats.hits);
+  printf("misses:          %llu\n", stats.misses);
+  printf("hit rate:        %.1f%%\n",
+         lookups == 0 ? 0.0 : 100.0 * stats.hits / lookups);
+  printf("stores:          %llu\n", stats.stores);
+  printf("evictions:       %llu\n", stats.evictions);
+  printf("size:            %llu bytes\n", stats.size);
+}
@@ -0,0 +1,37 @@
+#ifndef BCC_SRC_CACHE_H
+#define BCC_SRC_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// An on disk cache of generated assembly, keyed by a hash of the
+// preprocessed source, the compiler build and the options that change
+// codegen. Entries are written to a temporary name and renamed into place so
+// a reader never sees half an entry, and a hit touches the entry's mtime so
+// eviction can go oldest first once the cache is over its size limit.
+//
+// Layout: <dir>/xx/<rest of the key>.s for assembly or .o for an object,
+// plus <dir>/stats and <dir>/lock. Lookups and stores take no lock, the
+// stats are brought up to date once per process and every limit/16 bytes
+// stored.
+
+typedef struct {
+  uint64_t low;
+  uint64_t high;
+} CacheKey;
+
+// `salt` is mixed in alongside the build, for options that change output.
+CacheKey HashSource(const char *text, size_t length, uint64_t salt);
+
+// The cached assembly or object for `key` as a malloced buffer, or NULL on a
+// miss. `extension` is 's' or 'o', what the entry holds.
+char *CacheLookup(const char *dir, CacheKey key, char extension,
+                  size_t *length);
+void CacheStore(const char *dir, size_t limit, CacheKey key, char extension,
+                const char *text, size_t length);
+
+// The directory used when none is given, NULL if there is no home to put it.
+const char *DefaultCacheDir(void);
+void PrintCacheStats(const char *dir);
+
+#endif //BCC_SRC_CACHE_H
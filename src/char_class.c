@@ -0,0 +1,326 @@
+#include "char_class.h"
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SCAN_NEON 1
+#endif
+
+const uint8_t char_class[256] = {
+    ['\0'] = CC_BREAK,
+    ['\t'] = CC_SPACE | CC_BREAK,
+    ['\n'] = CC_SPACE | CC_BREAK,
+    ['\v'] = CC_SPACE | CC_BREAK,
+    ['\f'] = CC_SPACE | CC_BREAK,
+    ['\r'] = CC_SPACE | CC_BREAK,
+    [' '] = CC_SPACE | CC_BREAK,
+    ['a' ... 'z'] = CC_ALPHA,
+    ['A' ... 'Z'] = CC_ALPHA,
+    ['0' ... '9'] = CC_DIGIT,
+    ['{'] = CC_BREAK, ['}'] = CC_BREAK, ['('] = CC_BREAK,
+    [')'] = CC_BREAK, [';'] = CC_BREAK, ['~'] = CC_BREAK,
+    ['-'] = CC_BREAK, ['+'] = CC_BREAK, ['*'] = CC_BREAK,
+    ['|'] = CC_BREAK, ['^'] = CC_BREAK, ['&'] = CC_BREAK,
+    ['<'] = CC_BREAK, ['>'] = CC_BREAK, ['='] = CC_BREAK,
+    ['/'] = CC_BREAK | CC_PP, ['%'] = CC_BREAK | CC_PP,
+    ['#'] = CC_PP, ['\\'] = CC_PP, ['_'] = CC_PP,
+};
+
+static const char *ScanScalar(const char *p, const char *end, uint8_t cls) {
+  while (p < end && IsClass(*p, cls)) {
+    p++;
+  }
+  return p;
+}
+
+static const char *SkipSpaceScalar(const char *p, const char *end) {
+  return ScanScalar(p, end, CC_SPACE);
+}
+
+static const char *SkipAlphaScalar(const char *p, const char *end) {
+  return ScanScalar(p, end, CC_ALPHA);
+}
+
+static const char *SkipDigitsScalar(const char *p, const char *end) {
+  return ScanScalar(p, end, CC_DIGIT);
+}
+
+// The vector tests below all use the same trick, shift the range we want down
+// to start at zero and check x == min(x, top) for an unsigned x <= top.
+
+#ifdef SCAN_X86
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+// '\t'..'\r' or ' '.
+static inline SSE2 __m128i SpaceSse2(__m128i v) {
+  __m128i ctl = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+  __m128i is_ctl = _mm_cmpeq_epi8(_mm_min_epu8(ctl, _mm_set1_epi8(4)), ctl);
+  return _mm_or_si128(is_ctl, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+}
+
+// folding to lower case first makes this one range.
+static inline SSE2 __m128i AlphaSse2(__m128i v) {
+  __m128i x = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)),
+                           _mm_set1_epi8('a'));
+  return _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(25)), x);
+}
+
+static inline SSE2 __m128i DigitSse2(__m128i v) {
+  __m128i x = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+  return _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(9)), x);
+}
+
+// Returns the offset of the first byte not in the class, or 16.
+#define RUN_SSE2(test, p) \
+  __builtin_ctz(~_mm_movemask_epi8(test(_mm_loadu_si128((const __m128i *) (p)))) | 0x10000)
+
+static SSE2 const char *SkipSpaceSse2(const char *p, const char *end) {
+  while (end - p >= 16) {
+    unsigned n = RUN_SSE2(SpaceSse2, p);
+    p += n;
+    if (n < 16) {
+      return p;
+    }
+  }
+  return ScanScalar(p, end, CC_SPACE);
+}
+
+static SSE2 const char *SkipAlphaSse2(const char *p, const char *end) {
+  while (end - p >= 16) {
+    unsigned n = RUN_SSE2(AlphaSse2, p);
+    p += n;
+    if (n < 16) {
+      return p;
+    }
+  }
+  return ScanScalar(p, end, CC_ALPHA);
+}
+
+static SSE2 const char *SkipDigitsSse2(const char *p, const char *end) {
+  while (end - p >= 16) {
+    unsigned n = RUN_SSE2(DigitSse2, p);
+    p += n;
+    if (n < 16) {
+      return p;
+    }
+  }
+  return ScanScalar(p, end, CC_DIGIT);
+}
+
+static inline AVX2 __m256i SpaceAvx2(__m256i v) {
+  __m256i ctl = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+  __m256i is_ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, _mm256_set1_epi8(4)), ctl);
+  return _mm256_or_si256(is_ctl, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+}
+
+static inline AVX2 __m256i AlphaAvx2(__m256i v) {
+  __m256i x = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)),
+                              _mm256_set1_epi8('a'));
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(25)), x);
+}
+
+static inline AVX2 __m256i DigitAvx2(__m256i v) {
+  __m256i x = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(9)), x);
+}
+
+// Returns the offset of the first byte not in the class, or 32.
+#define RUN_AVX2(test, p) \
+  (unsigned) __builtin_ctzll( \
+      (uint32_t) ~_mm256_movemask_epi8(test(_mm256_loadu_si256((const __m256i *) (p)))) | \
+      (1ull << 32))
+
+// Most runs are short, so a 32 byte load is only worth it with room for one,
+// anything shorter goes through the 16 byte version.
+static AVX2 const char *SkipSpaceAvx2(const char *p, const char *end) {
+  while (end - p >= 32) {
+    unsigned n = RUN_AVX2(SpaceAvx2, p);
+    p += n;
+    if (n < 32) {
+      return p;
+    }
+  }
+  return SkipSpaceSse2(p, end);
+}
+
+static AVX2 const char *SkipAlphaAvx2(const char *p, const char *end) {
+  while (end - p >= 32) {
+    unsigned n = RUN_AVX2(AlphaAvx2, p);
+    p += n;
+    if (n < 32) {
+      return p;
+    }
+  }
+  return SkipAlphaSse2(p, end);
+}
+
+static AVX2 const char *SkipDigitsAvx2(const char *p, const char *end) {
+  while (end - p >= 32) {
+    unsigned n = RUN_AVX2(DigitAvx2, p);
+    p += n;
+    if (n < 32) {
+      return p;
+    }
+  }
+  return SkipDigitsSse2(p, end);
+}
+
+#endif
+
+#ifdef SCAN_NEON
+
+static inline uint8x16_t SpaceNeon(uint8x16_t v) {
+  uint8x16_t ctl = vsubq_u8(v, vdupq_n_u8('\t'));
+  return vorrq_u8(vcleq_u8(ctl, vdupq_n_u8(4)), vceqq_u8(v, vdupq_n_u8(' ')));
+}
+
+static inline uint8x16_t AlphaNeon(uint8x16_t v) {
+  uint8x16_t x = vsubq_u8(vorrq_u8(v, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+  return vcleq_u8(x, vdupq_n_u8(25));
+}
+
+static inline uint8x16_t DigitNeon(uint8x16_t v) {
+  return vcleq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8(9));
+}
+
+// There is no movemask, narrowing by 4 leaves a nibble per byte instead.
+static inline unsigned FirstMissNeon(uint8x16_t match) {
+  uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(match), 4);
+  uint64_t miss = ~vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+  return miss == 0 ? 16 : __builtin_ctzll(miss) >> 2;
+}
+
+static const char *SkipSpaceNeon(const char *p, const char *end) {
+  while (end - p >= 16) {
+    unsigned n = FirstMissNeon(SpaceNeon(vld1q_u8((const uint8_t *) p)));
+    p += n;
+    if (n < 16) {
+      return p;
+    }
+  }
+  return ScanScalar(p, end, CC_SPACE);
+}
+
+static const char *SkipAlphaNeon(const char *p, const char *end) {
+  while (end - p >= 16) {
+    unsigned n = FirstMissNeon(AlphaNeon(vld1q_u8((const uint8_t *) p)));
+    p += n;
+    if (n < 16) {
+      return p;
+    }
+  }
+  return ScanScalar(p, end, CC_ALPHA);
+}
+
+static const char *SkipDigitsNeon(const char *p, const char *end) {
+  while (end - p >= 16) {
+    unsigned n = FirstMissNeon(DigitNeon(vld1q_u8((const uint8_t *) p)));
+    p += n;
+    if (n < 16) {
+      return p;
+    }
+  }
+  return ScanScalar(p, end, CC_DIGIT);
+}
+
+#endif
+
+typedef const char *(*ScanFn)(const char *p, const char *end);
+
+typedef struct {
+  const char *name;
+  ScanFn space;
+  ScanFn alpha;
+  ScanFn digits;
+} Scanner;
+
+static const Scanner scalar_scanner = {
+    "scalar", SkipSpaceScalar, SkipAlphaScalar, SkipDigitsScalar};
+#ifdef SCAN_X86
+static const Scanner avx2_scanner = {
+    "avx2", SkipSpaceAvx2, SkipAlphaAvx2, SkipDigitsAvx2};
+static const Scanner sse2_scanner = {
+    "sse2", SkipSpaceSse2, SkipAlphaSse2, SkipDigitsSse2};
+#endif
+#ifdef SCAN_NEON
+static const Scanner neon_scanner = {
+    "neon", SkipSpaceNeon, SkipAlphaNeon, SkipDigitsNeon};
+#endif
+
+static const Scanner *scanner;
+
+static bool Supported(const Scanner *s) {
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (s == &avx2_scanner) {
+    return __builtin_cpu_supports("avx2");
+  }
+  if (s == &sse2_scanner) {
+    return __builtin_cpu_supports("sse2");
+  }
+#endif
+  return true;
+}
+
+// Best first.
+static const Scanner *const scanners[] = {
+#ifdef SCAN_X86
+    &avx2_scanner, &sse2_scanner,
+#endif
+#ifdef SCAN_NEON
+    &neon_scanner,
+#endif
+    &scalar_scanner,
+};
+
+// Picked on first use. Racing threads all pick the same one, so there is no
+// need to lock.
+static const Scanner *SelectScanner(void) {
+  for (size_t i = 0; i < sizeof(scanners) / sizeof(scanners[0]); ++i) {
+    if (Supported(scanners[i])) {
+      return scanners[i];
+    }
+  }
+  return &scalar_scanner;
+}
+
+static inline const Scanner *GetScanner(void) {
+  const Scanner *s = __atomic_load_n(&scanner, __ATOMIC_RELAXED);
+  if (s == NULL) {
+    s = SelectScanner();
+    __atomic_store_n(&scanner, s, __ATOMIC_RELAXED);
+  }
+  return s;
+}
+
+const char *SkipSpaceRun(const char *p, const char *end) {
+  return GetScanner()->space(p, end);
+}
+
+const char *SkipAlphaRun(const char *p, const char *end) {
+  return GetScanner()->alpha(p, end);
+}
+
+const char *SkipDigitsRun(const char *p, const char *end) {
+  return GetScanner()->digits(p, end);
+}
+
+const char *ScannerName(void) {
+  return GetScanner()->name;
+}
+
+bool UseScanner(const char *name) {
+  for (size_t i = 0; i < sizeof(scanners) / sizeof(scanners[0]); ++i) {
+    if (strcmp(scanners[i]->name, name) == 0 && Supported(scanners[i])) {
+      __atomic_store_n(&scanner, scanners[i], __ATOMIC_RELAXED);
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,54 @@
+#ifndef BCC_SRC_CHAR_CLASS_H
+#define BCC_SRC_CHAR_CLASS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Bits in char_class, a byte can be in more than one class.
+#define CC_SPACE 1
+#define CC_ALPHA 2
+#define CC_DIGIT 4
+// ends a word: whitespace, NUL or one of the single character operators.
+#define CC_BREAK 8
+// might start something only the preprocessor understands, see
+// NeedsPreprocessing.
+#define CC_PP 16
+
+extern const uint8_t char_class[256];
+
+static inline bool IsClass(char c, uint8_t cls) {
+  return (char_class[(unsigned char) c] & cls) != 0;
+}
+
+// Wide versions of the Skip functions below, picked for the CPU at runtime.
+const char *SkipSpaceRun(const char *p, const char *end);
+const char *SkipAlphaRun(const char *p, const char *end);
+const char *SkipDigitsRun(const char *p, const char *end);
+
+// Runs shorter than this are walked a byte at a time, most tokens and most
+// gaps between them are only a few bytes long and a vector load won't pay.
+#define SHORT_RUN 4
+
+// Each of these returns the first byte in [p, end) outside the class, or end
+// if the whole range is in it. They never read at or past end.
+#define SKIP_CLASS(name, cls)                                 \
+  static inline const char *Skip##name(const char *p, const char *end) { \
+    for (int i = 0; i < SHORT_RUN; ++i, ++p) {                \
+      if (p == end || !IsClass(*p, cls)) {                    \
+        return p;                                             \
+      }                                                       \
+    }                                                         \
+    return Skip##name##Run(p, end);                           \
+  }
+
+SKIP_CLASS(Space, CC_SPACE)
+SKIP_CLASS(Alpha, CC_ALPHA)
+SKIP_CLASS(Digits, CC_DIGIT)
+
+// Name of the scanner picked for this CPU, "avx2", "sse2", "neon" or "scalar".
+const char *ScannerName(void);
+// Switches to the named scanner, for benchmarks. False if it isn't built in
+// or this CPU can't run it.
+bool UseScanner(const char *name);
+
+#endif //BCC_SRC_CHAR_CLASS_H
@@ -2,24 +2,31 @@
 #include "codegen.h"
 #include "parser.h"
 #include "arena.h"
+#include "pool.h"
+#include "diagnostics.h"
 
 #define ASM_PADDING 4
 #define VAR_SIZE 8
 
-void AppendArmBinary(Arena* arena, ArmFunction* af, TackyInstruction ti);
+void AppendArmBinary(Pool* pool, ArmFunction* af, TackyInstruction ti);
 
-void AllocInstr(Arena* arena, ArmFunction* arm_func) {
-  if (arm_func->instructions == NULL) {
-    arm_func->instructions = arena_alloc(arena, sizeof(Instruction));
+// Makes room for `num` more instructions, growing the array geometrically.
+void AllocNumInstr(Pool* pool, ArmFunction* af, int num) {
+  if (af->length + num <= af->capacity) {
     return;
   }
-  arena_alloc(arena, sizeof(Instruction));
+  int capacity = af->capacity == 0 ? 16 : af->capacity * 2;
+  while (capacity < af->length + num) {
+    capacity *= 2;
+  }
+  af->instructions = pool_realloc(pool, af->instructions,
+                                   sizeof(Instruction) * af->capacity,
+                                   sizeof(Instruction) * capacity);
+  af->capacity = capacity;
 }
 
-void AllocNumInstr(Arena* arena, ArmFunction* af, int num) {
-  for (int i = 0; i < num; i++) {
-    AllocInstr(arena, af);
-  }
+void AllocInstr(Pool* pool, ArmFunction* arm_func) {
+  AllocNumInstr(pool, arm_func, 1);
 }
 
 Operand TackyValToArmVal(TackyVal val) {
@@ -31,7 +38,7 @@ Operand TackyValToArmVal(TackyVal val) {
       break;
     case TACKY_VAR:
       op.type = PSEUDO;
-      strcpy(op.identifier, val.identifier);
+      op.identifier = val.identifier;
       break;
   }
   return op;
@@ -51,8 +58,8 @@ BinaryOperator ToArmBinaryOp(TackyBinaryOp op) {
     case TACKY_DIVIDE:
       return A_DIVIDE;
     case TACKY_REMAINDER:
-      fprintf(stderr, "Unexpected binary op, remainder found");
-      exit(2);
+      fprintf(Diagnostics(), "Unexpected binary op, remainder found");
+      Fail();
     case TACKY_MULTIPLY:
       return A_MULTIPLY;
     case TACKY_SUBTRACT:
@@ -79,12 +86,12 @@ BinaryOperator ToArmBinaryOp(TackyBinaryOp op) {
     case TACKY_NOT_EQUAL:
       return A_CMP;
     default:
-      fprintf(stderr, "unexpected binary op\n");
-      exit(2);
+      fprintf(Diagnostics(), "unexpected binary op\n");
+      Fail();
   }
 }
 
-void AppendArmUnary(Arena* arena, ArmFunction* af, TackyInstruction ti) {
+void AppendArmUnary(Pool* pool, ArmFunction* af, TackyInstruction ti) {
   // somewhat hacky workaround for ARM missing a logical not instruction
   if (ti.unary.op == TACKY_L_NOT) {
     TackyUnary tu = ti.unary;
@@ -95,12 +102,10 @@ void AppendArmUnary(Arena* arena, ArmFunction* af, TackyInstruction ti) {
         .right = tu.src,
         .dst = tu.dst,
     };
-    AppendArmBinary(arena, af, ti);
+    AppendArmBinary(pool, af, ti);
     return;
   }
-  AllocInstr(arena, af);
-  AllocInstr(arena, af);
-  AllocInstr(arena, af);
+  AllocNumInstr(pool, af, 3);
   Mov mov;
   mov.src = TackyValToArmVal(ti.unary.src);
   mov.dst = (Operand) {.type = REGISTER, .reg = W11};
@@ -124,8 +129,8 @@ void AppendArmUnary(Arena* arena, ArmFunction* af, TackyInstruction ti) {
   };
 }
 
-void AppendArmRemainder(Arena* arena, ArmFunction* af, TackyInstruction ti) {
-  AllocNumInstr(arena, af, 5);
+void AppendArmRemainder(Pool* pool, ArmFunction* af, TackyInstruction ti) {
+  AllocNumInstr(pool, af, 5);
   Mov mov;
   mov.src = TackyValToArmVal(ti.binary.left);
   mov.dst = (Operand) {
@@ -183,17 +188,17 @@ ArmCC GetArmCC(TackyBinaryOp op) {
     case TACKY_NOT_EQUAL:
       return B_NE;
     default:
-      fprintf(stderr, "Invalid op for GetArmCC");
-      exit(2);
+      fprintf(Diagnostics(), "Invalid op for GetArmCC");
+      Fail();
   }
 }
 
-void AppendArmBinary(Arena* arena, ArmFunction* af, TackyInstruction ti) {
+void AppendArmBinary(Pool* pool, ArmFunction* af, TackyInstruction ti) {
   if (ti.binary.op == TACKY_REMAINDER) {
-    AppendArmRemainder(arena, af, ti);
+    AppendArmRemainder(pool, af, ti);
     return;
   }
-  AllocNumInstr(arena, af, 4);
+  AllocNumInstr(pool, af, 4);
   Mov mov;
   mov.src = TackyValToArmVal(ti.binary.left);
   mov.dst = (Operand) {.type = REGISTER, .reg = W11};
@@ -218,7 +223,7 @@ void AppendArmBinary(Arena* arena, ArmFunction* af, TackyInstruction ti) {
   };
   /* For comparing operations, move results instructions to W12 */
   if (af->instructions[af->length - 1].binary.op == A_CMP) {
-    AllocInstr(arena, af);
+    AllocNumInstr(pool, af, 2);
     af->instructions[af->length++] = (Instruction) {
         .type = SET_CC,
         .set_cc = (SetCC) {
@@ -235,8 +240,8 @@ void AppendArmBinary(Arena* arena, ArmFunction* af, TackyInstruction ti) {
   };
 }
 
-void AppendTackyJmp(Arena* arena, ArmFunction* af, TackyInstruction ti) {
-  AllocInstr(arena, af);
+void AppendTackyJmp(Pool* pool, ArmFunction* af, TackyInstruction ti) {
+  AllocInstr(pool, af);
   Instruction instr = (Instruction) {
       .type = CMP_BRANCH,
   };
@@ -244,7 +249,7 @@ void AppendTackyJmp(Arena* arena, ArmFunction* af, TackyInstruction ti) {
     case TACKY_JMP:
       instr.type = BRANCH;
       instr.branch.cc = B_NO_CC;
-      strcpy(instr.branch.label, ti.jump_cond.target);
+      instr.branch.label = ti.jump_cond.target;
       af->instructions[af->length++] = instr;
       return;
     case TACKY_JMP_Z:
@@ -254,7 +259,7 @@ void AppendTackyJmp(Arena* arena, ArmFunction* af, TackyInstruction ti) {
           },
           .reg = W13,
       };
-      strcpy(instr.cmp_branch.branch.label, ti.jump_cond.target);
+      instr.cmp_branch.branch.label = ti.jump_cond.target;
       break;
     case TACKY_JMP_NZ:
       instr.cmp_branch = (CompareBranch) {
@@ -263,14 +268,14 @@ void AppendTackyJmp(Arena* arena, ArmFunction* af, TackyInstruction ti) {
           },
           .reg = W13,
       };
-      strcpy(instr.cmp_branch.branch.label, ti.jump_cond.target);
+      instr.cmp_branch.branch.label = ti.jump_cond.target;
       break;
     default:
-      fprintf(stderr, "unexpected jmp operation\n");
-      exit(2);
+      fprintf(Diagnostics(), "unexpected jmp operation\n");
+      Fail();
   }
   // for conditional jumps alloc an additional instruction.
-  AllocInstr(arena, af);
+  AllocNumInstr(pool, af, 2);
   // notably we throw the cmp val into a work register.
   af->instructions[af->length++] = (Instruction) {
       .type = MOV,
@@ -285,8 +290,8 @@ void AppendTackyJmp(Arena* arena, ArmFunction* af, TackyInstruction ti) {
   af->instructions[af->length++] = instr;
 }
 
-void AppendTackyCopy(Arena* arena, ArmFunction* af, TackyCopy copy) {
-  AllocNumInstr(arena, af, 2);
+void AppendTackyCopy(Pool* pool, ArmFunction* af, TackyCopy copy) {
+  AllocNumInstr(pool, af, 2);
   // have to write to a temp register first to ensure we write to
   // stack correctly.
   af->instructions[af->length++] = (Instruction) {
@@ -309,20 +314,19 @@ void AppendTackyCopy(Arena* arena, ArmFunction* af, TackyCopy copy) {
   };
 }
 
-void AppendTackyLabel(Arena* arena, ArmFunction* af, labelStr label) {
-  AllocInstr(arena, af);
+void AppendTackyLabel(Pool* pool, ArmFunction* af, Symbol label) {
+  AllocInstr(pool, af);
   Instruction i = (Instruction) {
       .type = LABEL,
   };
-  strcpy(i.label.identifier, label);
+  i.label.identifier = label;
   af->instructions[af->length++] = i;
 }
 
-void AppendArmInstruction(Arena* arena, ArmFunction* arm_func, TackyInstruction t_instr) {
+void AppendArmInstruction(Pool* pool, ArmFunction* arm_func, TackyInstruction t_instr) {
   switch (t_instr.type) {
     case TACKY_RETURN: {
-      AllocInstr(arena, arm_func);
-      AllocInstr(arena, arm_func);
+      AllocNumInstr(pool, arm_func, 2);
       Mov mov;
       mov.src = TackyValToArmVal(t_instr.return_val);
       mov.dst = (Operand) {.type = REGISTER, .reg = W0};
@@ -336,74 +340,75 @@ void AppendArmInstruction(Arena* arena, ArmFunction* arm_func, TackyInstruction
       return;
     }
     case TACKY_UNARY:
-      AppendArmUnary(arena, arm_func, t_instr);
+      AppendArmUnary(pool, arm_func, t_instr);
       return;
     case TACKY_BINARY:
-      AppendArmBinary(arena, arm_func, t_instr);
+      AppendArmBinary(pool, arm_func, t_instr);
       return;
     case TACKY_COPY:
-      AppendTackyCopy(arena, arm_func, t_instr.copy);
+      AppendTackyCopy(pool, arm_func, t_instr.copy);
       return;
     case TACKY_JMP_Z:
     case TACKY_JMP_NZ:
     case TACKY_JMP:
-      AppendTackyJmp(arena, arm_func, t_instr);
+      AppendTackyJmp(pool, arm_func, t_instr);
       return;
     case TACKY_LABEL:
-      AppendTackyLabel(arena, arm_func, t_instr.label);
+      AppendTackyLabel(pool, arm_func, t_instr.label);
       return;
     default:
-      fprintf(stderr, "unexpected tacky instruction conversion to ARM");
-      exit(2);
+      fprintf(Diagnostics(), "unexpected tacky instruction conversion to ARM");
+      Fail();
   }
 }
 
-void ToArmFunctionFromTacky(Arena* arena, TackyProgram* tacky_program,
+void ToArmFunctionFromTacky(Pool* pool, TackyProgram* tacky_program,
                             ArmProgram* arm_program) {
-  arm_program->function_def = arena_alloc(arena, sizeof(ArmFunction));
-  arm_program->function_def->name = tacky_program->function_def->identifier;
+  arm_program->function_def = arena_alloc(pool->arena, sizeof(ArmFunction));
+  *arm_program->function_def = (ArmFunction) {
+      .name = tacky_program->function_def->identifier,
+  };
   for (int i = 0; i < tacky_program->function_def->instr_length; ++i) {
-    AppendArmInstruction(arena, arm_program->function_def,
+    AppendArmInstruction(pool, arm_program->function_def,
                          tacky_program->function_def->instructions[i]);
   }
 }
 
-ArmProgram* TranslateTacky(Arena* arena, TackyProgram* tacky_program) {
-  ArmProgram* arm_program = arena_alloc(arena, sizeof(ArmProgram));
-  ToArmFunctionFromTacky(arena, tacky_program, arm_program);
+ArmProgram* TranslateTacky(Pool* pool, TackyProgram* tacky_program) {
+  ArmProgram* arm_program = arena_alloc(pool->arena, sizeof(ArmProgram));
+  arm_program->symbols = tacky_program->symbols;
+  ToArmFunctionFromTacky(pool, tacky_program, arm_program);
   return arm_program;
 }
 
-int GetVarNum(Arena* scratch, char** identifiers, int* size, char* match) {
-  for (int i = 0; i < *size; ++i) {
-    if (strcmp(identifiers[i], match) == 0) {
-      return i;
-    }
+// Stack slots are handed out in order of first use. `slots` is indexed by
+// symbol and holds the slot + 1, zero meaning not yet assigned.
+int GetVarNum(int* slots, int* size, Symbol match) {
+  if (slots[match] == 0) {
+    slots[match] = ++(*size);
   }
-  if (*size == 100) {
-    fprintf(stderr, "too many variables in a function");
-    exit(2);
-  }
-  char* copy = arena_alloc(scratch, sizeof(char) * strlen(match) + 1);
-  identifiers[(*size)++] = strcpy(copy, match);
-  return *size - 1;
+  return slots[match] - 1;
 }
 
+// Everything allocated in `scratch` here is rewound before returning.
 void ReplacePseudoRegisters(Arena* scratch, ArmProgram* program) {
-  char** identifiers = arena_alloc(scratch, sizeof(char*) * 100);
+  ArenaMark mark = arena_mark(scratch);
+  size_t num_symbols = SymbolCount(program->symbols);
+  int* slots = arena_alloc(scratch, sizeof(int) * num_symbols);
+  memset(slots, 0, sizeof(int) * num_symbols);
   int size = 0;
   for (int i = 0; i < program->function_def->length; ++i) {
     Instruction* instruction = program->function_def->instructions + i;
     if (instruction->type == MOV) {
       if (instruction->mov.src.type == PSEUDO) {
-        int pos = GetVarNum(scratch, identifiers, &size, instruction->mov.src.identifier);
+        int pos = GetVarNum(slots, &size, instruction->mov.src.identifier);
         instruction->mov.src = (Operand) {
             .type = STACK,
             .stack_location = pos
         };
       }
       if (instruction->mov.dst.type == PSEUDO) {
-        int pos = GetVarNum(scratch, identifiers, &size, instruction->mov.dst.identifier);
+        int pos = GetVarNum(slots, &size, instruction->mov.dst.identifier);
         instruction->mov.dst = (Operand) {
             .type = STACK,
             .stack_location =  pos
@@ -411,6 +416,7 @@ void ReplacePseudoRegisters(Arena* scratch, ArmProgram* program) {
       }
     }
   }
+  arena_rewind(scratch, mark);
 }
 
 int max(int a, int b) {
@@ -422,11 +428,22 @@ int max(int a, int b) {
 
 // Since you cannot mov between to stack addresses, use a scratch register as an
 // intermediary. Also add the instruction to allocate stack and deallocate stack.
-void UpdateInstructions(Arena* arena, ArmFunction* func) {
-  Instruction* next_list_instr = arena_alloc(arena, sizeof(Instruction) * (func->length + 2));
+void UpdateInstructions(Pool* pool, ArmFunction* func) {
+  // every stack to stack mov turns into a STR and LDR pair.
+  int stack_movs = 0;
+  for (int i = 0; i < func->length; ++i) {
+    Instruction* instr = func->instructions + i;
+    if (instr->type == MOV && instr->mov.src.type == STACK &&
+        instr->mov.dst.type == STACK) {
+      ++stack_movs;
+    }
+  }
+  int capacity = func->length + stack_movs + 2;
+  Instruction* next_list_instr = pool_alloc(pool, sizeof(Instruction) * capacity);
   int pos = 1;
   int largest_stack = 0;
-  for (int i = 0; i < func->length - 1; ++i) {
+  int length = func->length;
+  for (int i = 0; i < length - 1; ++i) {
     Instruction next = func->instructions[i];
     if (next.type == MOV && next.mov.src.type == STACK && next.mov.dst.type == STACK) {
       next.type = STR;
@@ -443,7 +460,6 @@ void UpdateInstructions(Arena* arena, ArmFunction* func) {
       };
       next_list_instr[pos++] = next;
       next_list_instr[pos++] = after;
-      arena_alloc(arena, sizeof(Instruction));
       ++func->length;
       largest_stack = max(next.mov.src.stack_location, largest_stack);
       largest_stack = max(after.mov.dst.stack_location, largest_stack);
@@ -467,12 +483,14 @@ void UpdateInstructions(Arena* arena, ArmFunction* func) {
       .type = DEALLOC_STACK, .alloc_stack = (AllocStack) {.size = largest_stack}
   };
   next_list_instr[pos] = (Instruction) {.type = RET};
+  pool_free(pool, func->instructions, sizeof(Instruction) * func->capacity);
   func->instructions = next_list_instr;
   func->length += 2;
+  func->capacity = capacity;
 }
 
-void InstructionFixUp(Arena* arena, ArmProgram* arm_program) {
-  UpdateInstructions(arena, arm_program->function_def);
+void InstructionFixUp(Pool* pool, ArmProgram* arm_program) {
+  UpdateInstructions(pool, arm_program->function_def);
 }
 
 char* GetRegisterStr(Register reg) {
@@ -488,52 +506,11 @@ char* GetRegisterStr(Register reg) {
     case W10:
       return "W10";
     default:
-      fprintf(stderr, "unexpected register?, crashing \n");
-      exit(2);
-  }
-}
-
-void WriteRegister(Register reg, FILE* asm_f) {
-  switch (reg) {
-    case W0:
-      fprintf(asm_f, "W0");
-      return;
-    case W11:
-      fprintf(asm_f, "W11");
-      return;
-    case W12:
-      fprintf(asm_f, "W12");
-      return;
-    case W13:
-      fprintf(asm_f, "W13");
-      return;
-    case W10:
-      fprintf(asm_f, "W10");
-      return;
+      fprintf(Diagnostics(), "unexpected register?, crashing \n");
+      Fail();
   }
 }
 
-void WriteOperand(Operand op, FILE* asm_f) {
-  switch (op.type) {
-    case REGISTER:
-      WriteRegister(op.reg, asm_f);
-      return;
-    case IMM:
-      fprintf(asm_f, "#%d", op.imm);
-      return;
-    case STACK:
-      fprintf(asm_f, "[sp, #%d]", op.stack_location * 4);
-      return;
-  }
-}
-
-void WriteTwoOperands(Operand src, Operand dst, FILE* f) {
-  WriteOperand(dst, f);
-  fprintf(f, ",    ");
-  WriteOperand(src, f);
-  fprintf(f, "\n");
-}
-
 int RoundStackSize(int size) {
   if (size % 2 == 1) {
     ++size;
@@ -541,6 +518,14 @@ int RoundStackSize(int size) {
   return size;
 }
 
+int StackFrameSize(int size) {
+  return RoundStackSize(size) * VAR_SIZE;
+}
+
+int StackSlotOffset(int stack_location) {
+  return stack_location * 4;
+}
+
 char* ToUnaryOpStr(UnaryOperator op) {
   switch (op) {
     case NEG:
@@ -550,11 +535,6 @@ char* ToUnaryOpStr(UnaryOperator op) {
   }
 }
 
-void WriteUnary(ArmUnary unary, FILE* asm_f) {
-  fprintf(asm_f, "%*s%s  %s,  %s", ASM_PADDING, "", ToUnaryOpStr(unary.op),
-          GetRegisterStr(unary.reg), GetRegisterStr(unary.reg));
-}
-
 char* ToBinaryOpStr(BinaryOperator op) {
   switch (op) {
     case A_ADD:
@@ -578,28 +558,9 @@ char* ToBinaryOpStr(BinaryOperator op) {
     case A_CMP:
       return "CMP";
     default:
-      fprintf(stderr, "unexpected arm binary op\n");
-      exit(2);
-  }
-}
-
-void WriteBinary(ArmBinary binary, FILE* asm_f) {
-  char cmp_reg[20];
-  // no destination needed for CMP, so only add the destination
-  // for non-CMP operations.
-  if (binary.op != A_CMP) {
-    strncpy(cmp_reg, GetRegisterStr(binary.dst), 16);
-    strcat(cmp_reg, ",  ");
+      fprintf(Diagnostics(), "unexpected arm binary op\n");
+      Fail();
   }
-  fprintf(asm_f, "%*s%s  %s%s,  %s", ASM_PADDING, "",
-          ToBinaryOpStr(binary.op), cmp_reg, GetRegisterStr(binary.left),
-          GetRegisterStr(binary.right));
-}
-
-void WriteMsub(ArmMsub msub, FILE* asm_f) {
-  fprintf(asm_f, "%*sMSUB  %s,  %s,  %s,  %s", ASM_PADDING, "",
-          GetRegisterStr(msub.dst), GetRegisterStr(msub.right),
-          GetRegisterStr(msub.m), GetRegisterStr(msub.left));
 }
 
 char* GetCcStr(ArmCC cc) {
@@ -623,23 +584,9 @@ char* GetCcStr(ArmCC cc) {
     case B_NO_CC:
       return "";
     default:
-      fprintf(stderr, "unexpected CC, can't translate\n");
-      exit(2);
-  }
-}
-
-void WriteArmSetCC(FILE* asm_f, SetCC set_cc) {
-  fprintf(asm_f, "%*sCSET %s, %s\n", ASM_PADDING, "",
-          GetRegisterStr(set_cc.reg), GetCcStr(set_cc.cc));
-}
-
-void WriteArmBranch(FILE* asm_f, Branch branch) {
-  if (branch.cc == B_NO_CC) {
-    fprintf(asm_f, "%*sB _%s\n", ASM_PADDING, "", branch.label);
-    return;
+      fprintf(Diagnostics(), "unexpected CC, can't translate\n");
+      Fail();
   }
-  fprintf(asm_f, "%*sB.%s _%s\n", ASM_PADDING, "",
-          GetCcStr(branch.cc), branch.label);
 }
 
 char* GetBranchCcStr(ArmCC arm_cc) {
@@ -649,88 +596,277 @@ char* GetBranchCcStr(ArmCC arm_cc) {
     case B_NZ:
       return "NZ";
   }
-  fprintf(stderr, "Invalid Branch Condition code\n");
-  exit(2);
+  fprintf(Diagnostics(), "Invalid Branch Condition code\n");
+  Fail();
+}
+
+// Assembly text is built up in one large buffer and handed on in big pieces,
+// either to a stream or as one block of memory, rather than a few bytes at a
+// time through stdio.
+typedef struct {
+  char* data;
+  size_t length;
+  size_t capacity;
+  // flushed to when full, NULL to keep growing in memory instead.
+  FILE* out;
+} TextBuffer;
+
+#define TEXT_CHUNK ((size_t) 1 << 16)
+
+static void Flush(TextBuffer* buf) {
+  if (buf->out != NULL && buf->length != 0) {
+    fwrite(buf->data, 1, buf->length, buf->out);
+    buf->length = 0;
+  }
 }
 
-void WriteCmpBranch(FILE* asm_f, CompareBranch c_branch) {
-  fprintf(asm_f, "%*sCB%s  %s, _%s \n",
-          ASM_PADDING, "",
-          GetBranchCcStr(c_branch.branch.cc),
-          GetRegisterStr(c_branch.reg), c_branch.branch.label);
+static void Reserve(TextBuffer* buf, size_t size) {
+  if (buf->length + size <= buf->capacity) {
+    return;
+  }
+  if (buf->out != NULL && size <= buf->capacity) {
+    Flush(buf);
+    return;
+  }
+  size_t capacity = buf->capacity * 2;
+  while (capacity < buf->length + size) {
+    capacity *= 2;
+  }
+  buf->data = realloc(buf->data, capacity);
+  if (buf->data == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  buf->capacity = capacity;
+}
+
+static inline void PutBytes(TextBuffer* buf, const char* bytes, size_t length) {
+  Reserve(buf, length);
+  memcpy(buf->data + buf->length, bytes, length);
+  buf->length += length;
+}
+
+#define PutLiteral(buf, literal) PutBytes(buf, literal, sizeof(literal) - 1)
+
+static inline void PutString(TextBuffer* buf, const char* str) {
+  PutBytes(buf, str, strlen(str));
+}
+
+static void PutInt(TextBuffer* buf, int value) {
+  char digits[12];
+  int pos = sizeof(digits);
+  unsigned magnitude = value < 0 ? 0u - (unsigned) value : (unsigned) value;
+  do {
+    digits[--pos] = (char) ('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (value < 0) {
+    digits[--pos] = '-';
+  }
+  PutBytes(buf, digits + pos, sizeof(digits) - pos);
+}
+
+static void PutRegister(TextBuffer* buf, Register reg) {
+  switch (reg) {
+    case W0:
+      PutLiteral(buf, "W0");
+      return;
+    case W10:
+      PutLiteral(buf, "W10");
+      return;
+    case W11:
+      PutLiteral(buf, "W11");
+      return;
+    case W12:
+      PutLiteral(buf, "W12");
+      return;
+    case W13:
+      PutLiteral(buf, "W13");
+      return;
+  }
+}
+
+static void PutSymbol(TextBuffer* buf, const Interner* symbols, Symbol symbol) {
+  PutBytes(buf, SymbolText(symbols, symbol), SymbolLength(symbols, symbol));
+}
+
+void WriteOperand(TextBuffer* buf, Operand op) {
+  switch (op.type) {
+    case REGISTER:
+      PutRegister(buf, op.reg);
+      return;
+    case IMM:
+      PutLiteral(buf, "#");
+      PutInt(buf, op.imm);
+      return;
+    case STACK:
+      PutLiteral(buf, "[sp, #");
+      PutInt(buf, StackSlotOffset(op.stack_location));
+      PutLiteral(buf, "]");
+      return;
+    default:
+      return;
+  }
+}
+
+void WriteTwoOperands(TextBuffer* buf, Operand src, Operand dst) {
+  WriteOperand(buf, dst);
+  PutLiteral(buf, ",    ");
+  WriteOperand(buf, src);
+  PutLiteral(buf, "\n");
 }
 
-void WriteInstruction(Instruction* instruction, FILE* asm_f) {
+void WriteBinary(TextBuffer* buf, ArmBinary binary) {
+  PutLiteral(buf, "    ");
+  PutString(buf, ToBinaryOpStr(binary.op));
+  PutLiteral(buf, "  ");
+  // no destination needed for CMP, so only add the destination
+  // for non-CMP operations.
+  if (binary.op != A_CMP) {
+    PutString(buf, GetRegisterStr(binary.dst));
+    PutLiteral(buf, ",  ");
+  }
+  PutString(buf, GetRegisterStr(binary.left));
+  PutLiteral(buf, ",  ");
+  PutString(buf, GetRegisterStr(binary.right));
+  PutLiteral(buf, "\n");
+}
+
+void WriteMsub(TextBuffer* buf, ArmMsub msub) {
+  PutLiteral(buf, "    MSUB  ");
+  PutString(buf, GetRegisterStr(msub.dst));
+  PutLiteral(buf, ",  ");
+  PutString(buf, GetRegisterStr(msub.right));
+  PutLiteral(buf, ",  ");
+  PutString(buf, GetRegisterStr(msub.m));
+  PutLiteral(buf, ",  ");
+  PutString(buf, GetRegisterStr(msub.left));
+  PutLiteral(buf, "\n");
+}
+
+void WriteArmBranch(TextBuffer* buf, Branch branch, const Interner* symbols) {
+  if (branch.cc == B_NO_CC) {
+    PutLiteral(buf, "    B _");
+  } else {
+    PutLiteral(buf, "    B.");
+    PutString(buf, GetCcStr(branch.cc));
+    PutLiteral(buf, " _");
+  }
+  PutSymbol(buf, symbols, branch.label);
+  PutLiteral(buf, "\n");
+}
+
+void WriteInstruction(TextBuffer* buf, Instruction* instruction,
+                      const Interner* symbols) {
   switch (instruction->type) {
     case ALLOC_STACK:
-      fprintf(asm_f,
-              "%*sSUB  sp, sp, #%d\n",
-              ASM_PADDING,
-              "",
-              RoundStackSize(instruction->alloc_stack.size) * VAR_SIZE);
+      PutLiteral(buf, "    SUB  sp, sp, #");
+      PutInt(buf, StackFrameSize(instruction->alloc_stack.size));
+      PutLiteral(buf, "\n");
       return;
     case DEALLOC_STACK:
-      fprintf(asm_f,
-              "%*sADD  sp, sp, #%d\n",
-              ASM_PADDING,
-              "",
-              RoundStackSize(instruction->alloc_stack.size) * VAR_SIZE);
+      PutLiteral(buf, "    ADD  sp, sp, #");
+      PutInt(buf, StackFrameSize(instruction->alloc_stack.size));
+      PutLiteral(buf, "\n");
       return;
     case MOV:
-      fprintf(asm_f, "%*sMOV  ", ASM_PADDING, "");
-      WriteTwoOperands(instruction->mov.src, instruction->mov.dst, asm_f);
+      PutLiteral(buf, "    MOV  ");
+      WriteTwoOperands(buf, instruction->mov.src, instruction->mov.dst);
       return;
     case LDR:
-      fprintf(asm_f, "%*sLDR  ", ASM_PADDING, "");
-      WriteTwoOperands(instruction->mov.src, instruction->mov.dst, asm_f);
+      PutLiteral(buf, "    LDR  ");
+      WriteTwoOperands(buf, instruction->mov.src, instruction->mov.dst);
       return;
     case STR:
-      fprintf(asm_f, "%*sSTR  ", ASM_PADDING, "");
-      WriteTwoOperands(instruction->mov.dst, instruction->mov.src, asm_f);
+      PutLiteral(buf, "    STR  ");
+      WriteTwoOperands(buf, instruction->mov.dst, instruction->mov.src);
       return;
     case UNARY:
-      WriteUnary(instruction->unary, asm_f);
-      fprintf(asm_f, "\n");
+      PutLiteral(buf, "    ");
+      PutString(buf, ToUnaryOpStr(instruction->unary.op));
+      PutLiteral(buf, "  ");
+      PutString(buf, GetRegisterStr(instruction->unary.reg));
+      PutLiteral(buf, ",  ");
+      PutString(buf, GetRegisterStr(instruction->unary.reg));
+      PutLiteral(buf, "\n");
       return;
     case BINARY:
-      WriteBinary(instruction->binary, asm_f);
-      fprintf(asm_f, "\n");
+      WriteBinary(buf, instruction->binary);
       return;
     case MSUB:
-      WriteMsub(instruction->msub, asm_f);
-      fprintf(asm_f, "\n");
+      WriteMsub(buf, instruction->msub);
       return;
     case RET:
-      fprintf(asm_f, "%*sRET\n", ASM_PADDING, "");
+      PutLiteral(buf, "    RET\n");
       return;
     case SET_CC:
-      WriteArmSetCC(asm_f, instruction->set_cc);
+      PutLiteral(buf, "    CSET ");
+      PutString(buf, GetRegisterStr(instruction->set_cc.reg));
+      PutLiteral(buf, ", ");
+      PutString(buf, GetCcStr(instruction->set_cc.cc));
+      PutLiteral(buf, "\n");
       return;
     case BRANCH:
-      WriteArmBranch(asm_f, instruction->branch);
+      WriteArmBranch(buf, instruction->branch, symbols);
       return;
     case LABEL:
-      fprintf(asm_f, "_%s:\n", instruction->label.identifier);
+      PutLiteral(buf, "_");
+      PutSymbol(buf, symbols, instruction->label.identifier);
+      PutLiteral(buf, ":\n");
       return;
     case CMP_BRANCH:
-      WriteCmpBranch(asm_f, instruction->cmp_branch);
+      PutLiteral(buf, "    CB");
+      PutString(buf, GetBranchCcStr(instruction->cmp_branch.branch.cc));
+      PutLiteral(buf, "  ");
+      PutString(buf, GetRegisterStr(instruction->cmp_branch.reg));
+      PutLiteral(buf, ", _");
+      PutSymbol(buf, symbols, instruction->cmp_branch.branch.label);
+      PutLiteral(buf, " \n");
       return;
     default:
-      fprintf(stderr, "failed to write instruction, unknown translation\n");
-      exit(2);
+      fprintf(Diagnostics(), "failed to write instruction, unknown translation\n");
+      Fail();
   }
 }
 
-void WriteFunctionDef(ArmFunction* function, FILE* asm_f) {
-  fprintf(asm_f, "        .globl _%s\n", function->name);
-  fprintf(asm_f, "_%s:\n", function->name);
+void WriteFunctionDef(TextBuffer* buf, ArmFunction* function,
+                      const Interner* symbols) {
+  PutLiteral(buf, "        .globl " FUNCTION_PREFIX);
+  PutSymbol(buf, symbols, function->name);
+  PutLiteral(buf, "\n" FUNCTION_PREFIX);
+  PutSymbol(buf, symbols, function->name);
+  PutLiteral(buf, ":\n");
   for (int i = 0; i < function->length; ++i) {
-    WriteInstruction(&function->instructions[i], asm_f);
+    WriteInstruction(buf, &function->instructions[i], symbols);
   }
 }
 
-void WriteArmAssembly(ArmProgram* program, char* s_file) {
-  FILE* asm_f = fopen(s_file, "w");
-  WriteFunctionDef(program->function_def, asm_f);
-  fclose(asm_f);
+static TextBuffer NewTextBuffer(FILE* out) {
+  TextBuffer buf = {
+      .data = malloc(TEXT_CHUNK),
+      .length = 0,
+      .capacity = TEXT_CHUNK,
+      .out = out,
+  };
+  if (buf.data == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  return buf;
+}
+
+void WriteArmAssembly(ArmProgram* program, FILE* out) {
+  TextBuffer buf = NewTextBuffer(out);
+  WriteFunctionDef(&buf, program->function_def, program->symbols);
+  Flush(&buf);
+  free(buf.data);
+}
+
+char* ArmAssemblyText(ArmProgram* program, size_t* length) {
+  TextBuffer buf = NewTextBuffer(NULL);
+  WriteFunctionDef(&buf, program->function_def, program->symbols);
+  Reserve(&buf, 1);
+  buf.data[buf.length] = '\0';
+  *length = buf.length;
+  return buf.data;
 }
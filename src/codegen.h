@@ -13,7 +13,10 @@
 #ifndef BCC_SRC_CODEGEN_H_
 #define BCC_SRC_CODEGEN_H_
 
+#include <stdio.h>
 #include "arena.h"
+#include "intern.h"
+#include "pool.h"
 #include "ir_gen.h"
 #include "parser.h"
 
@@ -59,8 +62,8 @@ typedef struct {
     int imm;
     // stack location within frame
     int stack_location;
-    // variable name, 31 char max as per C lang.
-    char identifier[32];
+    // variable name.
+    Symbol identifier;
     // self explanatory :)
     Register reg;
   };
@@ -126,7 +129,7 @@ typedef enum {
 
 typedef struct {
   ArmCC cc;
-  labelStr label;
+  Symbol label;
 } Branch;
 
 typedef struct {
@@ -140,7 +143,7 @@ typedef struct {
 } SetCC;
 
 typedef struct {
-  labelStr identifier;
+  Symbol identifier;
 } ArmLabel;
 
 typedef struct {
@@ -159,19 +162,36 @@ typedef struct {
 } Instruction;
 
 typedef struct {
-  char* name;
+  Symbol name;
   Instruction* instructions;
   int length;
+  int capacity;
 } ArmFunction;
 
 typedef struct {
   ArmFunction* function_def;
+  Interner* symbols;
 } ArmProgram;
 
-ArmProgram* TranslateTacky(Arena* arena, TackyProgram* tacky_program);
+ArmProgram* TranslateTacky(Pool* pool, TackyProgram* tacky_program);
 void ReplacePseudoRegisters(Arena* scratch, ArmProgram* tacky_program);
-void InstructionFixUp(Arena* arena, ArmProgram* tacky_program);
-void WriteArmAssembly(ArmProgram* program, char* s_file);
+void InstructionFixUp(Pool* pool, ArmProgram* tacky_program);
+// How a C function is named in the assembly: Mach-O puts an underscore in
+// front, ELF doesn't. Objects we encode ourselves are always ELF, see
+// WriteArmObject.
+#ifdef __APPLE__
+#define FUNCTION_PREFIX "_"
+#else
+#define FUNCTION_PREFIX ""
+#endif
+
+void WriteArmAssembly(ArmProgram* program, FILE* out);
+// The same text in one malloced, NUL terminated block.
+char* ArmAssemblyText(ArmProgram* program, size_t* length);
+// Bytes AllocStack and DeallocStack move sp by, and where a stack slot sits
+// above sp.
+int StackFrameSize(int size);
+int StackSlotOffset(int stack_location);
 char* GetCcStr(ArmCC cc);
 char* GetRegisterStr(Register reg);
 char* ToUnaryOpStr(UnaryOperator op);
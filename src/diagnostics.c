@@ -0,0 +1,35 @@
+#include "diagnostics.h"
+
+#include <setjmp.h>
+#include <stdlib.h>
+
+static _Thread_local FILE* stream;
+static _Thread_local jmp_buf* recovery;
+
+FILE* Diagnostics(void) {
+  return stream != NULL ? stream : stderr;
+}
+
+void SetDiagnostics(FILE* out) {
+  stream = out;
+}
+
+void Fail(void) {
+  if (recovery != NULL) {
+    longjmp(*recovery, 1);
+  }
+  exit(2);
+}
+
+bool Attempt(void (*run)(void*), void* arg) {
+  jmp_buf here;
+  jmp_buf* outer = recovery;
+  recovery = &here;
+  if (setjmp(here) != 0) {
+    recovery = outer;
+    return false;
+  }
+  run(arg);
+  recovery = outer;
+  return true;
+}
@@ -0,0 +1,22 @@
+#ifndef BCC_SRC_DIAGNOSTICS_H
+#define BCC_SRC_DIAGNOSTICS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Errors found while compiling are printed to Diagnostics() and end the
+// compile with Fail(). Both are per thread: a batch gives each file its own
+// stream, and a failure only unwinds the compile it happened in.
+
+// stderr unless this thread was given a stream of its own.
+FILE* Diagnostics(void);
+void SetDiagnostics(FILE* out);
+
+// Back to the innermost Attempt on this thread, or exit(2) outside of one.
+_Noreturn void Fail(void);
+
+// Runs `run(arg)`, returning false if it called Fail. Anything it had open
+// is left for the caller to clean up.
+bool Attempt(void (*run)(void*), void* arg);
+
+#endif //BCC_SRC_DIAGNOSTICS_H
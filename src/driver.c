@@ -1,20 +1,40 @@
+#define _GNU_SOURCE
 #include "driver.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <spawn.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "arena.h"
+#include "intern.h"
+#include "ir_file.h"
+#include "pool.h"
 #include "lexer.h"
 #include "parser.h"
 #include "codegen.h"
+#include "encoder.h"
+#include "linker.h"
 #include "pretty_print.h"
+#include "preprocessor.h"
+#include "char_class.h"
+#include "cache.h"
+#include "time_report.h"
+#include "trace.h"
+#include "diagnostics.h"
 
-#define PREPROCESSED_EXTENSION 'i'
-#define ASSEMBLY_EXTENSION 'S'
+#define ASSEMBLY_EXTENSION 's'
+#define OBJECT_EXTENSION 'o'
 
-// 16 pages, will mess with this eventually.
-#define DEFAULT_MEM (4096 * 16)
+// Address space reserved for each arena. Only the pages a compile actually
+// touches are committed, so this can be generous.
+#define ARENA_RESERVE ((size_t) 1 << 30)
 
 void ChangeFileExtension(char *out_file, char extension) {
   while (*out_file != '\0') {
@@ -32,103 +52,787 @@ void RemoveFileExtension(char *out_file) {
   *out_file = '\0';
 }
 
-void Preprocess(char *file_name) {
-  int rc = fork();
-  char *file_name_copy = strdup(file_name);
-  char *outfile = strdup(file_name);
-  // Swap the file `extension type to .i from .c
-  ChangeFileExtension(outfile, PREPROCESSED_EXTENSION);
-  if (rc < 0) {
-    fprintf(stderr, "Failed to preprocess the file");
-    exit(2);
+extern char **environ;
+
+// Starts gcc with `fd` as its `target` descriptor, stdin or stdout.
+// Everything we open is close on exec, so gcc only ever holds what it is
+// given here. Otherwise in a batch one job's gcc would keep another job's
+// pipe open and its reader would never see EOF. gcc's own errors go with
+// the rest of the compile's.
+pid_t SpawnGcc(char **argv, int fd, int target) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fd, target);
+  FILE *errors = Diagnostics();
+  if (errors != stderr) {
+    fflush(errors);
+    posix_spawn_file_actions_adddup2(&actions, fileno(errors), STDERR_FILENO);
   }
-  if (rc == 0) {
-    char *argv[] = {"gcc", "-E", "-P", file_name_copy, "-o", outfile, NULL};
-    execvp("/usr/bin/gcc", argv);
-  } else {
-    wait(&rc);
+  pid_t pid;
+  int rc = posix_spawn(&pid, "/usr/bin/gcc", &actions, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (fd >= 0) {
+    close(fd);
   }
-  free(file_name_copy);
-  free(outfile);
+  if (rc != 0) {
+    fprintf(Diagnostics(), "Failed to run gcc");
+    Fail();
+  }
+  return pid;
 }
 
-void CleanTemporaryFiles(char *file_name) {
-  ChangeFileExtension(file_name, PREPROCESSED_EXTENSION);
-  remove(file_name);
-  ChangeFileExtension(file_name, ASSEMBLY_EXTENSION);
-  remove(file_name);
+void WaitForGcc(pid_t pid, const char *what) {
+  int status;
+  pid_t reaped = waitpid(pid, &status, 0);
+  TraceReapEvent(pid);
+  if (reaped < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(Diagnostics(), "Failed to %s the file", what);
+    Fail();
+  }
 }
 
-// Replace with actual compiler implementation eventually
-void InternalCompile(char *file_name, Mode mode) {
-  FILE *fp = fopen(file_name, "r");
-  // Phase 1: Lexing
-  TokenList token_list = Lex(fp);
-  Token last_token = token_list.tokens[token_list.length - 1];
-  if (last_token.type != tEof) {
-    fprintf(stderr, "Failed to compile, got last token type %d and val %s",
-            last_token.type, last_token.value);
-    exit(2);
+// Starts gcc -E on the file and returns the read end of a pipe carrying its
+// output, so the lexer can start on it while gcc is still going.
+int StartPreprocessor(char *file_name, pid_t *pid) {
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    fprintf(Diagnostics(), "Failed to preprocess the file");
+    Fail();
   }
-  if (mode == LEX) {
-    exit(0);
+  char *argv[] = {"gcc", "-E", "-P", file_name, NULL};
+  *pid = SpawnGcc(argv, fds[1], STDOUT_FILENO);
+  TraceSpawnEvent(*pid, "gcc -E");
+  return fds[0];
+}
+
+// Arenas are kept for the life of the thread and reset between compiles, so
+// after the first compile the pages they use are already faulted in.
+static _Thread_local Arena arena;
+static _Thread_local Arena scratch;
+static _Thread_local bool arenas_ready = false;
+
+void PrepareArenas(const CompileOptions *options) {
+  if (arenas_ready) {
+    arena_reset(&arena);
+    arena_reset(&scratch);
+    return;
   }
-  // Phase 2: Parsing
-  Arena arena = allocate_arena(DEFAULT_MEM);
-  Program *program = ParseTokens(&arena, token_list);
-  free(token_list.tokens);
-  if (mode == PARSE) {
-    PrettyPrintAST(program);
-    exit(0);
+  int flags = options->huge_pages ? ARENA_HUGE_PAGES : 0;
+  arena = reserve_arena(ARENA_RESERVE, flags);
+  scratch = reserve_arena(ARENA_RESERVE, flags);
+  arenas_ready = true;
+}
+
+void WarmUp(void) {
+  CompileOptions options = {.mode = FULL};
+  PrepareArenas(&options);
+  ScannerName();
+}
+
+// Timing is only ever done with a report or a trace, without either these
+// are a couple of checks.
+static inline void BeginPhase(TimeReport *report, Phase phase) {
+  TraceBegin(PhaseName(phase), NULL);
+  if (report != NULL) {
+    StartPhase(report);
   }
-  // Phase 3: IR GEN
-  TackyProgram* tacky_program = EmitTackyProgram(&arena, program);
-  PrettyPrintTacky(tacky_program);
-  if (mode == TACKY) {
-    exit(0);
+}
+
+static inline void FinishPhase(TimeReport *report, Phase phase) {
+  if (report != NULL) {
+    EndPhase(report, phase);
   }
+  TraceEnd();
+}
+
+// The AST or Tacky written next to the source, foo.c giving foo.tacky.
+static char *WithExtension(const char *file_name, const char *extension) {
+  const char *dot = strrchr(file_name, '.');
+  const char *slash = strrchr(file_name, '/');
+  size_t base = dot != NULL && (slash == NULL || dot > slash)
+                    ? (size_t) (dot - file_name)
+                    : strlen(file_name);
+  char *name = malloc(base + strlen(extension) + 2);
+  if (name == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  sprintf(name, "%.*s.%s", (int) base, file_name, extension);
+  return name;
+}
+
+static bool HasExtension(const char *file_name, const char *extension) {
+  const char *dot = strrchr(file_name, '.');
+  return dot != NULL && strcmp(dot + 1, extension) == 0;
+}
 
+static void SaveIrFile(const char *file_name, const char *extension,
+                       const Program *ast, const TackyProgram *tacky) {
+  char *ir_file = WithExtension(file_name, extension);
+  FILE *out = fopen(ir_file, "wb");
+  bool written = out != NULL &&
+                 (ast != NULL ? WriteAstFile(ast, out) : WriteTackyFile(tacky, out));
+  if (out != NULL && fclose(out) != 0) {
+    written = false;
+  }
+  if (!written) {
+    fprintf(Diagnostics(), "Failed to write %s", ir_file);
+    Fail();
+  }
+  free(ir_file);
+}
 
-  // Phase 4: Assembly Generation
-  ArmProgram* arm_program = TranslateTacky(&arena, tacky_program);
+// Phase 4 on. The AST and Tacky are dead once we have ARM instructions, so
+// they live in scratch from `front_end` on and are rewound before the
+// backend passes reuse the same memory.
+static ArmProgram *CompileTacky(TackyProgram *tacky_program, ArenaMark front_end,
+                                Pool *front_end_pool, TimeReport *report) {
+  Pool pool = create_pool(&arena);
+  BeginPhase(report, PHASE_TRANSLATE);
+  ArmProgram* arm_program = TranslateTacky(&pool, tacky_program);
+  arena_rewind(&scratch, front_end);
+  pool_reset(front_end_pool);
+  FinishPhase(report, PHASE_TRANSLATE);
   PrettyPrintAssemblyAST(arm_program);
-  Arena scratch = allocate_arena(DEFAULT_MEM);
-  //scratch.next_ptr += 10;
+  BeginPhase(report, PHASE_PSEUDO_REGISTERS);
   ReplacePseudoRegisters(&scratch, arm_program);
-  release(&scratch);
+  FinishPhase(report, PHASE_PSEUDO_REGISTERS);
   PrettyPrintAssemblyAST(arm_program);
-  InstructionFixUp(&arena, arm_program);
+  BeginPhase(report, PHASE_FIX_UP);
+  InstructionFixUp(&pool, arm_program);
+  FinishPhase(report, PHASE_FIX_UP);
+  if (report != NULL) {
+    report->arm_instructions = arm_program->function_def->length;
+  }
   PrettyPrintAssemblyAST(arm_program);
-  char* s_file = strdup(file_name);
-  ChangeFileExtension(s_file, ASSEMBLY_EXTENSION);
-  WriteArmAssembly(arm_program, s_file);
+  return arm_program;
+}
+
+static ArmProgram *CompileAst(Program *program, const char *file_name,
+                              ArenaMark front_end, Pool *front_end_pool,
+                              const CompileOptions *options, TimeReport *report) {
+  if (report != NULL) {
+    report->ast_nodes = CountAstNodes(program);
+  }
+  if (options->save_ast) {
+    SaveIrFile(file_name, AST_FILE_EXTENSION, program, NULL);
+  }
+  if (options->mode == PARSE) {
+    PrettyPrintAST(program);
+    return NULL;
+  }
+  // Phase 3: IR GEN
+  BeginPhase(report, PHASE_TACKY);
+  TackyProgram* tacky_program = EmitTackyProgram(front_end_pool, program);
+  FinishPhase(report, PHASE_TACKY);
+  if (report != NULL) {
+    report->tacky_instructions = tacky_program->function_def->instr_length;
+  }
+  PrettyPrintTacky(tacky_program);
+  if (options->save_tacky) {
+    SaveIrFile(file_name, TACKY_FILE_EXTENSION, NULL, tacky_program);
+  }
+  if (options->mode == TACKY) {
+    return NULL;
+  }
+  return CompileTacky(tacky_program, front_end, front_end_pool, report);
+}
+
+// Replace with actual compiler implementation eventually
+ArmProgram *InternalCompile(Lexer *lexer, const char *file_name,
+                            const CompileOptions *options, TimeReport *report) {
+  Mode mode = options->mode;
+  // Names are interned from lexing onward, the table lives as long as the
+  // ARM program does.
+  Interner *symbols = arena_alloc(&arena, sizeof(Interner));
+  *symbols = NewInterner(&arena);
+  lexer->symbols = symbols;
+  // Phase 1: Lexing, only done up front when the tokens are all we want or
+  // when it is split across threads. Otherwise the parser pulls tokens from
+  // the lexer as it needs them.
+  if (mode == LEX) {
+    BeginPhase(report, PHASE_LEX);
+    TokenList token_list = options->lex_threads > 1
+                               ? LexParallel(lexer, options->lex_threads)
+                               : Lex(lexer);
+    FinishPhase(report, PHASE_LEX);
+    Token last_token = token_list.tokens[token_list.length - 1];
+    if (last_token.type != tEof) {
+      ReportInvalidToken(token_list.source, last_token);
+    }
+    if (report != NULL) {
+      report->tokens = token_list.length;
+      report->source_bytes = lexer->end - lexer->start;
+    }
+    FreeTokenList(&token_list);
+    CloseSource(lexer);
+    return NULL;
+  }
+  // Phase 2: Parsing
+  ArenaMark front_end = arena_mark(&scratch);
+  Pool front_end_pool = create_pool(&scratch);
+  TokenList token_list = {.tokens = NULL};
+  TokenStream tokens;
+  // A report lexes up front too, so lexing and parsing are timed apart.
+  if (options->lex_threads > 1 || report != NULL) {
+    BeginPhase(report, PHASE_LEX);
+    token_list = options->lex_threads > 1
+                     ? LexParallel(lexer, options->lex_threads)
+                     : Lex(lexer);
+    FinishPhase(report, PHASE_LEX);
+    tokens = StreamFromList(&token_list);
+  } else {
+    tokens = StreamFromLexer(lexer);
+  }
+  if (report != NULL) {
+    report->tokens = token_list.length;
+    report->source_bytes = lexer->end - lexer->start;
+  }
+  BeginPhase(report, PHASE_PARSE);
+  Program *program = ParseTokens(&scratch, &tokens);
+  FinishPhase(report, PHASE_PARSE);
+  FreeTokenList(&token_list);
+  CloseSource(lexer);
+  return CompileAst(program, file_name, front_end, &front_end_pool, options,
+                    report);
+}
+
+// Picks a compile up from an AST or Tacky file, at the phase after the one
+// that wrote it.
+static ArmProgram *CompileIrFile(const char *file_name,
+                                 const CompileOptions *options,
+                                 TimeReport *report) {
+  bool ast = HasExtension(file_name, AST_FILE_EXTENSION);
+  if (options->mode == LEX || (options->mode == PARSE && !ast)) {
+    fprintf(Diagnostics(), "%s is past that phase already", file_name);
+    Fail();
+  }
+  ArenaMark front_end = arena_mark(&scratch);
+  Pool front_end_pool = create_pool(&scratch);
+  if (ast) {
+    BeginPhase(report, PHASE_PARSE);
+    Program *program = ReadAstFile(&arena, &scratch, file_name);
+    FinishPhase(report, PHASE_PARSE);
+    return CompileAst(program, file_name, front_end, &front_end_pool, options,
+                      report);
+  }
+  BeginPhase(report, PHASE_TACKY);
+  TackyProgram *tacky_program = ReadTackyFile(&arena, &front_end_pool, file_name);
+  FinishPhase(report, PHASE_TACKY);
+  if (report != NULL) {
+    report->tacky_instructions = tacky_program->function_def->instr_length;
+  }
+  PrettyPrintTacky(tacky_program);
+  if (options->mode == TACKY) {
+    return NULL;
+  }
+  return CompileTacky(tacky_program, front_end, &front_end_pool, report);
+}
+
+// Either a program to write out or text that was written before.
+typedef struct {
+  ArmProgram *program;
+  const char *text;
+  size_t length;
+  // an ELF object we encode ourselves rather than assembly text.
+  bool object;
+} Assembly;
+
+static void WriteAssembly(const Assembly *assembly, FILE *out) {
+  if (assembly->program != NULL && assembly->object) {
+    WriteArmObject(assembly->program, out);
+  } else if (assembly->program != NULL) {
+    WriteArmAssembly(assembly->program, out);
+  } else {
+    fwrite(assembly->text, 1, assembly->length, out);
+  }
+}
+
+// Renders the program so it can be stored, the returned assembly then
+// refers to the text.
+static char *RenderAssembly(Assembly *assembly) {
+  char *text = NULL;
+  size_t length = 0;
+  if (!assembly->object) {
+    text = ArmAssemblyText(assembly->program, &length);
+  } else {
+    FILE *out = open_memstream(&text, &length);
+    if (out == NULL) {
+      fprintf(Diagnostics(), "failed to allocate memory");
+      Fail();
+    }
+    WriteAssembly(assembly, out);
+    fclose(out);
+  }
+  *assembly = (Assembly) {.text = text, .length = length,
+                          .object = assembly->object};
+  return text;
+}
+
+void WriteAssemblyFile(const Assembly *assembly, char *file_name) {
+  char *s_file = strdup(file_name);
+  ChangeFileExtension(s_file,
+                      assembly->object ? OBJECT_EXTENSION : ASSEMBLY_EXTENSION);
+  FILE *out = fopen(s_file, "wb");
+  if (out == NULL) {
+    fprintf(Diagnostics(), "Failed to write %s", s_file);
+    Fail();
+  }
+  WriteAssembly(assembly, out);
+  fclose(out);
+  free(s_file);
+}
+
+// gcc's arguments: `args`, the libraries asked for, then the output file.
+static char **GccCommand(char **args, int count, const CompileOptions *options,
+                         char *outfile) {
+  char **argv = malloc(sizeof(char *) * (count + options->link_arg_count + 3));
+  if (argv == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  memcpy(argv, args, sizeof(char *) * count);
+  // link_args is NULL when there are none, which memcpy mustn't be given.
+  if (options->link_arg_count > 0) {
+    memcpy(argv + count, options->link_args,
+           sizeof(char *) * options->link_arg_count);
+  }
+  count += options->link_arg_count;
+  argv[count++] = "-o";
+  argv[count++] = outfile;
+  argv[count] = NULL;
+  return argv;
 }
 
-void AssembleAndLink(char *file_name) {
-  int rc = fork();
-  char *file_name_copy = strdup(file_name);
+// The assembly goes to gcc over a pipe, never touching the disk. It is
+// already plain assembly, so tell gcc not to preprocess it.
+void AssembleAndLink(const Assembly *assembly, char *file_name,
+                     const CompileOptions *options, TimeReport *report) {
+  TraceBegin("AssembleAndLink", NULL);
   char *outfile = strdup(file_name);
-  // Swap the file `extension type to .i from .c
   RemoveFileExtension(outfile);
-  if (rc < 0) {
-    fprintf(stderr, "Failed to preprocess the file");
-    exit(2);
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    fprintf(Diagnostics(), "Failed to assemble the file");
+    Fail();
   }
-  if (rc == 0) {
-    char *argv[] = {"gcc", file_name_copy, "-o", outfile, NULL};
-    execvp("/usr/bin/gcc", argv);
-  } else {
-    wait(&rc);
+  char *args[] = {"gcc", "-x", "assembler", "-"};
+  char **argv = GccCommand(args, 4, options, outfile);
+  pid_t pid = SpawnGcc(argv, fds[0], STDIN_FILENO);
+  free(argv);
+  TraceSpawnEvent(pid, "gcc -x assembler");
+  BeginPhase(report, PHASE_EMIT);
+  FILE *out = fdopen(fds[1], "w");
+  WriteAssembly(assembly, out);
+  fclose(out);
+  FinishPhase(report, PHASE_EMIT);
+  BeginPhase(report, PHASE_ASSEMBLE);
+  WaitForGcc(pid, "assemble");
+  FinishPhase(report, PHASE_ASSEMBLE);
+  free(outfile);
+  TraceEnd();
+}
+
+// With libraries, or anything else our linker won't take, the object goes to
+// gcc through a memfd on its stdin, so like the assembly it never touches
+// the disk.
+static void LinkWithGcc(const char *object, size_t size, char *outfile,
+                        const CompileOptions *options, TimeReport *report) {
+  int fd = memfd_create("bcc-object", MFD_CLOEXEC);
+  if (fd < 0 || write(fd, object, size) != (ssize_t) size) {
+    fprintf(Diagnostics(), "Failed to write the object file");
+    Fail();
   }
-  free(file_name_copy);
+  // opening /dev/stdin opens the memfd afresh, from the start.
+  char *args[] = {"gcc", "/dev/stdin"};
+  char **argv = GccCommand(args, 2, options, outfile);
+  pid_t pid = SpawnGcc(argv, fd, STDIN_FILENO);
+  TraceSpawnEvent(pid, "gcc link");
+  free(argv);
+  close(fd);
+  BeginPhase(report, PHASE_LINK);
+  WaitForGcc(pid, "link");
+  FinishPhase(report, PHASE_LINK);
+}
+
+// Our own object only needs linking, which for a program on its own we do
+// here rather than start gcc and ld for it.
+void Link(const Assembly *assembly, char *file_name,
+          const CompileOptions *options, TimeReport *report) {
+  TraceBegin("Link", NULL);
+  char *outfile = strdup(file_name);
+  RemoveFileExtension(outfile);
+  Assembly object = *assembly;
+  char *rendered = NULL;
+  if (object.program != NULL) {
+    BeginPhase(report, PHASE_EMIT);
+    rendered = RenderAssembly(&object);
+    FinishPhase(report, PHASE_EMIT);
+  }
+  bool linked = false;
+  if (options->link_arg_count == 0) {
+    BeginPhase(report, PHASE_LINK);
+    linked = LinkExecutable((const uint8_t *) object.text, object.length,
+                            outfile);
+    FinishPhase(report, PHASE_LINK);
+  }
+  if (options->verbose) {
+    fprintf(Diagnostics(), "%s: linked %s\n", file_name,
+            linked ? "in process" : "with gcc");
+  }
+  if (!linked) {
+    LinkWithGcc(object.text, object.length, outfile, options, report);
+  }
+  free(rendered);
   free(outfile);
+  TraceEnd();
+}
+
+// Generated sources often have nothing for the preprocessor to do, those are
+// mapped and handed to the lexer as they are.
+static bool OpenUnpreprocessed(Lexer *lexer, const char *file_name) {
+  if (!OpenSource(lexer, file_name)) {
+    return false;
+  }
+  // Not mapped. A regular file that ends on a page boundary is just read in
+  // whole, but a pipe can only be read once and is left to the preprocessor.
+  if (lexer->fd >= 0) {
+    struct stat st;
+    if (fstat(lexer->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      CloseSource(lexer);
+      return false;
+    }
+    ReadWholeSource(lexer);
+  }
+  if (NeedsPreprocessing(lexer->start, lexer->end)) {
+    CloseSource(lexer);
+    return false;
+  }
+  return true;
+}
+
+// Encoding straight to an object skips the assembler, which the full build
+// only goes back to when asked.
+static bool EmitsObject(const CompileOptions *options) {
+  return options->mode == OBJECT ||
+         (options->mode == FULL && !options->external_as);
+}
+
+// Options that change the generated assembly go in here, so they get their
+// own cache entries. Objects and text are told apart.
+static uint64_t OutputSalt(const CompileOptions *options) {
+  return EmitsObject(options) ? 1 : 0;
+}
+
+static char CacheExtension(const CompileOptions *options) {
+  return EmitsObject(options) ? OBJECT_EXTENSION : ASSEMBLY_EXTENSION;
+}
+
+// The .s or .o file, or the linked program, whichever the mode stops at.
+static void WriteOutput(Assembly *assembly, char *file_name,
+                        const CompileOptions *options, TimeReport *report) {
+  if (options->mode == ASSEMBLY || options->mode == OBJECT) {
+    BeginPhase(report, PHASE_EMIT);
+    WriteAssemblyFile(assembly, file_name);
+    FinishPhase(report, PHASE_EMIT);
+  } else if (assembly->object) {
+    Link(assembly, file_name, options, report);
+  } else {
+    AssembleAndLink(assembly, file_name, options, report);
+  }
+}
+
+// What a compile has open, which a failure part way through leaves for
+// Compile to let go of.
+typedef struct {
+  char *file_name;
+  const CompileOptions *options;
+  TimeReport *report;
+  Lexer lexer;
+  // gcc -E until it has been waited for.
+  pid_t cpp;
+} Job;
+
+static void CompileSource(Job *job) {
+  char *file_name = job->file_name;
+  const CompileOptions *options = job->options;
+  TimeReport *report = job->report;
+  Lexer *lexer = &job->lexer;
+  BeginPhase(report, PHASE_PREPROCESS);
+  bool bypass = OpenUnpreprocessed(lexer, file_name);
+  if (options->verbose) {
+    fprintf(Diagnostics(), "%s: preprocessor %s\n", file_name,
+            bypass ? "skipped" : options->external_cpp ? "gcc -E" : "in process");
+  }
+  if (!bypass && options->external_cpp) {
+    OpenSourceFd(lexer, StartPreprocessor(file_name, &job->cpp));
+  } else if (!bypass) {
+    size_t length;
+    char *source = PreprocessFile(&scratch, file_name, &length);
+    OpenSourceBuffer(lexer, source, length);
+  }
+  FinishPhase(report, PHASE_PREPROCESS);
+  // Only the assembly is cached, so only modes that stop at assembly or
+  // later can use it.
+  bool caching = options->cache_dir != NULL &&
+                 (options->mode == ASSEMBLY || options->mode == OBJECT ||
+                  options->mode == FULL);
+  CacheKey key;
+  Assembly assembly = {.program = NULL, .object = EmitsObject(options)};
+  char *text = NULL;
+  // A hit skips the front end, so with an AST or Tacky to save we only
+  // store.
+  bool saving = options->save_ast || options->save_tacky;
+  if (caching) {
+    TraceBegin("cache lookup", NULL);
+    ReadWholeSource(lexer);
+    key = HashSource(lexer->start, lexer->end - lexer->start,
+                     OutputSalt(options));
+    if (!saving) {
+      text = CacheLookup(options->cache_dir, key, CacheExtension(options),
+                         &assembly.length);
+    }
+    TraceEnd();
+    if (options->verbose && !saving) {
+      fprintf(Diagnostics(), "%s: cache %s\n", file_name,
+              text != NULL ? "hit" : "miss");
+    }
+  }
+  if (text != NULL) {
+    assembly.text = text;
+    if (report != NULL) {
+      report->source_bytes = lexer->end - lexer->start;
+    }
+    CloseSource(lexer);
+  } else {
+    TraceBegin("InternalCompile", NULL);
+    assembly.program = InternalCompile(lexer, file_name, options, report);
+    TraceEnd();
+  }
+  if (job->cpp != 0) {
+    WaitForGcc(job->cpp, "preprocess");
+    job->cpp = 0;
+  }
+  if (assembly.program != NULL || text != NULL) {
+    if (caching && text == NULL) {
+      BeginPhase(report, PHASE_EMIT);
+      text = RenderAssembly(&assembly);
+      FinishPhase(report, PHASE_EMIT);
+      TraceBegin("cache store", NULL);
+      CacheStore(options->cache_dir, options->cache_limit, key,
+                 CacheExtension(options), text, assembly.length);
+      TraceEnd();
+    }
+    WriteOutput(&assembly, file_name, options, report);
+    free(text);
+  }
+}
+
+// An AST or Tacky file has nothing to preprocess and isn't cached, being a
+// cached compile itself. Its outputs are named as its source's would be.
+static void CompileSaved(Job *job) {
+  TraceBegin("InternalCompile", NULL);
+  Assembly assembly = {
+      .program = CompileIrFile(job->file_name, job->options, job->report),
+      .object = EmitsObject(job->options)};
+  TraceEnd();
+  if (assembly.program != NULL) {
+    char *source_name = WithExtension(job->file_name, "c");
+    WriteOutput(&assembly, source_name, job->options, job->report);
+    free(source_name);
+  }
+}
+
+static void RunJob(void *arg) {
+  Job *job = arg;
+  if (HasExtension(job->file_name, AST_FILE_EXTENSION) ||
+      HasExtension(job->file_name, TACKY_FILE_EXTENSION)) {
+    CompileSaved(job);
+  } else {
+    CompileSource(job);
+  }
 }
 
-void Compile(char *file_name, Mode mode) {
-  Preprocess(file_name);
-  ChangeFileExtension(file_name, PREPROCESSED_EXTENSION);
-  InternalCompile(file_name, mode);
-  ChangeFileExtension(file_name, ASSEMBLY_EXTENSION);
-  AssembleAndLink(file_name);
-  //CleanTemporaryFiles(file_name);
+// Only what a long batch could run out of is given back, descriptors and
+// gcc processes. Memory a failed compile had from malloc stays lost.
+static void AbandonJob(Job *job) {
+  CloseSource(&job->lexer);
+  if (job->cpp != 0) {
+    kill(job->cpp, SIGKILL);
+    waitpid(job->cpp, NULL, 0);
+    TraceReapEvent(job->cpp);
+  }
+}
+
+bool Compile(char *file_name, const CompileOptions *options) {
+  TraceBegin("Compile", file_name);
+  int depth = TraceDepth();
+  PrepareArenas(options);
+  TimeReport time_report;
+  TimeReport *report = NULL;
+  if (options->time_report != REPORT_NONE) {
+    report = &time_report;
+    StartReport(report, file_name, &arena, &scratch, options->perf_counters);
+  }
+  Job job = {.file_name = file_name, .options = options, .report = report,
+             .lexer = {.fd = -1}, .cpp = 0};
+  bool compiled = Attempt(RunJob, &job);
+  if (!compiled) {
+    AbandonJob(&job);
+    while (TraceDepth() > depth) {
+      TraceEnd();
+    }
+  }
+  if (report != NULL) {
+    if (compiled) {
+      PrintTimeReport(report, Diagnostics(),
+                      options->time_report == REPORT_JSON);
+    }
+    StopReport(report);
+  }
+  TraceEnd();
+  return compiled;
+}
+
+// What one file's compile printed, held until every file before it has
+// been printed.
+typedef struct {
+  char *output;
+  size_t output_length;
+  char *errors;
+  size_t errors_length;
+  bool failed;
+  bool done;
+} BatchResult;
+
+// A batch hands files out to the workers in order. Each compile prints to
+// streams of its own, so the output reads the same as compiling the files
+// one at a time, and a file that fails is reported without stopping the
+// others.
+typedef struct {
+  char **file_names;
+  int count;
+  const CompileOptions *options;
+  int next;
+  // numbers the workers in a trace.
+  int workers;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  BatchResult *results;
+} Batch;
+
+// A memfd rather than a memstream, so the gcc a compile starts can write
+// its errors there too. Appending keeps its writes and ours in order.
+static FILE *OpenErrors(void) {
+  int fd = memfd_create("bcc-errors", MFD_CLOEXEC);
+  FILE *errors = fd >= 0 ? fdopen(fd, "a+") : NULL;
+  if (errors == NULL) {
+    fprintf(stderr, "Failed to create a batch job's output");
+    exit(2);
+  }
+  return errors;
+}
+
+static char *CloseErrors(FILE *errors, size_t *length) {
+  fflush(errors);
+  struct stat st;
+  char *text = NULL;
+  if (fstat(fileno(errors), &st) == 0) {
+    text = malloc(st.st_size + 1);
+  }
+  if (text == NULL ||
+      pread(fileno(errors), text, st.st_size, 0) != st.st_size) {
+    fprintf(stderr, "Failed to read a batch job's output");
+    exit(2);
+  }
+  *length = st.st_size;
+  fclose(errors);
+  return text;
+}
+
+static void *BatchWorker(void *arg) {
+  Batch *batch = arg;
+  NameTraceThread("worker",
+                  __atomic_fetch_add(&batch->workers, 1, __ATOMIC_RELAXED));
+  for (;;) {
+    int i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+    if (i >= batch->count) {
+      return NULL;
+    }
+    BatchResult result = {.done = true};
+    FILE *out = open_memstream(&result.output, &result.output_length);
+    if (out == NULL) {
+      fprintf(stderr, "failed to allocate memory");
+      exit(2);
+    }
+    FILE *errors = OpenErrors();
+    SetPrettyPrintOutput(out);
+    SetDiagnostics(errors);
+    result.failed = !Compile(batch->file_names[i], batch->options);
+    SetDiagnostics(NULL);
+    SetPrettyPrintOutput(NULL);
+    fclose(out);
+    result.errors = CloseErrors(errors, &result.errors_length);
+    pthread_mutex_lock(&batch->lock);
+    batch->results[i] = result;
+    pthread_cond_signal(&batch->finished);
+    pthread_mutex_unlock(&batch->lock);
+  }
+}
+
+bool CompileBatch(char **file_names, int count, const CompileOptions *options) {
+  int jobs = options->jobs < count ? options->jobs : count;
+  Batch batch = {
+      .file_names = file_names,
+      .count = count,
+      .options = options,
+      .next = 0,
+      .results = calloc(count, sizeof(BatchResult)),
+  };
+  pthread_t *threads = malloc(sizeof(pthread_t) * jobs);
+  if (batch.results == NULL || threads == NULL) {
+    fprintf(stderr, "failed to allocate memory");
+    exit(2);
+  }
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.finished, NULL);
+  for (int i = 0; i < jobs; ++i) {
+    if (pthread_create(&threads[i], NULL, BatchWorker, &batch) != 0) {
+      fprintf(stderr, "failed to start a worker thread");
+      exit(2);
+    }
+  }
+  bool compiled = true;
+  for (int i = 0; i < count; ++i) {
+    TraceBegin("wait", file_names[i]);
+    pthread_mutex_lock(&batch.lock);
+    while (!batch.results[i].done) {
+      pthread_cond_wait(&batch.finished, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+    TraceEnd();
+    BatchResult *result = &batch.results[i];
+    fwrite(result->output, 1, result->output_length, stdout);
+    fflush(stdout);
+    fwrite(result->errors, 1, result->errors_length, stderr);
+    if (result->failed) {
+      // most errors don't end their line, the name goes on one of its own.
+      if (result->errors_length > 0 &&
+          result->errors[result->errors_length - 1] != '\n') {
+        fputc('\n', stderr);
+      }
+      fprintf(stderr, "%s: failed to compile\n", file_names[i]);
+      compiled = false;
+    }
+    free(result->output);
+    free(result->errors);
+  }
+  for (int i = 0; i < jobs; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_cond_destroy(&batch.finished);
+  pthread_mutex_destroy(&batch.lock);
+  free(threads);
+  free(batch.results);
+  return compiled;
 }
@@ -1,14 +1,69 @@
 #ifndef BCC_SRC_DRIVER_H
 #define BCC_SRC_DRIVER_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 typedef enum {
   LEX,
   PARSE,
   TACKY,
   CODEGEN,
+  // stop at a .s file.
+  ASSEMBLY,
+  // stop at a .o file, encoded without an assembler.
+  OBJECT,
   FULL
 } Mode;
 
-void Compile(char* file_name, Mode mode);
+typedef enum {
+  REPORT_NONE,
+  REPORT_TEXT,
+  REPORT_JSON
+} ReportFormat;
+
+typedef struct {
+  Mode mode;
+  // back the arenas with transparent huge pages where the kernel allows it.
+  bool huge_pages;
+  // lex on this many threads, anything below 2 lexes as the parser goes.
+  int lex_threads;
+  // preprocess with gcc -E instead of in process.
+  bool external_cpp;
+  // assemble text with gcc instead of encoding the object ourselves.
+  bool external_as;
+  // say on stderr which way the source was preprocessed.
+  bool verbose;
+  // files compiled at once in a batch, which also bounds how many gcc
+  // processes we run at a time.
+  int jobs;
+  // where generated assembly is cached, NULL for no caching.
+  const char* cache_dir;
+  // bytes the cache may hold before the least recently used entries go.
+  size_t cache_limit;
+  // per phase times and memory on stderr after each compile.
+  ReportFormat time_report;
+  // -l and -L options, which send linking to gcc.
+  char **link_args;
+  int link_arg_count;
+  // add hardware counters to the time report.
+  bool perf_counters;
+  // write foo.ast or foo.tacky next to foo.c, which can be compiled from
+  // in its place later on.
+  bool save_ast;
+  bool save_tacky;
+} CompileOptions;
+
+// False if the compile failed, after saying why on stderr.
+bool Compile(char* file_name, const CompileOptions* options);
+// Reserves the arenas and picks the scanner for this CPU, so a process
+// forked afterwards doesn't redo either. No arena pages are touched: a
+// forked child would copy them on its first write, which costs it as much
+// as the zero fill it saves.
+void WarmUp(void);
+// Compiles every file on `jobs` threads, printing what each would print
+// alone in the order given. A file that fails doesn't stop the others, the
+// result is false if any did.
+bool CompileBatch(char** file_names, int count, const CompileOptions* options);
 
 #endif // BCC_SRC_DRIVER_H
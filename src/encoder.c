@@ -0,0 +1,485 @@
+#include "encoder.h"
+
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+#include "diagnostics.h"
+#include "object_file.h"
+
+// Register 31 is sp or the zero register depending on the instruction.
+#define SP 31
+#define ZR 31
+
+typedef enum {
+  // B, 26 bit word offset.
+  FIXUP_BRANCH,
+  // B.cond, CBZ and CBNZ, 19 bit word offset at bit 5.
+  FIXUP_CONDITIONAL,
+} FixupKind;
+
+typedef struct {
+  int index;
+  Symbol label;
+  FixupKind kind;
+} Fixup;
+
+typedef struct {
+  MachineCode code;
+  const Interner* symbols;
+  // byte offset of each label by symbol, -1 until it is placed.
+  int64_t* label_at;
+  int label_capacity;
+  Fixup* fixups;
+  int fixup_count;
+  int fixup_capacity;
+} Encoder;
+
+static void* Grow(void* items, int* capacity, int length, size_t size) {
+  if (length < *capacity) {
+    return items;
+  }
+  *capacity = *capacity == 0 ? 64 : *capacity * 2;
+  items = realloc(items, size * *capacity);
+  if (items == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  return items;
+}
+
+static void Emit(Encoder* encoder, uint32_t word) {
+  MachineCode* code = &encoder->code;
+  code->words = Grow(code->words, &code->capacity, code->length,
+                     sizeof(uint32_t));
+  code->words[code->length++] = word;
+}
+
+static uint32_t RegisterNumber(Register reg) {
+  switch (reg) {
+    case W0:
+      return 0;
+    case W10:
+      return 10;
+    case W11:
+      return 11;
+    case W12:
+      return 12;
+    case W13:
+      return 13;
+  }
+  fprintf(Diagnostics(), "unexpected register?, crashing \n");
+  Fail();
+}
+
+static uint32_t ConditionCode(ArmCC cc) {
+  switch (cc) {
+    case B_E:
+    case B_Z:
+      return 0x0;
+    case B_NE:
+    case B_NZ:
+      return 0x1;
+    case B_GE:
+      return 0xa;
+    case B_L:
+      return 0xb;
+    case B_G:
+      return 0xc;
+    case B_LE:
+      return 0xd;
+    default:
+      fprintf(Diagnostics(), "unexpected CC, can't encode\n");
+      Fail();
+  }
+}
+
+// The N:immr:imms fields of a 32 bit logical immediate, false when the value
+// isn't a rotated run of ones repeated across the word.
+static bool LogicalImmediate(uint32_t value, uint32_t* fields) {
+  if (value == 0 || value == 0xffffffff) {
+    return false;
+  }
+  int size = 32;
+  while (size > 2) {
+    int half = size / 2;
+    uint32_t mask = (1u << half) - 1;
+    if ((value & mask) != ((value >> half) & mask)) {
+      break;
+    }
+    size = half;
+  }
+  uint32_t mask = size == 32 ? 0xffffffff : (1u << size) - 1;
+  uint32_t element = value & mask;
+  for (int r = 0; r < size; ++r) {
+    uint32_t rotated =
+        r == 0 ? element : ((element >> r) | (element << (size - r))) & mask;
+    if ((rotated & (rotated + 1)) == 0) {
+      uint32_t ones = __builtin_popcount(rotated);
+      uint32_t immr = (size - r) % size;
+      uint32_t imms = ((~(uint32_t) (size - 1) << 1) & 0x3f) | (ones - 1);
+      *fields = immr << 6 | imms;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Picks what an assembler picks for MOV with an immediate: MOVZ, then MOVN,
+// then ORR with a logical immediate. Anything else takes a MOVZ and MOVK pair.
+static void EncodeMovImmediate(Encoder* encoder, uint32_t rd, int imm) {
+  uint32_t value = (uint32_t) imm;
+  uint32_t fields;
+  if ((value & 0xffff0000) == 0) {
+    Emit(encoder, 0x52800000 | value << 5 | rd);
+  } else if ((value & 0xffff) == 0) {
+    Emit(encoder, 0x52a00000 | (value >> 16) << 5 | rd);
+  } else if ((~value & 0xffff0000) == 0) {
+    Emit(encoder, 0x12800000 | (~value & 0xffff) << 5 | rd);
+  } else if ((~value & 0xffff) == 0) {
+    Emit(encoder, 0x12a00000 | (~value >> 16) << 5 | rd);
+  } else if (LogicalImmediate(value, &fields)) {
+    Emit(encoder, 0x32000000 | fields << 10 | ZR << 5 | rd);
+  } else {
+    Emit(encoder, 0x52800000 | (value & 0xffff) << 5 | rd);
+    Emit(encoder, 0x72a00000 | (value >> 16) << 5 | rd);
+  }
+}
+
+// SUB or ADD sp, sp, #bytes. Frames past what one 12 bit immediate holds are
+// moved in a shifted step then the rest.
+static void EncodeStackAdjust(Encoder* encoder, uint32_t base, int bytes) {
+  if (bytes < 0 || bytes > 0xffffff) {
+    fprintf(Diagnostics(), "stack frame too large to encode\n");
+    Fail();
+  }
+  uint32_t high = (uint32_t) bytes >> 12;
+  uint32_t low = (uint32_t) bytes & 0xfff;
+  if (high != 0) {
+    Emit(encoder, base | 1u << 22 | high << 10 | SP << 5 | SP);
+  }
+  if (low != 0 || high == 0) {
+    Emit(encoder, base | low << 10 | SP << 5 | SP);
+  }
+}
+
+// A 32 bit LDR or STR to a stack slot, with the unsigned scaled offset. Slots
+// past its reach are addressed through x16, the scratch register calls may
+// clobber, which an assembler would refuse to do for us.
+static void EncodeStackAccess(Encoder* encoder, uint32_t base, Register reg,
+                              int stack_location) {
+  int offset = StackSlotOffset(stack_location);
+  if (offset < 0 || offset % 4 != 0 || offset > 0xffffff) {
+    fprintf(Diagnostics(), "stack slot out of range: %d\n", offset);
+    Fail();
+  }
+  uint32_t address = SP;
+  if (offset / 4 > 0xfff) {
+    // ADD X16, SP, #high, LSL #12
+    address = 16;
+    Emit(encoder, 0x91400000 | (uint32_t) (offset >> 12) << 10 | SP << 5 |
+                      address);
+    offset &= 0xfff;
+  }
+  Emit(encoder, base | (uint32_t) (offset / 4) << 10 | address << 5 |
+                    RegisterNumber(reg));
+}
+
+// MOV, LDR and STR all move between two operands, what is encoded follows
+// the operands rather than the instruction type.
+static void EncodeMove(Encoder* encoder, Mov mov) {
+  if (mov.dst.type == REGISTER && mov.src.type == IMM) {
+    EncodeMovImmediate(encoder, RegisterNumber(mov.dst.reg), mov.src.imm);
+  } else if (mov.dst.type == REGISTER && mov.src.type == REGISTER) {
+    // ORR Wd, WZR, Wm
+    Emit(encoder, 0x2a0003e0 | RegisterNumber(mov.src.reg) << 16 |
+                      RegisterNumber(mov.dst.reg));
+  } else if (mov.dst.type == REGISTER && mov.src.type == STACK) {
+    EncodeStackAccess(encoder, 0xb9400000, mov.dst.reg, mov.src.stack_location);
+  } else if (mov.dst.type == STACK && mov.src.type == REGISTER) {
+    EncodeStackAccess(encoder, 0xb9000000, mov.src.reg, mov.dst.stack_location);
+  } else if (mov.dst.type == STACK && mov.src.type == STACK) {
+    // what the fix up splits into a STR and LDR through W10.
+    EncodeStackAccess(encoder, 0xb9400000, W10, mov.src.stack_location);
+    EncodeStackAccess(encoder, 0xb9000000, W10, mov.dst.stack_location);
+  } else {
+    fprintf(Diagnostics(), "failed to encode move, unexpected operands\n");
+    Fail();
+  }
+}
+
+static uint32_t BinaryOpcode(BinaryOperator op) {
+  switch (op) {
+    case A_ADD:
+      return 0x0b000000;
+    case A_SUBTRACT:
+      return 0x4b000000;
+    case A_DIVIDE:
+      return 0x1ac00c00;
+    case A_MULTIPLY:
+      // MADD with the zero register as the addend.
+      return 0x1b007c00;
+    case A_OR:
+      return 0x2a000000;
+    case A_XOR:
+      return 0x4a000000;
+    case A_AND:
+      return 0x0a000000;
+    case A_LSHIFT:
+      return 0x1ac02000;
+    case A_RSHIFT:
+      return 0x1ac02800;
+    case A_CMP:
+      // SUBS to the zero register.
+      return 0x6b00001f;
+    default:
+      fprintf(Diagnostics(), "unexpected arm binary op\n");
+      Fail();
+  }
+}
+
+static void EncodeBinary(Encoder* encoder, ArmBinary binary) {
+  uint32_t word = BinaryOpcode(binary.op) |
+                  RegisterNumber(binary.right) << 16 |
+                  RegisterNumber(binary.left) << 5;
+  if (binary.op != A_CMP) {
+    word |= RegisterNumber(binary.dst);
+  }
+  Emit(encoder, word);
+}
+
+static void AddFixup(Encoder* encoder, Symbol label, FixupKind kind) {
+  encoder->fixups = Grow(encoder->fixups, &encoder->fixup_capacity,
+                         encoder->fixup_count, sizeof(Fixup));
+  encoder->fixups[encoder->fixup_count++] = (Fixup) {
+      .index = encoder->code.length, .label = label, .kind = kind};
+}
+
+static void PlaceLabel(Encoder* encoder, Symbol label) {
+  MachineCode* code = &encoder->code;
+  if (encoder->label_at[label] >= 0) {
+    fprintf(Diagnostics(), "label defined twice: %s\n",
+            SymbolText(encoder->symbols, label));
+    Fail();
+  }
+  uint32_t offset = code->length * 4;
+  encoder->label_at[label] = offset;
+  int capacity = encoder->label_capacity;
+  code->labels = Grow(code->labels, &capacity, code->label_count,
+                      sizeof(Symbol));
+  code->label_offsets = Grow(code->label_offsets, &encoder->label_capacity,
+                             code->label_count, sizeof(uint32_t));
+  code->labels[code->label_count] = label;
+  code->label_offsets[code->label_count++] = offset;
+}
+
+static void EncodeInstruction(Encoder* encoder, const Instruction* instruction) {
+  switch (instruction->type) {
+    case ALLOC_STACK:
+      EncodeStackAdjust(encoder, 0xd1000000,
+                        StackFrameSize(instruction->alloc_stack.size));
+      return;
+    case DEALLOC_STACK:
+      EncodeStackAdjust(encoder, 0x91000000,
+                        StackFrameSize(instruction->alloc_stack.size));
+      return;
+    case MOV:
+    case LDR:
+    case STR:
+      EncodeMove(encoder, instruction->mov);
+      return;
+    case UNARY: {
+      uint32_t reg = RegisterNumber(instruction->unary.reg);
+      // NEG is SUB from the zero register and MVN is ORN with it.
+      uint32_t base = instruction->unary.op == NEG ? 0x4b0003e0 : 0x2a2003e0;
+      Emit(encoder, base | reg << 16 | reg);
+      return;
+    }
+    case BINARY:
+      EncodeBinary(encoder, instruction->binary);
+      return;
+    case MSUB: {
+      ArmMsub msub = instruction->msub;
+      Emit(encoder, 0x1b008000 | RegisterNumber(msub.m) << 16 |
+                        RegisterNumber(msub.left) << 10 |
+                        RegisterNumber(msub.right) << 5 |
+                        RegisterNumber(msub.dst));
+      return;
+    }
+    case RET:
+      Emit(encoder, 0xd65f03c0);
+      return;
+    case SET_CC:
+      // CSINC Wd, WZR, WZR with the inverted condition.
+      Emit(encoder, 0x1a9f07e0 | (ConditionCode(instruction->set_cc.cc) ^ 1) << 12 |
+                        RegisterNumber(instruction->set_cc.reg));
+      return;
+    case BRANCH: {
+      Branch branch = instruction->branch;
+      if (branch.cc == B_NO_CC) {
+        AddFixup(encoder, branch.label, FIXUP_BRANCH);
+        Emit(encoder, 0x14000000);
+      } else {
+        AddFixup(encoder, branch.label, FIXUP_CONDITIONAL);
+        Emit(encoder, 0x54000000 | ConditionCode(branch.cc));
+      }
+      return;
+    }
+    case CMP_BRANCH: {
+      CompareBranch c_branch = instruction->cmp_branch;
+      if (c_branch.branch.cc != B_Z && c_branch.branch.cc != B_NZ) {
+        fprintf(Diagnostics(), "Invalid Branch Condition code\n");
+        Fail();
+      }
+      AddFixup(encoder, c_branch.branch.label, FIXUP_CONDITIONAL);
+      Emit(encoder, (c_branch.branch.cc == B_Z ? 0x34000000 : 0x35000000) |
+                        RegisterNumber(c_branch.reg));
+      return;
+    }
+    case LABEL:
+      PlaceLabel(encoder, instruction->label.identifier);
+      return;
+    default:
+      fprintf(Diagnostics(), "failed to encode instruction, unknown translation\n");
+      Fail();
+  }
+}
+
+// Fills in branches now every label is placed. A label that never was is
+// somewhere else, so like an assembler we leave a relocation for it.
+static void ResolveFixups(Encoder* encoder) {
+  MachineCode* code = &encoder->code;
+  int reloc_capacity = 0;
+  for (int i = 0; i < encoder->fixup_count; ++i) {
+    Fixup fixup = encoder->fixups[i];
+    uint32_t* word = &code->words[fixup.index];
+    int64_t target = encoder->label_at[fixup.label];
+    if (target < 0) {
+      code->relocs = Grow(code->relocs, &reloc_capacity, code->reloc_count,
+                          sizeof(CodeReloc));
+      code->relocs[code->reloc_count++] = (CodeReloc) {
+          .offset = fixup.index * 4,
+          .label = fixup.label,
+          .type = fixup.kind == FIXUP_BRANCH ? R_AARCH64_JUMP26
+                                             : R_AARCH64_CONDBR19,
+      };
+      continue;
+    }
+    int64_t delta = target / 4 - fixup.index;
+    int bits = fixup.kind == FIXUP_BRANCH ? 26 : 19;
+    if (delta < -(1 << (bits - 1)) || delta >= (1 << (bits - 1))) {
+      fprintf(Diagnostics(), "branch to %s out of range\n",
+              SymbolText(encoder->symbols, fixup.label));
+      Fail();
+    }
+    uint32_t field = (uint32_t) delta & ((1u << bits) - 1);
+    *word |= fixup.kind == FIXUP_BRANCH ? field : field << 5;
+  }
+}
+
+MachineCode EncodeArmFunction(const ArmFunction* function,
+                              const Interner* symbols) {
+  Encoder encoder = {.symbols = symbols};
+  uint32_t symbol_count = SymbolCount(symbols);
+  encoder.label_at = malloc(sizeof(int64_t) * (symbol_count + 1));
+  if (encoder.label_at == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  for (uint32_t i = 0; i < symbol_count; ++i) {
+    encoder.label_at[i] = -1;
+  }
+  for (int i = 0; i < function->length; ++i) {
+    EncodeInstruction(&encoder, &function->instructions[i]);
+  }
+  ResolveFixups(&encoder);
+  free(encoder.label_at);
+  free(encoder.fixups);
+  return encoder.code;
+}
+
+void FreeMachineCode(MachineCode* code) {
+  free(code->words);
+  free(code->labels);
+  free(code->label_offsets);
+  free(code->relocs);
+  *code = (MachineCode) {.words = NULL};
+}
+
+// Labels as WriteArmAssembly writes them, with a leading underscore. The
+// function keeps its C name, this being ELF.
+static char* SymbolName(const Interner* symbols, Symbol symbol) {
+  const char* text = SymbolText(symbols, symbol);
+  char* name = malloc(strlen(text) + 2);
+  if (name == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  name[0] = '_';
+  strcpy(name + 1, text);
+  return name;
+}
+
+void WriteArmObject(ArmProgram* program, FILE* out) {
+  ArmFunction* function = program->function_def;
+  MachineCode code = EncodeArmFunction(function, program->symbols);
+  // the $x mapping symbol marks where A64 code starts, then the labels, the
+  // function and anything branched to but not defined here.
+  int count = 0;
+  ObjectSymbol* syms = malloc(sizeof(ObjectSymbol) *
+                              (code.label_count + code.reloc_count + 2));
+  ObjectReloc* relocs = malloc(sizeof(ObjectReloc) * (code.reloc_count + 1));
+  if (syms == NULL || relocs == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  syms[count++] = (ObjectSymbol) {.name = strdup("$x"), .defined = true};
+  for (int i = 0; i < code.label_count; ++i) {
+    syms[count++] = (ObjectSymbol) {
+        .name = SymbolName(program->symbols, code.labels[i]),
+        .value = code.label_offsets[i],
+        .defined = true,
+    };
+  }
+  syms[count++] = (ObjectSymbol) {
+      .name = strdup(SymbolText(program->symbols, function->name)),
+      .defined = true,
+      .global = true,
+  };
+  for (int i = 0; i < code.reloc_count; ++i) {
+    int symbol = count;
+    for (int j = count - 1; j >= 0 && syms[j].defined == false; --j) {
+      if (strcmp(syms[j].name + 1, SymbolText(program->symbols,
+                                              code.relocs[i].label)) == 0) {
+        symbol = j;
+      }
+    }
+    if (symbol == count) {
+      syms[count++] = (ObjectSymbol) {
+          .name = SymbolName(program->symbols, code.relocs[i].label)};
+    }
+    relocs[i] = (ObjectReloc) {
+        .offset = code.relocs[i].offset,
+        .symbol = symbol,
+        .type = code.relocs[i].type,
+    };
+  }
+  // machine words are little endian, as is every host we build on.
+  ObjectFile object = {
+      .text = (const uint8_t*) code.words,
+      .text_size = code.length * sizeof(uint32_t),
+      .symbols = syms,
+      .symbol_count = count,
+      .relocs = relocs,
+      .reloc_count = code.reloc_count,
+  };
+  if (!WriteElfObject(&object, out)) {
+    fprintf(Diagnostics(), "Failed to write the object file");
+    Fail();
+  }
+  for (int i = 0; i < count; ++i) {
+    free((char*) syms[i].name);
+  }
+  free(syms);
+  free(relocs);
+  FreeMachineCode(&code);
+}
@@ -0,0 +1,38 @@
+#ifndef BCC_SRC_ENCODER_H
+#define BCC_SRC_ENCODER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "codegen.h"
+
+// Encodes ARM instructions straight into AArch64 machine code, the same
+// instructions an assembler would pick for what WriteArmAssembly prints.
+
+// A branch to a label the function doesn't define, left for the linker.
+typedef struct {
+  uint32_t offset;
+  Symbol label;
+  uint32_t type;
+} CodeReloc;
+
+typedef struct {
+  uint32_t* words;
+  int length;
+  int capacity;
+  // labels in the order they are defined, with their byte offsets.
+  Symbol* labels;
+  uint32_t* label_offsets;
+  int label_count;
+  CodeReloc* relocs;
+  int reloc_count;
+} MachineCode;
+
+MachineCode EncodeArmFunction(const ArmFunction* function,
+                              const Interner* symbols);
+void FreeMachineCode(MachineCode* code);
+// The program as an ELF relocatable object, what assembling the output of
+// WriteArmAssembly would give.
+void WriteArmObject(ArmProgram* program, FILE* out);
+
+#endif //BCC_SRC_ENCODER_H
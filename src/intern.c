@@ -0,0 +1,103 @@
+#include "intern.h"
+#include <stdio.h>
+#include <string.h>
+
+#define INITIAL_SYMBOLS 64
+
+// FNV-1a, names are short so anything fancier doesn't pay for itself.
+static uint32_t HashText(const char* text, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= (unsigned char) text[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t* FindSlot(Interner* interner, const char* text, size_t length,
+                          uint32_t hash) {
+  uint32_t i = hash & interner->slot_mask;
+  while (interner->slots[i] != 0) {
+    SymbolEntry* entry = &interner->entries[interner->slots[i] - 1];
+    if (entry->hash == hash && entry->length == length &&
+        memcmp(entry->text, text, length) == 0) {
+      break;
+    }
+    i = (i + 1) & interner->slot_mask;
+  }
+  return &interner->slots[i];
+}
+
+// Doubles the entry array and the hash table, keeping the table at most half
+// full.
+static void GrowInterner(Interner* interner) {
+  uint32_t capacity = interner->capacity * 2;
+  interner->entries = arena_realloc(interner->arena, interner->entries,
+                                    sizeof(SymbolEntry) * interner->capacity,
+                                    sizeof(SymbolEntry) * capacity);
+  interner->capacity = capacity;
+  uint32_t slot_count = capacity * 2;
+  interner->slots = arena_alloc(interner->arena, sizeof(uint32_t) * slot_count);
+  memset(interner->slots, 0, sizeof(uint32_t) * slot_count);
+  interner->slot_mask = slot_count - 1;
+  for (uint32_t s = 0; s < interner->count; ++s) {
+    uint32_t i = interner->entries[s].hash & interner->slot_mask;
+    while (interner->slots[i] != 0) {
+      i = (i + 1) & interner->slot_mask;
+    }
+    interner->slots[i] = s + 1;
+  }
+}
+
+Interner NewInterner(Arena* arena) {
+  Interner interner = {
+      .arena = arena,
+      .entries = arena_alloc(arena, sizeof(SymbolEntry) * INITIAL_SYMBOLS),
+      .count = 0,
+      .capacity = INITIAL_SYMBOLS,
+      .slots = arena_alloc(arena, sizeof(uint32_t) * INITIAL_SYMBOLS * 2),
+      .slot_mask = INITIAL_SYMBOLS * 2 - 1,
+  };
+  memset(interner.slots, 0, sizeof(uint32_t) * INITIAL_SYMBOLS * 2);
+  return interner;
+}
+
+Symbol Intern(Interner* interner, const char* text, size_t length) {
+  uint32_t hash = HashText(text, length);
+  uint32_t* slot = FindSlot(interner, text, length, hash);
+  if (*slot != 0) {
+    return *slot - 1;
+  }
+  if (interner->count == UINT32_MAX - 1) {
+    fprintf(stderr, "too many symbols");
+    exit(2);
+  }
+  if (interner->count == interner->capacity) {
+    GrowInterner(interner);
+    slot = FindSlot(interner, text, length, hash);
+  }
+  Symbol symbol = interner->count++;
+  interner->entries[symbol] = (SymbolEntry) {
+      .text = arena_strndup(interner->arena, text, length),
+      .length = length,
+      .hash = hash,
+  };
+  *slot = symbol + 1;
+  return symbol;
+}
+
+Symbol InternStr(Interner* interner, const char* text) {
+  return Intern(interner, text, strlen(text));
+}
+
+const char* SymbolText(const Interner* interner, Symbol symbol) {
+  return interner->entries[symbol].text;
+}
+
+uint32_t SymbolLength(const Interner* interner, Symbol symbol) {
+  return interner->entries[symbol].length;
+}
+
+uint32_t SymbolCount(const Interner* interner) {
+  return interner->count;
+}
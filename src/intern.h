@@ -0,0 +1,39 @@
+#ifndef BCC_SRC_INTERN_H
+#define BCC_SRC_INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+// Every identifier, temporary and label is interned once and referred to by
+// its Symbol from then on, so comparing names is comparing integers. Symbols
+// are dense, starting at zero, so they can index side tables directly.
+typedef uint32_t Symbol;
+
+typedef struct {
+  const char* text;
+  uint32_t length;
+  uint32_t hash;
+} SymbolEntry;
+
+typedef struct {
+  // holds the strings and the tables, must outlive the interner.
+  Arena* arena;
+  SymbolEntry* entries;
+  uint32_t count;
+  uint32_t capacity;
+  // open addressing table holding symbol + 1, zero marks an empty slot.
+  uint32_t* slots;
+  uint32_t slot_mask;
+} Interner;
+
+Interner NewInterner(Arena* arena);
+Symbol Intern(Interner* interner, const char* text, size_t length);
+// Interns a NUL terminated string.
+Symbol InternStr(Interner* interner, const char* text);
+// The interned text, always NUL terminated.
+const char* SymbolText(const Interner* interner, Symbol symbol);
+uint32_t SymbolLength(const Interner* interner, Symbol symbol);
+uint32_t SymbolCount(const Interner* interner);
+
+#endif // BCC_SRC_INTERN_H
@@ -0,0 +1,432 @@
+#include "ir_file.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "diagnostics.h"
+
+// Bumped whenever a record or an enum they hold changes.
+#define IR_FILE_VERSION 1
+
+typedef enum {
+  IR_AST = 1,
+  IR_TACKY = 2
+} IrKind;
+
+// Read back as anything else, the file came from a machine with the other
+// byte order.
+#define IR_BYTE_ORDER 0x01020304u
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  // IR_BYTE_ORDER and the record size as the writer saw them, the records
+  // are its structs as they are in memory.
+  uint32_t byte_order;
+  uint32_t record_size;
+  uint32_t kind;
+  // the function's name and, for an AST, its statement type.
+  uint32_t name;
+  uint32_t statement;
+  uint32_t symbol_count;
+  // offsets from the start of the file, all four byte aligned.
+  uint32_t symbols;
+  uint32_t strings;
+  uint32_t strings_size;
+  uint32_t records;
+  uint32_t record_count;
+} IrHeader;
+
+static const char ir_magic[4] = {'B', 'C', 'I', 'R'};
+
+typedef struct {
+  uint32_t offset;
+  uint32_t length;
+} SymbolRecord;
+
+// A constant holds its value in `a`, a unary expression its operand and a
+// binary expression both, all as indexes of earlier records.
+typedef struct {
+  uint8_t type;
+  uint8_t op;
+  uint16_t unused;
+  uint32_t a;
+  uint32_t b;
+} AstRecord;
+
+// Values go in `args` in the order the instruction's struct has them, bit i
+// of `vars` is set when args[i] is a variable rather than a constant. Jump
+// targets and labels are always args[0].
+typedef struct {
+  uint8_t type;
+  uint8_t op;
+  uint8_t vars;
+  uint8_t unused;
+  uint32_t args[3];
+} TackyRecord;
+
+static uint64_t Align4(uint64_t offset) {
+  return (offset + 3) & ~(uint64_t) 3;
+}
+
+// Structs only go to the file zeroed whole and copied with memcpy, so no
+// uninitialised padding byte is ever written out.
+static bool WriteIrFile(FILE* out, IrHeader* header, const Interner* symbols,
+                        const void* records, size_t record_size) {
+  uint32_t count = SymbolCount(symbols);
+  uint64_t strings_size = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    strings_size += SymbolLength(symbols, i) + 1;
+  }
+  uint64_t strings = sizeof(IrHeader) + (uint64_t) count * sizeof(SymbolRecord);
+  uint64_t records_offset = Align4(strings + strings_size);
+  if (records_offset + (uint64_t) header->record_count * record_size > UINT32_MAX) {
+    return false;
+  }
+  memcpy(header->magic, ir_magic, sizeof(ir_magic));
+  header->version = IR_FILE_VERSION;
+  header->byte_order = IR_BYTE_ORDER;
+  header->record_size = record_size;
+  header->symbol_count = count;
+  header->symbols = sizeof(IrHeader);
+  header->strings = strings;
+  header->strings_size = strings_size;
+  header->records = records_offset;
+  fwrite(header, sizeof(*header), 1, out);
+  uint32_t offset = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    SymbolRecord symbol;
+    memset(&symbol, 0, sizeof(symbol));
+    symbol.offset = offset;
+    symbol.length = SymbolLength(symbols, i);
+    fwrite(&symbol, sizeof(symbol), 1, out);
+    offset += symbol.length + 1;
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    fwrite(SymbolText(symbols, i), 1, SymbolLength(symbols, i) + 1, out);
+  }
+  static const char padding[4] = {0};
+  fwrite(padding, 1, records_offset - (strings + strings_size), out);
+  fwrite(records, record_size, header->record_count, out);
+  return !ferror(out);
+}
+
+typedef struct {
+  AstRecord* records;
+  uint32_t length;
+  uint32_t capacity;
+} AstRecords;
+
+static uint32_t AddAstRecord(AstRecords* list, const AstRecord* record) {
+  if (list->length == list->capacity) {
+    list->capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+    list->records = realloc(list->records, sizeof(AstRecord) * list->capacity);
+    if (list->records == NULL) {
+      fprintf(Diagnostics(), "failed to allocate memory");
+      Fail();
+    }
+  }
+  memcpy(&list->records[list->length], record, sizeof(*record));
+  return list->length++;
+}
+
+static uint32_t AddExp(AstRecords* list, const Exp* exp) {
+  AstRecord record;
+  memset(&record, 0, sizeof(record));
+  record.type = exp->type;
+  switch (exp->type) {
+    case eConst:
+      record.a = (uint32_t) exp->const_val;
+      break;
+    case eUnaryExp:
+      record.op = exp->unary_exp.op_type;
+      record.a = AddExp(list, exp->unary_exp.exp);
+      break;
+    case eBinaryExp:
+      record.op = exp->binary_exp.op;
+      record.a = AddExp(list, exp->binary_exp.left);
+      record.b = AddExp(list, exp->binary_exp.right);
+      break;
+  }
+  return AddAstRecord(list, &record);
+}
+
+bool WriteAstFile(const Program* program, FILE* out) {
+  AstRecords list = {.records = NULL};
+  AddExp(&list, program->function->statement->exp);
+  IrHeader header;
+  memset(&header, 0, sizeof(header));
+  header.kind = IR_AST;
+  header.name = program->function->name;
+  header.statement = program->function->statement->type;
+  header.record_count = list.length;
+  bool written = WriteIrFile(out, &header, program->symbols, list.records,
+                             sizeof(AstRecord));
+  free(list.records);
+  return written;
+}
+
+static void PutVal(TackyRecord* record, int i, TackyVal val) {
+  if (val.type == TACKY_VAR) {
+    record->vars |= 1 << i;
+    record->args[i] = val.identifier;
+  } else {
+    record->args[i] = (uint32_t) val.const_val;
+  }
+}
+
+static void ToTackyRecord(const TackyInstruction* instr, TackyRecord* out) {
+  TackyRecord record;
+  memset(&record, 0, sizeof(record));
+  record.type = instr->type;
+  switch (instr->type) {
+    case TACKY_RETURN:
+      PutVal(&record, 0, instr->return_val);
+      break;
+    case TACKY_UNARY:
+      record.op = instr->unary.op;
+      PutVal(&record, 0, instr->unary.src);
+      PutVal(&record, 1, instr->unary.dst);
+      break;
+    case TACKY_BINARY:
+      record.op = instr->binary.op;
+      PutVal(&record, 0, instr->binary.left);
+      PutVal(&record, 1, instr->binary.right);
+      PutVal(&record, 2, instr->binary.dst);
+      break;
+    case TACKY_COPY:
+      PutVal(&record, 0, instr->copy.src);
+      PutVal(&record, 1, instr->copy.dst);
+      break;
+    case TACKY_JMP_Z:
+    case TACKY_JMP_NZ:
+      record.args[0] = instr->jump_cond.target;
+      PutVal(&record, 1, instr->jump_cond.val);
+      break;
+    case TACKY_JMP:
+    case TACKY_LABEL:
+      record.args[0] = instr->label;
+      break;
+  }
+  memcpy(out, &record, sizeof(record));
+}
+
+bool WriteTackyFile(const TackyProgram* program, FILE* out) {
+  const TackyFunction* function = program->function_def;
+  TackyRecord* records = malloc(sizeof(TackyRecord) * (function->instr_length + 1));
+  if (records == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  for (int i = 0; i < function->instr_length; ++i) {
+    ToTackyRecord(&function->instructions[i], &records[i]);
+  }
+  IrHeader header;
+  memset(&header, 0, sizeof(header));
+  header.kind = IR_TACKY;
+  header.name = function->identifier;
+  header.record_count = function->instr_length;
+  bool written = WriteIrFile(out, &header, program->symbols, records,
+                             sizeof(TackyRecord));
+  free(records);
+  return written;
+}
+
+// A file mapped for reading, its header and symbol table already checked.
+typedef struct {
+  const char* file_name;
+  const uint8_t* data;
+  size_t size;
+  const IrHeader* header;
+  const void* records;
+} IrFile;
+
+static void InvalidIrFile(const IrFile* file) {
+  fprintf(Diagnostics(), "%s is not a valid bcc IR file\n", file->file_name);
+  Fail();
+}
+
+static bool InBounds(const IrFile* file, uint64_t offset, uint64_t size) {
+  return offset % 4 == 0 && offset <= file->size && size <= file->size - offset;
+}
+
+static IrFile MapIrFile(const char* file_name, IrKind kind, size_t record_size) {
+  IrFile file = {.file_name = file_name};
+  int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(Diagnostics(), "Failed to read %s", file_name);
+    Fail();
+  }
+  if (!S_ISREG(st.st_mode) || (size_t) st.st_size < sizeof(IrHeader)) {
+    InvalidIrFile(&file);
+  }
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(Diagnostics(), "Failed to read %s", file_name);
+    Fail();
+  }
+  file.data = map;
+  file.size = st.st_size;
+  file.header = map;
+  const IrHeader* header = file.header;
+  if (memcmp(header->magic, ir_magic, sizeof(ir_magic)) != 0 ||
+      header->version != IR_FILE_VERSION ||
+      header->byte_order != IR_BYTE_ORDER ||
+      header->record_size != record_size || header->kind != kind ||
+      header->name >= header->symbol_count ||
+      !InBounds(&file, header->symbols,
+                (uint64_t) header->symbol_count * sizeof(SymbolRecord)) ||
+      header->strings > file.size ||
+      header->strings_size > file.size - header->strings ||
+      !InBounds(&file, header->records,
+                (uint64_t) header->record_count * record_size)) {
+    InvalidIrFile(&file);
+  }
+  file.records = file.data + header->records;
+  return file;
+}
+
+static void UnmapIrFile(IrFile* file) {
+  munmap((void*) file->data, file->size);
+}
+
+// Interns the names in file order, a name that shows up twice would give two
+// symbols the same number.
+static Interner* ReadSymbols(Arena* arena, const IrFile* file) {
+  const IrHeader* header = file->header;
+  const SymbolRecord* table = (const SymbolRecord*) (file->data + header->symbols);
+  const char* strings = (const char*) file->data + header->strings;
+  Interner* symbols = arena_alloc(arena, sizeof(Interner));
+  *symbols = NewInterner(arena);
+  for (uint32_t i = 0; i < header->symbol_count; ++i) {
+    SymbolRecord symbol = table[i];
+    if (symbol.offset >= header->strings_size ||
+        symbol.length >= header->strings_size - symbol.offset ||
+        strings[symbol.offset + symbol.length] != '\0' ||
+        Intern(symbols, strings + symbol.offset, symbol.length) != i) {
+      InvalidIrFile(file);
+    }
+  }
+  return symbols;
+}
+
+Program* ReadAstFile(Arena* arena, Arena* ir, const char* file_name) {
+  IrFile file = MapIrFile(file_name, IR_AST, sizeof(AstRecord));
+  const IrHeader* header = file.header;
+  if (header->statement != S_RETURN || header->record_count == 0) {
+    InvalidIrFile(&file);
+  }
+  Program* program = arena_alloc(ir, sizeof(Program));
+  program->symbols = ReadSymbols(arena, &file);
+  Function* function = arena_alloc(ir, sizeof(Function));
+  function->name = header->name;
+  function->statement = arena_alloc(ir, sizeof(Statement));
+  program->function = function;
+  // Record i becomes exps[i], so an operand is always one already filled in.
+  const AstRecord* records = file.records;
+  Exp* exps = arena_alloc(ir, sizeof(Exp) * header->record_count);
+  for (uint32_t i = 0; i < header->record_count; ++i) {
+    AstRecord record = records[i];
+    Exp* exp = &exps[i];
+    exp->type = record.type;
+    switch (record.type) {
+      case eConst:
+        exp->const_val = (int) record.a;
+        break;
+      case eUnaryExp:
+        if (record.op > LOGICAL_NOT || record.a >= i) {
+          InvalidIrFile(&file);
+        }
+        exp->unary_exp = (UnaryExp) {.op_type = record.op, .exp = &exps[record.a]};
+        break;
+      case eBinaryExp:
+        if (record.op > LESS_OR_EQUAL || record.a >= i || record.b >= i) {
+          InvalidIrFile(&file);
+        }
+        exp->binary_exp = (BinaryExp) {
+            .op = record.op, .left = &exps[record.a], .right = &exps[record.b]};
+        break;
+      default:
+        InvalidIrFile(&file);
+    }
+  }
+  function->statement->type = header->statement;
+  function->statement->exp = &exps[header->record_count - 1];
+  UnmapIrFile(&file);
+  return program;
+}
+
+static bool GetVal(const IrFile* file, const TackyRecord* record, int i,
+                   TackyVal* val) {
+  if (record->vars & (1 << i)) {
+    *val = (TackyVal) {.type = TACKY_VAR, .identifier = record->args[i]};
+    return record->args[i] < file->header->symbol_count;
+  }
+  *val = (TackyVal) {.type = TACKY_CONST, .const_val = (int) record->args[i]};
+  return true;
+}
+
+static bool FromTackyRecord(const IrFile* file, const TackyRecord* record,
+                            TackyInstruction* instr) {
+  instr->type = record->type;
+  bool is_symbol = record->args[0] < file->header->symbol_count;
+  switch (record->type) {
+    case TACKY_RETURN:
+      return GetVal(file, record, 0, &instr->return_val);
+    case TACKY_UNARY:
+      instr->unary.op = record->op;
+      return record->op <= TACKY_L_NOT &&
+             GetVal(file, record, 0, &instr->unary.src) &&
+             GetVal(file, record, 1, &instr->unary.dst);
+    case TACKY_BINARY:
+      instr->binary.op = record->op;
+      return record->op <= TACKY_LE_EQUAL &&
+             GetVal(file, record, 0, &instr->binary.left) &&
+             GetVal(file, record, 1, &instr->binary.right) &&
+             GetVal(file, record, 2, &instr->binary.dst);
+    case TACKY_COPY:
+      return GetVal(file, record, 0, &instr->copy.src) &&
+             GetVal(file, record, 1, &instr->copy.dst);
+    case TACKY_JMP_Z:
+    case TACKY_JMP_NZ:
+      instr->jump_cond.target = record->args[0];
+      return is_symbol && GetVal(file, record, 1, &instr->jump_cond.val);
+    case TACKY_JMP:
+    case TACKY_LABEL:
+      instr->label = record->args[0];
+      return is_symbol;
+    default:
+      return false;
+  }
+}
+
+TackyProgram* ReadTackyFile(Arena* arena, Pool* pool, const char* file_name) {
+  IrFile file = MapIrFile(file_name, IR_TACKY, sizeof(TackyRecord));
+  const IrHeader* header = file.header;
+  if (header->record_count > INT32_MAX) {
+    InvalidIrFile(&file);
+  }
+  TackyProgram* program = arena_alloc(pool->arena, sizeof(TackyProgram));
+  program->symbols = ReadSymbols(arena, &file);
+  TackyFunction* function = arena_alloc(pool->arena, sizeof(TackyFunction));
+  function->identifier = header->name;
+  function->instr_length = header->record_count;
+  function->instr_capacity = header->record_count;
+  function->instructions =
+      pool_alloc(pool, sizeof(TackyInstruction) * function->instr_capacity);
+  const TackyRecord* records = file.records;
+  for (uint32_t i = 0; i < header->record_count; ++i) {
+    if (!FromTackyRecord(&file, &records[i], &function->instructions[i])) {
+      InvalidIrFile(&file);
+    }
+  }
+  program->function_def = function;
+  UnmapIrFile(&file);
+  return program;
+}
@@ -0,0 +1,39 @@
+#ifndef BCC_SRC_IR_FILE_H
+#define BCC_SRC_IR_FILE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "arena.h"
+#include "ir_gen.h"
+#include "parser.h"
+#include "pool.h"
+
+// The AST or Tacky of a program as a flat binary file, so a later run can
+// pick the compile up where this one left off.
+//
+// Layout: a header, the symbol table as (offset, length) pairs into the
+// NUL terminated strings that follow it, then fixed size records for the
+// expressions or instructions. Every reference is an offset from the start
+// of the file, a symbol number or a record index, never a pointer, so the
+// file can be mapped anywhere and read in place. Expressions come after
+// the expressions they use, the last one is the statement's.
+//
+// Numbers are in the writer's byte order and records are its structs as
+// laid out in memory. The header says which byte order and record size
+// that was, and a file that doesn't match is rejected rather than read
+// wrongly.
+
+#define AST_FILE_EXTENSION "ast"
+#define TACKY_FILE_EXTENSION "tacky"
+
+// False if writing failed.
+bool WriteAstFile(const Program* program, FILE* out);
+bool WriteTackyFile(const TackyProgram* program, FILE* out);
+
+// Load what the writers above wrote. Names go into a new interner on
+// `arena`, in the order they were numbered in, so every symbol keeps its
+// number. The program itself goes on `ir`, or `pool` for Tacky.
+Program* ReadAstFile(Arena* arena, Arena* ir, const char* file_name);
+TackyProgram* ReadTackyFile(Arena* arena, Pool* pool, const char* file_name);
+
+#endif //BCC_SRC_IR_FILE_H
@@ -3,22 +3,40 @@
 #include <assert.h>
 #include <string.h>
 #include "arena.h"
+#include "pool.h"
 #include "ir_gen.h"
 #include "parser.h"
+#include "diagnostics.h"
 
-int tmp_count = 0;
-int label_count = 0;
+// Per thread, so files compiled side by side number their temps and labels
+// just as they would alone.
+_Thread_local int tmp_count = 0;
+_Thread_local int label_count = 0;
+// symbol table of the program being emitted, temps and labels go in here.
+_Thread_local Interner* symbols;
 
-TackyVal EmitTacky(Arena* arena, Exp* exp, TackyFunction* tf);
+TackyVal EmitTacky(Pool* pool, Exp* exp, TackyFunction* tf);
 
-// Assumes no allocations concurrently.
-void AppendInstruction(Arena* arena, TackyFunction* tf, TackyInstruction instr) {
-  if (tf->instr_length == 0) {
-    tf->instructions = arena_alloc(arena, sizeof(TackyInstruction));
-  } else {
-    arena_alloc(arena, sizeof(TackyInstruction));
+Symbol NewName(const char* prefix, int count) {
+  char name[32];
+  int length = snprintf(name, sizeof(name), "%s%d", prefix, count);
+  return Intern(symbols, name, length);
+}
+
+Symbol NewTemp(void) {
+  return NewName("tmp.", tmp_count++);
+}
+
+// Grows the instruction array geometrically, the outgrown array goes back to
+// the pool.
+void AppendInstruction(Pool* pool, TackyFunction* tf, TackyInstruction instr) {
+  if (tf->instr_length == tf->instr_capacity) {
+    int capacity = tf->instr_capacity == 0 ? 16 : tf->instr_capacity * 2;
+    tf->instructions = pool_realloc(pool, tf->instructions,
+                                     sizeof(TackyInstruction) * tf->instr_capacity,
+                                     sizeof(TackyInstruction) * capacity);
+    tf->instr_capacity = capacity;
   }
-  arena_alloc(arena, sizeof(TackyInstruction));
   tf->instructions[tf->instr_length++] = instr;
 }
 
@@ -31,8 +49,8 @@ TackyUnaryOp ConvertOp(UnaryOp op) {
     case LOGICAL_NOT:
       return TACKY_L_NOT;
     default:
-      fprintf(stderr, "bad unary op found\n");
-      exit(2);
+      fprintf(Diagnostics(), "bad unary op found\n");
+      Fail();
   }
 }
 
@@ -71,7 +89,7 @@ TackyBinaryOp ConvertBinaryOp(BinaryOp op) {
     case NOT_EQUAL:
       return TACKY_NOT_EQUAL;
     default:
-      fprintf(stderr, "Unexpected binary op type: %d", op);
+      fprintf(Diagnostics(), "Unexpected binary op type: %d", op);
   }
 }
 
@@ -86,17 +104,15 @@ bool ShouldExpandBinary(Exp* exp) {
   }
 }
 
-void AssignLabel(BinaryOp op, char* dst) {
+Symbol AssignLabel(BinaryOp op) {
   switch (op) {
     case LOGICAL_AND:
-      snprintf(dst, 20, "false_%d", label_count);
-      return;
+      return NewName("false_", label_count);
     case LOGICAL_OR:
-      snprintf(dst, 20, "true_%d", label_count);
-      return;
+      return NewName("true_", label_count);
     default:
-      fprintf(stderr, "bad label op code\n");
-      exit(2);
+      fprintf(Diagnostics(), "bad label op code\n");
+      Fail();
   }
 }
 
@@ -109,23 +125,23 @@ void BuildBinaryJmp(BinaryOp op, TackyInstruction* jmp) {
     jmp->type = TACKY_JMP_NZ;
     return;
   }
-  fprintf(stderr, "unexpected jmp op call\n");
-  exit(2);
+  fprintf(Diagnostics(), "unexpected jmp op call\n");
+  Fail();
 }
 
 // this is for logical AND and OR, in which we need to potentially
 // short circuit.
-TackyVal ExpandBinaryExp(Arena* arena, BinaryExp exp, TackyFunction* tf) {
+TackyVal ExpandBinaryExp(Pool* pool, BinaryExp exp, TackyFunction* tf) {
   // evaluate the expression on left and jump to end if false.
   TackyInstruction jmp;
   BuildBinaryJmp(exp.op, &jmp);
-  jmp.jump_cond.val = EmitTacky(arena, exp.left, tf);
-  AssignLabel(exp.op, jmp.jump_cond.target);
+  jmp.jump_cond.val = EmitTacky(pool, exp.left, tf);
+  jmp.jump_cond.target = AssignLabel(exp.op);
   label_count++;
-  AppendInstruction(arena, tf, jmp);
+  AppendInstruction(pool, tf, jmp);
   // do the same for the right. reusing jmp.
-  jmp.jump_cond.val = EmitTacky(arena, exp.right, tf);
-  AppendInstruction(arena, tf, jmp);
+  jmp.jump_cond.val = EmitTacky(pool, exp.right, tf);
+  AppendInstruction(pool, tf, jmp);
   // if we make it this far, mark as true if AND false if OR. and jump to end
   TackyInstruction copy = {
       .type = TACKY_COPY,
@@ -139,35 +155,35 @@ TackyVal ExpandBinaryExp(Arena* arena, BinaryExp exp, TackyFunction* tf) {
           }
       }
   };
-  sprintf(copy.copy.dst.identifier, "tmp.%d", tmp_count++);
-  AppendInstruction(arena, tf, copy);
+  copy.copy.dst.identifier = NewTemp();
+  AppendInstruction(pool, tf, copy);
   TackyInstruction endJump;
   endJump.type = TACKY_JMP;
-  snprintf(endJump.jump_cond.target, 20, "end_%d", label_count++);
-  AppendInstruction(arena, tf, endJump);
+  endJump.jump_cond.target = NewName("end_", label_count++);
+  AppendInstruction(pool, tf, endJump);
 
   TackyInstruction label;
   label.type = TACKY_LABEL;
-  strcpy(label.label, jmp.label);
-  AppendInstruction(arena, tf, label);
+  label.label = jmp.jump_cond.target;
+  AppendInstruction(pool, tf, label);
   // for the fail case mark as result as zero.
   copy.copy.src.const_val = exp.op == LOGICAL_AND ? 0 : 1;
-  AppendInstruction(arena, tf, copy);
-  strcpy(label.label, endJump.label);
-  AppendInstruction(arena, tf, label);
+  AppendInstruction(pool, tf, copy);
+  label.label = endJump.jump_cond.target;
+  AppendInstruction(pool, tf, label);
   return copy.copy.dst;
 }
 
-TackyVal EmitTacky(Arena* arena, Exp* exp, TackyFunction* tf) {
+TackyVal EmitTacky(Pool* pool, Exp* exp, TackyFunction* tf) {
   switch (exp->type) {
     case eConst: {
       TackyVal const_val = {.type = TACKY_CONST, .const_val =  exp->const_val};
       return const_val;
     }
     case eUnaryExp: {
-      TackyVal src = EmitTacky(arena, exp->unary_exp.exp, tf);
+      TackyVal src = EmitTacky(pool, exp->unary_exp.exp, tf);
       TackyVal dst = {.type = TACKY_VAR};
-      sprintf(dst.identifier, "tmp.%d", tmp_count++);
+      dst.identifier = NewTemp();
       TackyUnaryOp op = ConvertOp(exp->unary_exp.op_type);
       TackyInstruction t_instr = {
           .type = TACKY_UNARY,
@@ -175,17 +191,17 @@ TackyVal EmitTacky(Arena* arena, Exp* exp, TackyFunction* tf) {
           .unary.src = src,
           .unary.dst = dst
       };
-      AppendInstruction(arena, tf, t_instr);
+      AppendInstruction(pool, tf, t_instr);
       return dst;
     }
     case eBinaryExp: {
       if (ShouldExpandBinary(exp)) {
-        return ExpandBinaryExp(arena, exp->binary_exp, tf);
+        return ExpandBinaryExp(pool, exp->binary_exp, tf);
       }
-      TackyVal left = EmitTacky(arena, exp->binary_exp.left, tf);
-      TackyVal right = EmitTacky(arena, exp->binary_exp.right, tf);
+      TackyVal left = EmitTacky(pool, exp->binary_exp.left, tf);
+      TackyVal right = EmitTacky(pool, exp->binary_exp.right, tf);
       TackyVal dst = {.type = TACKY_VAR};
-      sprintf(dst.identifier, "tmp.%d", tmp_count++);
+      dst.identifier = NewTemp();
       TackyBinaryOp op = ConvertBinaryOp(exp->binary_exp.op);
       TackyInstruction t_instr = {
           .type = TACKY_BINARY,
@@ -194,28 +210,34 @@ TackyVal EmitTacky(Arena* arena, Exp* exp, TackyFunction* tf) {
           .binary.right = right,
           .binary.dst = dst,
       };
-      AppendInstruction(arena, tf, t_instr);
+      AppendInstruction(pool, tf, t_instr);
       return dst;
     }
   }
 }
 
-TackyFunction* EmitTackyFunction(Arena* arena, Function* func) {
-  TackyFunction* t_func = arena_alloc(arena, sizeof(TackyFunction));
+TackyFunction* EmitTackyFunction(Pool* pool, Function* func) {
+  TackyFunction* t_func = arena_alloc(pool->arena, sizeof(TackyFunction));
   t_func->identifier = func->name;
+  t_func->instructions = NULL;
   t_func->instr_length = 0;
-  TackyVal src = EmitTacky(arena, func->statement->exp, t_func);
+  t_func->instr_capacity = 0;
+  TackyVal src = EmitTacky(pool, func->statement->exp, t_func);
   TackyInstruction return_instr = {
       .type = TACKY_RETURN,
       .return_val = src
   };
-  AppendInstruction(arena, t_func, return_instr);
+  AppendInstruction(pool, t_func, return_instr);
   return t_func;
 }
 
-TackyProgram* EmitTackyProgram(Arena* arena, Program* program) {
-  TackyProgram* pgrm = arena_alloc(arena, sizeof(TackyProgram));
-  pgrm->function_def = EmitTackyFunction(arena, program->function);
+TackyProgram* EmitTackyProgram(Pool* pool, Program* program) {
+  TackyProgram* pgrm = arena_alloc(pool->arena, sizeof(TackyProgram));
+  tmp_count = 0;
+  label_count = 0;
+  symbols = program->symbols;
+  pgrm->symbols = program->symbols;
+  pgrm->function_def = EmitTackyFunction(pool, program->function);
   return pgrm;
 } 
 
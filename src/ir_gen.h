@@ -22,6 +22,8 @@
  */
 
 #include "arena.h"
+#include "intern.h"
+#include "pool.h"
 #include "parser.h"
 
 typedef enum {
@@ -58,7 +60,7 @@ typedef struct {
   TackyValType type;
   union {
     int const_val;
-    char identifier[32]; 
+    Symbol identifier;
   };
 } TackyVal;
 
@@ -68,8 +70,6 @@ typedef struct {
   TackyVal dst;  
 } TackyUnary;
 
-typedef char labelStr[20];
-
 typedef struct {
   TackyBinaryOp op;
   TackyVal left;
@@ -78,7 +78,7 @@ typedef struct {
 } TackyBinary;
 
 typedef struct {
-  labelStr target;
+  Symbol target;
   TackyVal val;
 } JumpCond;
 
@@ -105,7 +105,7 @@ typedef struct {
     TackyUnary unary;
     TackyBinary binary;
     JumpCond jump_cond;
-    labelStr label;
+    Symbol label;
     TackyCopy copy;
   };
 } TackyInstruction;
@@ -113,13 +113,15 @@ typedef struct {
 typedef struct {
   TackyInstruction* instructions;
   int instr_length;
-  char* identifier;
+  int instr_capacity;
+  Symbol identifier;
 } TackyFunction;
 
 typedef struct {
   TackyFunction* function_def;
+  Interner* symbols;
 } TackyProgram;
 
-TackyProgram* EmitTackyProgram(Arena* arena, Program* program);
+TackyProgram* EmitTackyProgram(Pool* pool, Program* program);
 
 #endif // BCC_SRC_IR_GEN_H
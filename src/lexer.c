@@ -1,72 +1,277 @@
+#define _GNU_SOURCE
 #include "lexer.h"
+#include "char_class.h"
+#include "diagnostics.h"
 #include <stdio.h>
-#include <ctype.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define MAX_TOKENS 100
+#define INITIAL_TOKENS 64
+#define READ_SIZE (64 * 1024)
+// Below this much source per thread, starting a thread costs more than it
+// saves.
+#define MIN_LEX_CHUNK (1 << 20)
+#define MAX_LEX_THREADS 64
 
-bool IsBreak(char c) {
-  if (isspace(c)) {
-    return true;
+// Rebuilds the cursor pointers after the buffer moves.
+static void Rebase(Lexer *lexer, char *buf) {
+  lexer->cur = buf + (lexer->cur - lexer->start);
+  lexer->end = buf + (lexer->end - lexer->start);
+  lexer->complete = buf + (lexer->complete - lexer->start);
+  lexer->start = buf;
+}
+
+// Reads until at least one more complete line is buffered or the input ends.
+// Returns false when there was nothing left to read.
+static bool Refill(Lexer *lexer) {
+  if (lexer->fd < 0) {
+    return false;
   }
-  if (c == EOF) {
-    return true;
+  for (;;) {
+    size_t length = lexer->end - lexer->start;
+    if (lexer->capacity - length < READ_SIZE) {
+      size_t capacity = lexer->capacity * 2 + READ_SIZE;
+      if (capacity > UINT32_MAX) {
+        fprintf(Diagnostics(), "source file too large to lex");
+        Fail();
+      }
+      char *buf = realloc((char *) lexer->start, capacity + 1);
+      if (buf == NULL) {
+        fprintf(Diagnostics(), "failed to allocate memory");
+        Fail();
+      }
+      Rebase(lexer, buf);
+      lexer->capacity = capacity;
+    }
+    char *end = (char *) lexer->end;
+    ssize_t n = read(lexer->fd, end, lexer->capacity - length);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      fprintf(Diagnostics(), "failed to read source");
+      Fail();
+    }
+    if (n == 0) {
+      close(lexer->fd);
+      lexer->fd = -1;
+      lexer->complete = lexer->end;
+      return true;
+    }
+    lexer->end = end + n;
+    *(char *) lexer->end = '\0';
+    const char *newline = memrchr(end, '\n', n);
+    if (newline != NULL) {
+      lexer->complete = newline + 1;
+      return true;
+    }
   }
-  char *brk = BRK;
-  while (*brk != '\0') {
-    if (c == *brk) {
+}
+
+bool OpenSourceFd(Lexer *lexer, int fd) {
+  struct stat st;
+  long page_size = sysconf(_SC_PAGESIZE);
+  lexer->mapped_length = 0;
+  lexer->fd = -1;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      st.st_size % page_size != 0 && st.st_size <= UINT32_MAX) {
+    // the kernel zero fills the tail of the last page, which gives us the
+    // NUL terminator for free.
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      lexer->start = lexer->cur = map;
+      lexer->end = lexer->complete = lexer->start + st.st_size;
+      lexer->mapped_length = st.st_size;
+      lexer->capacity = st.st_size;
+      close(fd);
       return true;
     }
-    brk++;
   }
-  return false;
+  // Pipes, empty files and files that end exactly on a page boundary can't
+  // give us a NUL after the last byte, so read them as we go instead.
+  char *buf = malloc(READ_SIZE + 1);
+  if (buf == NULL) {
+    close(fd);
+    return false;
+  }
+  buf[0] = '\0';
+  lexer->start = lexer->cur = lexer->end = lexer->complete = buf;
+  lexer->capacity = READ_SIZE;
+  lexer->fd = fd;
+  return true;
 }
 
-Token GetAlphaToken(FILE *fp) {
-  Token result;
-  int index = 0;
-  char c = fgetc(fp);
-  while (isalpha(c)) {
-    result.value[index++] = c;
-    c = fgetc(fp);
+void OpenSourceBuffer(Lexer *lexer, char *buffer, size_t length) {
+  if (length > UINT32_MAX) {
+    fprintf(Diagnostics(), "source file too large to lex");
+    Fail();
   }
+  buffer[length] = '\0';
+  lexer->start = lexer->cur = buffer;
+  lexer->end = lexer->complete = buffer + length;
+  lexer->mapped_length = 0;
+  lexer->capacity = length;
+  lexer->fd = -1;
+}
 
-  ungetc(c, fp);
-  result.value[index] = '\0';
-  if (IsBreak(c)) {
-    if (strcmp(result.value, "int") == 0) {
-      result.type = tInt;
-      return result;
-    }
-    if (strcmp(result.value, "return") == 0) {
-      result.type = tReturn;
-      return result;
+bool OpenSource(Lexer *lexer, const char *file_name) {
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  return OpenSourceFd(lexer, fd);
+}
+
+void CloseSource(Lexer *lexer) {
+  if (lexer->fd >= 0) {
+    close(lexer->fd);
+    lexer->fd = -1;
+  }
+  if (lexer->mapped_length != 0) {
+    munmap((void *) lexer->start, lexer->mapped_length);
+    lexer->mapped_length = 0;
+  } else {
+    free((void *) lexer->start);
+  }
+  lexer->start = lexer->cur = lexer->end = lexer->complete = NULL;
+}
+
+bool IsBreak(char c) {
+  return IsClass(c, CC_BREAK);
+}
+
+typedef struct {
+  const char *text;
+  uint8_t length;
+  uint8_t type;
+} Keyword;
+
+#define MIN_KEYWORD_LENGTH 2
+#define MAX_KEYWORD_LENGTH 8
+#define KEYWORD_SLOTS 128
+
+// A perfect hash over the C keywords, found by searching the multipliers until
+// no two keywords landed in the same slot. Adding a keyword can break that,
+// and a keyword that loses its slot to another just stops being found, so
+// CheckKeywords looks each one up at startup.
+#define KEYWORD_HASH(first, second, last, length)                          \
+  (((unsigned char) (first) * 6 + (unsigned char) (second) * 17 +          \
+    (unsigned char) (last) + (length)) & (KEYWORD_SLOTS - 1))
+
+// Identifiers are letters only, so C11's _Bool and friends can't be lexed
+// and aren't listed.
+#define KEYWORDS(X) \
+  X('a', 'u', 'o', "auto", tAuto) \
+  X('b', 'r', 'k', "break", tBreak) \
+  X('c', 'a', 'e', "case", tCase) \
+  X('c', 'h', 'r', "char", tChar) \
+  X('c', 'o', 't', "const", tConst) \
+  X('c', 'o', 'e', "continue", tContinue) \
+  X('d', 'e', 't', "default", tDefault) \
+  X('d', 'o', 'o', "do", tDo) \
+  X('d', 'o', 'e', "double", tDouble) \
+  X('e', 'l', 'e', "else", tElse) \
+  X('e', 'n', 'm', "enum", tEnum) \
+  X('e', 'x', 'n', "extern", tExtern) \
+  X('f', 'l', 't', "float", tFloat) \
+  X('f', 'o', 'r', "for", tFor) \
+  X('g', 'o', 'o', "goto", tGoto) \
+  X('i', 'f', 'f', "if", tIf) \
+  X('i', 'n', 'e', "inline", tInline) \
+  X('i', 'n', 't', "int", tInt) \
+  X('l', 'o', 'g', "long", tLong) \
+  X('r', 'e', 'r', "register", tRegister) \
+  X('r', 'e', 't', "restrict", tRestrict) \
+  X('r', 'e', 'n', "return", tReturn) \
+  X('s', 'h', 't', "short", tShort) \
+  X('s', 'i', 'd', "signed", tSigned) \
+  X('s', 'i', 'f', "sizeof", tSizeof) \
+  X('s', 't', 'c', "static", tStatic) \
+  X('s', 't', 't', "struct", tStruct) \
+  X('s', 'w', 'h', "switch", tSwitch) \
+  X('t', 'y', 'f', "typedef", tTypedef) \
+  X('u', 'n', 'n', "union", tUnion) \
+  X('u', 'n', 'd', "unsigned", tUnsigned) \
+  X('v', 'o', 'd', "void", tVoid) \
+  X('v', 'o', 'e', "volatile", tVolatile) \
+  X('w', 'h', 'e', "while", tWhile)
+
+#define KEYWORD(first, second, last, text, type) \
+  [KEYWORD_HASH(first, second, last, sizeof(text) - 1)] = {text, sizeof(text) - 1, type},
+
+static const Keyword keywords[KEYWORD_SLOTS] = {KEYWORDS(KEYWORD)};
+
+// One hash and one compare, identifiers that miss the table don't pay more
+// as keywords get added.
+static TokenType LookupKeyword(const char *text, size_t length) {
+  if (length < MIN_KEYWORD_LENGTH || length > MAX_KEYWORD_LENGTH) {
+    return tIdentifier;
+  }
+  const Keyword *keyword =
+      &keywords[KEYWORD_HASH(text[0], text[1], text[length - 1], length)];
+  if (keyword->length == length && memcmp(keyword->text, text, length) == 0) {
+    return keyword->type;
+  }
+  return tIdentifier;
+}
+
+#define KEYWORD_ENTRY(first, second, last, text, type) {text, sizeof(text) - 1, type},
+
+__attribute__((constructor)) static void CheckKeywords(void) {
+  static const Keyword all[] = {KEYWORDS(KEYWORD_ENTRY)};
+  for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); ++i) {
+    if (all[i].length > MAX_KEYWORD_LENGTH ||
+        LookupKeyword(all[i].text, all[i].length) != all[i].type) {
+      fprintf(stderr, "keyword table: \"%s\" collides, change KEYWORD_HASH\n",
+              all[i].text);
+      exit(2);
     }
-    if (strcmp(result.value, "void") == 0) {
-      result.type = tVoid;
-      return result;
+  }
+}
+
+Token GetAlphaToken(Lexer *lexer, Token result) {
+  const char *p = SkipAlpha(lexer->cur, lexer->end);
+  const char *text = lexer->cur;
+  size_t length = p - text;
+  lexer->cur = p;
+  result.length = length;
+  if (length > UINT16_MAX) {
+    result.type = tInvalidToken;
+    result.length = UINT16_MAX;
+    return result;
+  }
+  if (IsBreak(*p)) {
+    result.type = LookupKeyword(text, length);
+    if (result.type == tIdentifier) {
+      result.symbol = Intern(lexer->symbols, text, length);
     }
-    result.type = tIdentifier;
     return result;
   }
   result.type = tInvalidToken;
   return result;
 }
 
-Token GetConstantToken(FILE *fp) {
-  Token result;
-  int index = 0;
-  char c = fgetc(fp);
-  while (isdigit(c)) {
-    result.value[index++] = c;
-    c = fgetc(fp);
+Token GetConstantToken(Lexer *lexer, Token result) {
+  const char *p = lexer->cur;
+  // wraps on overflow, same as atoi did.
+  uint32_t value = 0;
+  const char *last = SkipDigits(p, lexer->end);
+  for (; p < last; ++p) {
+    value = value * 10 + (*p - '0');
   }
-
-  ungetc(c, fp);
-  result.value[index] = '\0';
-  if (IsBreak(c)) {
+  size_t length = p - lexer->cur;
+  lexer->cur = p;
+  result.length = length > UINT16_MAX ? UINT16_MAX : length;
+  result.value = (int32_t) value;
+  if (IsBreak(*p) && length <= UINT16_MAX) {
     result.type = tConstant;
     return result;
   }
@@ -74,17 +279,33 @@ Token GetConstantToken(FILE *fp) {
   return result;
 }
 
-Token NextToken(FILE *fp) {
-  Token result;
-  char c = fgetc(fp);
-  // trim whitespace before next token.
-  while (isspace(c)) {
-    c = fgetc(fp);
+// Consumes the next character when it is `c`.
+static bool Match(Lexer *lexer, char c) {
+  if (*lexer->cur == c) {
+    lexer->cur++;
+    return true;
   }
-  if (c == EOF) {
-    result.type = tEof;
-    return result;
+  return false;
+}
+
+Token NextToken(Lexer *lexer) {
+  const char *p = lexer->cur;
+  for (;;) {
+    // trim whitespace before next token.
+    p = SkipSpace(p, lexer->end);
+    if (p < lexer->complete) {
+      break;
+    }
+    lexer->cur = p;
+    if (!Refill(lexer)) {
+      Token eof = {.offset = p - lexer->start, .length = 0, .type = tEof};
+      return eof;
+    }
+    p = lexer->cur;
   }
+  Token result = {.offset = p - lexer->start, .length = 1, .value = 0};
+  char c = *p;
+  lexer->cur = p + 1;
   switch (c) {
     case '{':
       result.type = tOpenBrace;
@@ -105,149 +326,357 @@ Token NextToken(FILE *fp) {
       result.type = tTilde;
       return result;
     case '-':
-      c = fgetc(fp);
-      if (c == '-') {
+      if (Match(lexer, '-')) {
         result.type = tInvalidToken;
-        strcpy("--", result.value);
+        result.length = 2;
         return result;
       }
-      ungetc(c, fp);
       result.type = tMinus;
       return result;
     case '+':
-      c = fgetc(fp);
-      if (c == '+') {
+      if (Match(lexer, '+')) {
         result.type = tInvalidToken;
-        strcpy("++", result.value);
+        result.length = 2;
         return result;
       }
-      ungetc(c, fp);
       result.type = tPlus;
       return result;
     case '/':
-      c = fgetc(fp);
-      if (c == '/') {
+      if (Match(lexer, '/')) {
         result.type = tInvalidToken;
-        strcpy("//", result.value);
+        result.length = 2;
         return result;
       }
-      ungetc(c, fp);
       result.type = tForSlash;
       return result;
     case '*':
-      c = fgetc(fp);
-      if (c == '*') {
+      if (Match(lexer, '*')) {
         result.type = tInvalidToken;
-        strcpy("**", result.value);
+        result.length = 2;
         return result;
       }
-      ungetc(c, fp);
       result.type = tAsterik;
       return result;
     case '%':
       result.type = tModulo;
       return result;
     case '!':
-      c = fgetc(fp);
-      if (c == '=') {
+      if (Match(lexer, '=')) {
         result.type = tNotEqual;
+        result.length = 2;
         return result;
       }
-      ungetc(c, fp);
       result.type = tLogicalNot;
       return result;
     case '=':
-      c = fgetc(fp);
-      if (c == '=') {
+      if (Match(lexer, '=')) {
         result.type = tEqual;
+        result.length = 2;
         return result;
       }
       result.type = tInvalidToken;
-      result.value[0] = '=';
-      result.value[1] = c;
-      result.value[2] = '\0';
-    case '|': {
-      c = fgetc(fp);
-      if (c == '|') {
+      return result;
+    case '|':
+      if (Match(lexer, '|')) {
         result.type = tLogicalOr;
+        result.length = 2;
         return result;
       }
-      ungetc(c, fp);
       result.type = tOr;
       return result;
-    }
-    case '&': {
-      c = fgetc(fp);
-      if (c == '&') {
+    case '&':
+      if (Match(lexer, '&')) {
         result.type = tLogicalAnd;
+        result.length = 2;
         return result;
       }
-      ungetc(c, fp);
       result.type = tAnd;
       return result;
-    }
     case '^':
       result.type = tXor;
       return result;
-    case '<': {
-      c = fgetc(fp);
-      if (c == '<') {
+    case '<':
+      if (Match(lexer, '<')) {
         result.type = tLeftShift;
-        return result;
-      } else if (c == '=') {
+        result.length = 2;
+      } else if (Match(lexer, '=')) {
         result.type = tLessOrEqual;
-        return result;
+        result.length = 2;
+      } else {
+        result.type = tLessThan;
       }
-      ungetc(c, fp);
-      result.type = tLessThan;
       return result;
-    }
-    case '>': {
-      c = fgetc(fp);
-      if (c == '>') {
+    case '>':
+      if (Match(lexer, '>')) {
         result.type = tRightShift;
-        return result;
-      } else if (c == '=') {
+        result.length = 2;
+      } else if (Match(lexer, '=')) {
         result.type = tGreaterOrEqual;
-        return result;
+        result.length = 2;
+      } else {
+        result.type = tGreaterThan;
       }
-      ungetc(c, fp);
-      result.type = tGreaterThan;
       return result;
-    }
     case 'a' ... 'z':
     case 'A' ... 'Z':
-      ungetc(c, fp);
-      return GetAlphaToken(fp);
+      lexer->cur = p;
+      return GetAlphaToken(lexer, result);
     case '0' ... '9':
-      ungetc(c, fp);
-      return GetConstantToken(fp);
+      lexer->cur = p;
+      return GetConstantToken(lexer, result);
     default:
       result.type = tInvalidToken;
-      result.value[0] = c;
-      result.value[1] = '\0';
       return result;
   }
 }
 
-TokenList Lex(FILE *fp) {
-  TokenList token_list;
-  Token *tokens = malloc(sizeof(Token) * MAX_TOKENS);
-  token_list.tokens = tokens;
-  int index = 0;
-  Token next_token = NextToken(fp);
+static void PushToken(TokenList *token_list, Token token) {
+  if (token_list->length == token_list->capacity) {
+    token_list->capacity *= 2;
+    token_list->tokens = realloc(token_list->tokens,
+                                 sizeof(Token) * token_list->capacity);
+    if (token_list->tokens == NULL) {
+      fprintf(Diagnostics(), "failed to allocate memory");
+      Fail();
+    }
+  }
+  token_list->tokens[token_list->length++] = token;
+}
+
+TokenList Lex(Lexer *lexer) {
+  TokenList token_list = {
+      // a rough guess of one token per eight bytes of source.
+      .capacity = INITIAL_TOKENS + (lexer->end - lexer->cur) / 8,
+      .length = 0,
+      .symbols = lexer->symbols,
+  };
+  token_list.tokens = malloc(sizeof(Token) * token_list.capacity);
+  if (token_list.tokens == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  Token next_token = NextToken(lexer);
   while (next_token.type != tInvalidToken && next_token.type != tEof) {
-    tokens[index++] = next_token;
-    next_token = NextToken(fp);
+    PushToken(&token_list, next_token);
+    next_token = NextToken(lexer);
+  }
+  PushToken(&token_list, next_token);
+  // read last, the buffer may have moved while lexing a pipe.
+  token_list.source = lexer->start;
+  return token_list;
+}
+
+// One slice of the source, lexed on its own thread into its own list. The
+// interner is private to the slice so the workers never share anything.
+typedef struct {
+  Lexer lexer;
+  Arena arena;
+  Interner symbols;
+  TokenList tokens;
+} LexChunk;
+
+static void *LexChunkWorker(void *arg) {
+  LexChunk *chunk = arg;
+  chunk->arena = allocate_arena(16 * 1024);
+  chunk->symbols = NewInterner(&chunk->arena);
+  chunk->lexer.symbols = &chunk->symbols;
+  chunk->tokens = Lex(&chunk->lexer);
+  return NULL;
+}
+
+// Appends a chunk's tokens, moving its identifiers over to the real interner.
+// Local symbols are numbered in order of first use and chunks are stitched in
+// source order, so every name gets the same symbol a single pass would give
+// it. Returns false once an invalid token has been copied.
+static bool StitchChunk(TokenList *token_list, LexChunk *chunk, bool last) {
+  Interner *local = &chunk->symbols;
+  Symbol *remap = malloc(sizeof(Symbol) * (local->count + 1));
+  if (remap == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  for (uint32_t s = 0; s < local->count; ++s) {
+    remap[s] = Intern(token_list->symbols, local->entries[s].text,
+                      local->entries[s].length);
+  }
+  bool more = true;
+  for (size_t i = 0; i < chunk->tokens.length; ++i) {
+    Token token = chunk->tokens.tokens[i];
+    if (token.type == tIdentifier) {
+      token.symbol = remap[token.symbol];
+    } else if (token.type == tEof && !last) {
+      // the end of a chunk, not of the source.
+      break;
+    } else if (token.type == tInvalidToken) {
+      more = false;
+    }
+    token_list->tokens[token_list->length++] = token;
+  }
+  free(remap);
+  FreeTokenList(&chunk->tokens);
+  release(&chunk->arena);
+  return more;
+}
+
+void ReadWholeSource(Lexer *lexer) {
+  while (lexer->fd >= 0) {
+    Refill(lexer);
+  }
+}
+
+TokenList LexParallel(Lexer *lexer, int threads) {
+  // the chunks need the whole source up front.
+  ReadWholeSource(lexer);
+  size_t length = lexer->end - lexer->cur;
+  size_t count = threads < MAX_LEX_THREADS ? threads : MAX_LEX_THREADS;
+  if (count > length / MIN_LEX_CHUNK) {
+    count = length / MIN_LEX_CHUNK;
+  }
+  if (count <= 1) {
+    return Lex(lexer);
   }
-  tokens[index++] = next_token;
-  token_list.length = index;
+  // No token spans a newline, so cutting just after one is always safe. Every
+  // chunk but the last ends in a newline, so peeking one past a token never
+  // reads into the next chunk.
+  LexChunk chunks[MAX_LEX_THREADS];
+  const char *from = lexer->cur;
+  for (size_t i = 0; i < count; ++i) {
+    const char *to = lexer->end;
+    if (i + 1 < count) {
+      to = lexer->cur + length * (i + 1) / count;
+      if (to < from) {
+        to = from;
+      }
+      const char *newline = memchr(to, '\n', lexer->end - to);
+      to = newline == NULL ? lexer->end : newline + 1;
+    }
+    chunks[i].lexer = (Lexer) {
+        .start = lexer->start,
+        .cur = from,
+        .end = to,
+        .complete = to,
+        .mapped_length = 0,
+        .capacity = 0,
+        .fd = -1,
+    };
+    from = to;
+  }
+  // the first chunk is lexed on this thread, if a thread can't be started its
+  // chunk is too.
+  pthread_t workers[MAX_LEX_THREADS];
+  bool started[MAX_LEX_THREADS] = {false};
+  for (size_t i = 1; i < count; ++i) {
+    started[i] = pthread_create(&workers[i], NULL, LexChunkWorker, &chunks[i]) == 0;
+  }
+  LexChunkWorker(&chunks[0]);
+  for (size_t i = 1; i < count; ++i) {
+    if (started[i]) {
+      pthread_join(workers[i], NULL);
+    } else {
+      LexChunkWorker(&chunks[i]);
+    }
+  }
+  TokenList token_list = {
+      .length = 0,
+      .capacity = 0,
+      .source = lexer->start,
+      .symbols = lexer->symbols,
+  };
+  for (size_t i = 0; i < count; ++i) {
+    token_list.capacity += chunks[i].tokens.length;
+  }
+  token_list.tokens = malloc(sizeof(Token) * token_list.capacity);
+  if (token_list.tokens == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  size_t i = 0;
+  while (i < count && StitchChunk(&token_list, &chunks[i], i + 1 == count)) {
+    i++;
+  }
+  // whatever follows an invalid token is dropped, as Lex would never get there.
+  for (i++; i < count; ++i) {
+    FreeTokenList(&chunks[i].tokens);
+    release(&chunks[i].arena);
+  }
+  lexer->cur = lexer->end;
   return token_list;
 }
 
-Token DequeueToken(TokenList *token_list) {
-  token_list->length--;
-  return *token_list->tokens++;
+void FreeTokenList(TokenList *token_list) {
+  free(token_list->tokens);
+  token_list->tokens = NULL;
+}
+
+const char *TokenText(const TokenList *token_list, Token token) {
+  return token_list->source + token.offset;
+}
+
+void ReportInvalidToken(const char *source, Token token) {
+  fprintf(Diagnostics(), "Failed to compile, got last token type %d and val %.*s",
+          token.type, token.length, source + token.offset);
+  Fail();
+}
+
+TokenStream StreamFromLexer(Lexer *lexer) {
+  TokenStream stream = {
+      .lexer = lexer,
+      .list = NULL,
+      .head = 0,
+      .count = 0,
+      .symbols = lexer->symbols,
+  };
+  return stream;
+}
+
+TokenStream StreamFromList(const TokenList *token_list) {
+  TokenStream stream = {
+      .lexer = NULL,
+      .list = token_list,
+      .list_pos = 0,
+      .head = 0,
+      .count = 0,
+      .symbols = token_list->symbols,
+  };
+  return stream;
+}
+
+// Pulls one more token into the ring, the lexer only runs here.
+static void PullToken(TokenStream *stream) {
+  Token token;
+  if (stream->lexer != NULL) {
+    token = NextToken(stream->lexer);
+    if (token.type == tInvalidToken) {
+      ReportInvalidToken(stream->lexer->start, token);
+    }
+  } else {
+    const TokenList *list = stream->list;
+    token = list->tokens[stream->list_pos];
+    if (token.type == tInvalidToken) {
+      ReportInvalidToken(list->source, token);
+    }
+    // keep handing out the final token once the list runs out.
+    if (stream->list_pos + 1 < list->length) {
+      stream->list_pos++;
+    }
+  }
+  unsigned tail = (stream->head + stream->count) & (TOKEN_LOOKAHEAD - 1);
+  stream->ring[tail] = token;
+  stream->count++;
+}
+
+Token PeekToken(TokenStream *stream, unsigned n) {
+  while (stream->count <= n) {
+    PullToken(stream);
+  }
+  return stream->ring[(stream->head + n) & (TOKEN_LOOKAHEAD - 1)];
+}
+
+Token DequeueToken(TokenStream *stream) {
+  Token token = PeekToken(stream, 0);
+  stream->head = (stream->head + 1) & (TOKEN_LOOKAHEAD - 1);
+  stream->count--;
+  return token;
 }
 
 const char* TokenTypeStr(TokenType type) {
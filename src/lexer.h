@@ -1,9 +1,11 @@
 #ifndef BCC_SRC_LEXER_H
 #define BCC_SRC_LEXER_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
-
-#define BRK "{}();~-+*/%|^&<>="
+#include "intern.h"
 
 static const char *TypeStr[] = {
     "tInvalidToken",
@@ -12,6 +14,37 @@ static const char *TypeStr[] = {
     "tInt",
     "tVoid",
     "tReturn",
+    "tAuto",
+    "tBreak",
+    "tCase",
+    "tChar",
+    "tConst",
+    "tContinue",
+    "tDefault",
+    "tDo",
+    "tDouble",
+    "tElse",
+    "tEnum",
+    "tExtern",
+    "tFloat",
+    "tFor",
+    "tGoto",
+    "tIf",
+    "tInline",
+    "tLong",
+    "tRegister",
+    "tRestrict",
+    "tShort",
+    "tSigned",
+    "tSizeof",
+    "tStatic",
+    "tStruct",
+    "tSwitch",
+    "tTypedef",
+    "tUnion",
+    "tUnsigned",
+    "tVolatile",
+    "tWhile",
     "tOpenParen",
     "tCloseParen",
     "tOpenBrace",
@@ -49,6 +82,37 @@ typedef enum {
   tInt,
   tVoid,
   tReturn,
+  tAuto,
+  tBreak,
+  tCase,
+  tChar,
+  tConst,
+  tContinue,
+  tDefault,
+  tDo,
+  tDouble,
+  tElse,
+  tEnum,
+  tExtern,
+  tFloat,
+  tFor,
+  tGoto,
+  tIf,
+  tInline,
+  tLong,
+  tRegister,
+  tRestrict,
+  tShort,
+  tSigned,
+  tSizeof,
+  tStatic,
+  tStruct,
+  tSwitch,
+  tTypedef,
+  tUnion,
+  tUnsigned,
+  tVolatile,
+  tWhile,
   tOpenParen,
   tCloseParen,
   tOpenBrace,
@@ -79,22 +143,94 @@ typedef enum {
   tEof
 } TokenType;
 
+// Tokens are small fixed size records, the text lives in the source buffer.
 typedef struct {
-  TokenType type;
-  // to be used for identifiers and constants
-  // might need to rethink for digits.
-  char value[120];
+  // where the token starts in the source.
+  uint32_t offset;
+  uint16_t length;
+  // a TokenType, kept narrow to keep the record at 12 bytes.
+  uint8_t type;
+  union {
+    // value of a constant, parsed once by the lexer.
+    int32_t value;
+    // identifiers are interned as they are lexed.
+    Symbol symbol;
+  };
 } Token;
 
 typedef struct {
   Token *tokens;
-  int length;
+  size_t length;
+  size_t capacity;
+  // the buffer token offsets refer to, must outlive the list.
+  const char *source;
+  Interner *symbols;
 } TokenList;
 
-Token NextToken(FILE *fp);
-TokenList Lex(FILE *fp);
+// The source held in memory, scanned with a cursor. The byte at `end` is
+// always a NUL so the scanner can peek one past the last character without a
+// bounds check. Inputs that can't be mapped, like pipes, are read as lexing
+// goes, a line at a time.
+typedef struct {
+  const char *start;
+  const char *cur;
+  const char *end;
+  // tokens starting before this point are wholly in the buffer, since no
+  // token spans a newline this is just past the last complete line.
+  const char *complete;
+  // non-zero when the buffer is an mmap of the file rather than malloced.
+  size_t mapped_length;
+  size_t capacity;
+  // still being read from when not -1.
+  int fd;
+  // where identifiers get interned, set before lexing.
+  Interner *symbols;
+} Lexer;
+
+// Maps the file when it can, otherwise reads it incrementally.
+bool OpenSource(Lexer *lexer, const char *file_name);
+// Lexes from an already open descriptor, which the lexer takes ownership of.
+bool OpenSourceFd(Lexer *lexer, int fd);
+// Lexes a malloced buffer already in memory, which the lexer takes ownership
+// of. buffer[length] must be writable, it becomes the NUL terminator.
+void OpenSourceBuffer(Lexer *lexer, char *buffer, size_t length);
+void CloseSource(Lexer *lexer);
+// Finishes reading a source still coming in, so all of it is in [start, end).
+void ReadWholeSource(Lexer *lexer);
+
+Token NextToken(Lexer *lexer);
+TokenList Lex(Lexer *lexer);
+// Same tokens and symbols as Lex, but the source is split at newlines and the
+// pieces are lexed on up to `threads` threads. Small inputs are lexed on the
+// calling thread.
+TokenList LexParallel(Lexer *lexer, int threads);
+
+void FreeTokenList(TokenList *token_list);
+const char *TokenText(const TokenList *token_list, Token token);
+
+// How far ahead of the parser a stream can look, a power of two.
+#define TOKEN_LOOKAHEAD 4
+
+// Tokens handed to the parser, pulled from a lexer only when the parser asks
+// for them, or read from a list that was lexed up front.
+typedef struct {
+  Lexer *lexer;
+  // used when lexer is NULL.
+  const TokenList *list;
+  size_t list_pos;
+  Token ring[TOKEN_LOOKAHEAD];
+  unsigned head;
+  unsigned count;
+  Interner *symbols;
+} TokenStream;
 
-Token DequeueToken(TokenList *token_list);
+TokenStream StreamFromLexer(Lexer *lexer);
+TokenStream StreamFromList(const TokenList *token_list);
+// Looks `n` tokens ahead without consuming anything, n < TOKEN_LOOKAHEAD.
+Token PeekToken(TokenStream *stream, unsigned n);
+Token DequeueToken(TokenStream *stream);
+// Exits with a diagnostic for a token the lexer could not make sense of.
+void ReportInvalidToken(const char *source, Token token);
 
 const char *TokenTypeStr(TokenType type);
 #endif //BCC_SRC_LEXER_H
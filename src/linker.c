@@ -0,0 +1,279 @@
+#include "linker.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "diagnostics.h"
+
+// Where the executable is loaded, and the page size its one segment is
+// aligned to, which covers 4K, 16K and 64K page kernels alike.
+#define BASE_ADDRESS 0x400000
+#define SEGMENT_ALIGN 0x10000
+
+// _start: bl main, then exit_group with its return value still in x0.
+static const uint32_t startup_stub[] = {
+    0x94000000,
+    // mov x8, #94
+    0xd2800bc8,
+    // svc #0
+    0xd4000001,
+};
+
+// What we need out of an object, found and bounds checked up front.
+typedef struct {
+  const uint8_t* data;
+  size_t size;
+  const Elf64_Shdr* sections;
+  int section_count;
+  int text;
+  const Elf64_Sym* symbols;
+  int symbol_count;
+  const char* names;
+  size_t names_size;
+  const Elf64_Rela* relocs;
+  int reloc_count;
+} Object;
+
+static bool InBounds(const Object* object, uint64_t offset, uint64_t size) {
+  return offset <= object->size && size <= object->size - offset;
+}
+
+static const char* SymbolName(const Object* object, const Elf64_Sym* symbol) {
+  if (symbol->st_name >= object->names_size) {
+    return "";
+  }
+  return object->names + symbol->st_name;
+}
+
+static bool ReadObject(Object* object) {
+  if (object->size < sizeof(Elf64_Ehdr)) {
+    return false;
+  }
+  const Elf64_Ehdr* header = (const Elf64_Ehdr*) object->data;
+  if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 ||
+      header->e_ident[EI_CLASS] != ELFCLASS64 ||
+      header->e_ident[EI_DATA] != ELFDATA2LSB || header->e_type != ET_REL ||
+      header->e_machine != EM_AARCH64 ||
+      header->e_shentsize != sizeof(Elf64_Shdr) ||
+      !InBounds(object, header->e_shoff,
+                (uint64_t) header->e_shnum * sizeof(Elf64_Shdr)) ||
+      header->e_shstrndx >= header->e_shnum) {
+    return false;
+  }
+  object->sections = (const Elf64_Shdr*) (object->data + header->e_shoff);
+  object->section_count = header->e_shnum;
+  const Elf64_Shdr* shstrtab = &object->sections[header->e_shstrndx];
+  if (!InBounds(object, shstrtab->sh_offset, shstrtab->sh_size)) {
+    return false;
+  }
+  const char* section_names = (const char*) object->data + shstrtab->sh_offset;
+  object->text = -1;
+  int symtab = -1;
+  int rela = -1;
+  for (int i = 1; i < object->section_count; ++i) {
+    const Elf64_Shdr* section = &object->sections[i];
+    if (section->sh_type != SHT_NOBITS &&
+        !InBounds(object, section->sh_offset, section->sh_size)) {
+      return false;
+    }
+    bool text = section->sh_name < shstrtab->sh_size &&
+                strcmp(section_names + section->sh_name, ".text") == 0;
+    if (text) {
+      object->text = i;
+    } else if (section->sh_type == SHT_SYMTAB) {
+      symtab = i;
+    } else if (section->sh_type == SHT_RELA || section->sh_type == SHT_REL) {
+      rela = i;
+    } else if ((section->sh_flags & SHF_ALLOC) && section->sh_size != 0) {
+      // data of any kind needs more than one read only segment.
+      return false;
+    }
+  }
+  if (object->text < 0 || symtab < 0) {
+    return false;
+  }
+  const Elf64_Shdr* symbols = &object->sections[symtab];
+  if (symbols->sh_entsize != sizeof(Elf64_Sym) ||
+      symbols->sh_link >= (uint32_t) object->section_count) {
+    return false;
+  }
+  const Elf64_Shdr* names = &object->sections[symbols->sh_link];
+  object->symbols = (const Elf64_Sym*) (object->data + symbols->sh_offset);
+  object->symbol_count = symbols->sh_size / sizeof(Elf64_Sym);
+  object->names = (const char*) object->data + names->sh_offset;
+  object->names_size = names->sh_size;
+  if (object->names_size == 0 || object->names[object->names_size - 1] != '\0') {
+    return false;
+  }
+  object->reloc_count = 0;
+  if (rela >= 0) {
+    const Elf64_Shdr* relocs = &object->sections[rela];
+    if (relocs->sh_type != SHT_RELA || relocs->sh_info != (uint32_t) object->text ||
+        relocs->sh_link != (uint32_t) symtab ||
+        relocs->sh_entsize != sizeof(Elf64_Rela)) {
+      return false;
+    }
+    object->relocs = (const Elf64_Rela*) (object->data + relocs->sh_offset);
+    object->reloc_count = relocs->sh_size / sizeof(Elf64_Rela);
+  }
+  return true;
+}
+
+// The address a symbol ends up at, false for anything not in .text, which
+// means it is defined somewhere we don't link.
+static bool SymbolAddress(const Object* object, uint32_t index,
+                          uint64_t text_address, uint64_t* address) {
+  if (index == 0 || index >= (uint32_t) object->symbol_count) {
+    return false;
+  }
+  const Elf64_Sym* symbol = &object->symbols[index];
+  if (symbol->st_shndx != object->text) {
+    return false;
+  }
+  *address = text_address +
+             (ELF64_ST_TYPE(symbol->st_info) == STT_SECTION ? 0 : symbol->st_value);
+  return true;
+}
+
+// Points the branch at `word` to `target`, false when it can't reach.
+static bool PatchBranch(uint8_t* word, uint32_t type, uint64_t place,
+                        uint64_t target) {
+  int64_t delta = (int64_t) (target - place);
+  if (delta % 4 != 0) {
+    return false;
+  }
+  delta /= 4;
+  uint32_t instruction;
+  memcpy(&instruction, word, sizeof(instruction));
+  switch (type) {
+    case R_AARCH64_JUMP26:
+    case R_AARCH64_CALL26:
+      if (delta < -(1 << 25) || delta >= (1 << 25)) {
+        return false;
+      }
+      instruction = (instruction & ~0x3ffffffu) | ((uint32_t) delta & 0x3ffffff);
+      break;
+    case R_AARCH64_CONDBR19:
+      if (delta < -(1 << 18) || delta >= (1 << 18)) {
+        return false;
+      }
+      instruction = (instruction & ~(0x7ffffu << 5)) |
+                    ((uint32_t) delta & 0x7ffff) << 5;
+      break;
+    default:
+      return false;
+  }
+  memcpy(word, &instruction, sizeof(instruction));
+  return true;
+}
+
+static size_t Align(size_t offset, size_t alignment) {
+  return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+bool LinkExecutable(const uint8_t* data, size_t size, const char* out_file) {
+  Object object = {.data = data, .size = size};
+  if (!ReadObject(&object)) {
+    return false;
+  }
+  const Elf64_Shdr* text = &object.sections[object.text];
+  uint64_t entry_main = 0;
+  bool found_main = false;
+  for (int i = 1; i < object.symbol_count; ++i) {
+    const Elf64_Sym* symbol = &object.symbols[i];
+    // undefined means a library is involved.
+    if (symbol->st_shndx == SHN_UNDEF) {
+      return false;
+    }
+    if (ELF64_ST_BIND(symbol->st_info) == STB_GLOBAL &&
+        symbol->st_shndx == object.text &&
+        strcmp(SymbolName(&object, symbol), "main") == 0) {
+      entry_main = symbol->st_value;
+      found_main = true;
+    }
+  }
+  if (!found_main) {
+    return false;
+  }
+
+  // Headers, then the stub, then .text, all in one read and execute segment.
+  size_t headers_size = sizeof(Elf64_Ehdr) + 2 * sizeof(Elf64_Phdr);
+  size_t stub_offset = Align(headers_size, 16);
+  size_t text_alignment = text->sh_addralign > 4 ? text->sh_addralign : 4;
+  size_t text_offset = Align(stub_offset + sizeof(startup_stub), text_alignment);
+  size_t file_size = text_offset + text->sh_size;
+  uint8_t* image = calloc(1, file_size);
+  if (image == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  uint64_t stub_address = BASE_ADDRESS + stub_offset;
+  uint64_t text_address = BASE_ADDRESS + text_offset;
+  memcpy(image + stub_offset, startup_stub, sizeof(startup_stub));
+  memcpy(image + text_offset, data + text->sh_offset, text->sh_size);
+  bool linked = PatchBranch(image + stub_offset, R_AARCH64_CALL26, stub_address,
+                            text_address + entry_main);
+  for (int i = 0; linked && i < object.reloc_count; ++i) {
+    const Elf64_Rela* reloc = &object.relocs[i];
+    uint64_t target;
+    linked = reloc->r_offset + 4 <= text->sh_size &&
+             SymbolAddress(&object, ELF64_R_SYM(reloc->r_info), text_address,
+                           &target) &&
+             PatchBranch(image + text_offset + reloc->r_offset,
+                         ELF64_R_TYPE(reloc->r_info),
+                         text_address + reloc->r_offset,
+                         target + reloc->r_addend);
+  }
+  if (!linked) {
+    free(image);
+    return false;
+  }
+
+  Elf64_Ehdr header = {
+      .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB,
+                  EV_CURRENT, ELFOSABI_NONE},
+      .e_type = ET_EXEC,
+      .e_machine = EM_AARCH64,
+      .e_version = EV_CURRENT,
+      .e_entry = stub_address,
+      .e_phoff = sizeof(Elf64_Ehdr),
+      .e_ehsize = sizeof(Elf64_Ehdr),
+      .e_phentsize = sizeof(Elf64_Phdr),
+      .e_phnum = 2,
+  };
+  Elf64_Phdr segments[2] = {
+      {
+          .p_type = PT_LOAD,
+          .p_flags = PF_R | PF_X,
+          .p_offset = 0,
+          .p_vaddr = BASE_ADDRESS,
+          .p_paddr = BASE_ADDRESS,
+          .p_filesz = file_size,
+          .p_memsz = file_size,
+          .p_align = SEGMENT_ALIGN,
+      },
+      // no executable stack.
+      {
+          .p_type = PT_GNU_STACK,
+          .p_flags = PF_R | PF_W,
+          .p_align = 16,
+      },
+  };
+  memcpy(image, &header, sizeof(header));
+  memcpy(image + sizeof(header), segments, sizeof(segments));
+
+  int fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0777);
+  bool written = fd >= 0 && write(fd, image, file_size) == (ssize_t) file_size;
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(image);
+  if (!written) {
+    fprintf(Diagnostics(), "Failed to write %s", out_file);
+    Fail();
+  }
+  return true;
+}
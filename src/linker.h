@@ -0,0 +1,15 @@
+#ifndef BCC_SRC_LINKER_H
+#define BCC_SRC_LINKER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Links one of our own objects into a static AArch64 executable, behind a
+// startup stub that calls `main` and exits with what it returns. Only what
+// WriteArmObject produces is handled: one .text section, branch relocations
+// and no undefined symbols. Anything else returns false so the caller can
+// hand the object to the system linker instead.
+bool LinkExecutable(const uint8_t* object, size_t size, const char* out_file);
+
+#endif //BCC_SRC_LINKER_H
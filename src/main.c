@@ -1,35 +1,190 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "cache.h"
 #include "driver.h"
+#include "server.h"
+#include "trace.h"
 
 #define MIN_ARGUMENTS 2
+#define DEFAULT_CACHE_MB 256
 
-int main(int argc, char **argv) {
+typedef struct {
+  char **names;
+  int count;
+  int capacity;
+} FileList;
+
+void AddFile(FileList *files, char *name) {
+  if (files->count == files->capacity) {
+    files->capacity = files->capacity == 0 ? 16 : files->capacity * 2;
+    files->names = realloc(files->names, sizeof(char *) * files->capacity);
+    if (files->names == NULL) {
+      fprintf(stderr, "failed to allocate memory");
+      exit(2);
+    }
+  }
+  files->names[files->count++] = name;
+}
 
+// @file names a response file, a whitespace separated list of sources.
+void ReadResponseFile(FileList *files, const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to read %s", path);
+    exit(1);
+  }
+  char name[4096];
+  while (fscanf(f, "%4095s", name) == 1) {
+    AddFile(files, strdup(name));
+  }
+  fclose(f);
+}
+
+int ParseJobs(const char *opt, const char *value) {
+  int jobs = atoi(value);
+  if (jobs < 1) {
+    fprintf(stderr, "Invalid job count: %s", opt);
+    exit(1);
+  }
+  return jobs;
+}
+
+int RunCompiler(int argc, char **argv) {
   if (argc < MIN_ARGUMENTS) {
     fprintf(stderr, "Incorrect number of arguments, got %d, expected "
                     "at least %d",
             argc, MIN_ARGUMENTS);
     exit(1);
   }
-  Mode mode = FULL;
-  if (argc == 3) {
-    char* opt = argv[1];
+  CompileOptions options = {.mode = FULL};
+  options.jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (options.jobs < 1) {
+    options.jobs = 1;
+  }
+  options.cache_dir = getenv("BCC_CACHE_DIR");
+  options.cache_limit = (size_t) DEFAULT_CACHE_MB << 20;
+  bool cache_stats = false;
+  FileList files = {.names = NULL};
+  FileList link_args = {.names = NULL};
+  for (int i = 1; i < argc; ++i) {
+    char* opt = argv[i];
     if (strcmp(opt, "--lex") == 0) {
-      mode = LEX;
+      options.mode = LEX;
     } else if (strcmp(opt, "--parse") == 0) {
-      mode = PARSE;
+      options.mode = PARSE;
     } else if (strcmp(opt, "--tacky") == 0) {
-      mode = TACKY;
+      options.mode = TACKY;
     } else if (strcmp(opt, "--codegen") == 0) {
-        mode = CODEGEN;
-    } else {
+      options.mode = CODEGEN;
+    } else if (strcmp(opt, "-S") == 0) {
+      options.mode = ASSEMBLY;
+    } else if (strcmp(opt, "-c") == 0) {
+      options.mode = OBJECT;
+    } else if (strcmp(opt, "--huge-pages") == 0) {
+      options.huge_pages = true;
+    } else if (strcmp(opt, "--external-cpp") == 0) {
+      options.external_cpp = true;
+    } else if (strcmp(opt, "--external-as") == 0) {
+      options.external_as = true;
+    } else if (strcmp(opt, "-v") == 0 || strcmp(opt, "--verbose") == 0) {
+      options.verbose = true;
+    } else if (strncmp(opt, "--lex-threads=", 14) == 0) {
+      options.lex_threads = atoi(opt + 14);
+      if (options.lex_threads < 1) {
+        fprintf(stderr, "Invalid thread count: %s", opt);
+        exit(1);
+      }
+    } else if (strcmp(opt, "-j") == 0 && i + 1 < argc) {
+      options.jobs = ParseJobs(opt, argv[++i]);
+    } else if (strncmp(opt, "-j", 2) == 0) {
+      options.jobs = ParseJobs(opt, opt + 2);
+    } else if (strncmp(opt, "--jobs=", 7) == 0) {
+      options.jobs = ParseJobs(opt, opt + 7);
+    } else if (strcmp(opt, "--cache") == 0) {
+      options.cache_dir = DefaultCacheDir();
+      if (options.cache_dir == NULL) {
+        fprintf(stderr, "No home directory for the cache, use --cache=DIR");
+        exit(1);
+      }
+    } else if (strncmp(opt, "--cache=", 8) == 0) {
+      options.cache_dir = opt + 8;
+    } else if (strncmp(opt, "--cache-size=", 13) == 0) {
+      long mb = atol(opt + 13);
+      if (mb < 1) {
+        fprintf(stderr, "Invalid cache size: %s", opt);
+        exit(1);
+      }
+      options.cache_limit = (size_t) mb << 20;
+    } else if (strcmp(opt, "--cache-stats") == 0) {
+      cache_stats = true;
+    } else if (strcmp(opt, "--time-report") == 0 ||
+               strcmp(opt, "--time-report=text") == 0) {
+      options.time_report = REPORT_TEXT;
+    } else if (strcmp(opt, "--time-report=json") == 0) {
+      options.time_report = REPORT_JSON;
+    } else if (strcmp(opt, "--perf-counters") == 0) {
+      options.perf_counters = true;
+    } else if (strcmp(opt, "--save-ast") == 0) {
+      options.save_ast = true;
+    } else if (strcmp(opt, "--save-tacky") == 0) {
+      options.save_tacky = true;
+    } else if (strncmp(opt, "--trace=", 8) == 0) {
+      StartTrace(opt + 8);
+    } else if (strncmp(opt, "-l", 2) == 0 || strncmp(opt, "-L", 2) == 0) {
+      AddFile(&link_args, opt);
+    } else if (opt[0] == '@') {
+      ReadResponseFile(&files, opt + 1);
+    } else if (opt[0] == '-') {
       fprintf(stderr, "Invalid option not know: %s", opt);
       exit(1);
+    } else {
+      AddFile(&files, opt);
+    }
+  }
+  // counters are reported per phase, so they come with a time report.
+  if (options.perf_counters && options.time_report == REPORT_NONE) {
+    options.time_report = REPORT_TEXT;
+  }
+  options.link_args = link_args.names;
+  options.link_arg_count = link_args.count;
+  if (cache_stats) {
+    const char *dir = options.cache_dir != NULL ? options.cache_dir : DefaultCacheDir();
+    if (dir == NULL) {
+      fprintf(stderr, "No cache directory, use --cache=DIR");
+      exit(1);
+    }
+    PrintCacheStats(dir);
+    return 0;
+  }
+  if (files.count == 0) {
+    fprintf(stderr, "No input file given");
+    exit(1);
+  }
+  bool compiled = files.count == 1
+                      ? Compile(files.names[0], &options)
+                      : CompileBatch(files.names, files.count, &options);
+  return compiled ? 0 : 2;
+}
+
+// --server[=socket] runs the compile server, --connect[=socket] hands the
+// rest of the command line to it, compiling here if none is running.
+int main(int argc, char **argv) {
+  if (argc >= 2 && strncmp(argv[1], "--server", 8) == 0 &&
+      (argv[1][8] == '\0' || argv[1][8] == '=')) {
+    RunServer(argv[1][8] == '=' ? argv[1] + 9 : DefaultSocketPath(), RunCompiler);
+    return 0;
+  }
+  if (argc >= 2 && strncmp(argv[1], "--connect", 9) == 0 &&
+      (argv[1][9] == '\0' || argv[1][9] == '=')) {
+    const char *socket_path = argv[1][9] == '=' ? argv[1] + 10 : DefaultSocketPath();
+    argv[1] = argv[0];
+    int status = RunClient(socket_path, argc - 1, argv + 1);
+    if (status >= 0) {
+      return status;
     }
-    ++argv;
+    return RunCompiler(argc - 1, argv + 1);
   }
-  Compile(argv[1], mode);
-  return 0;
+  return RunCompiler(argc, argv);
 }
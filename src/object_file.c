@@ -0,0 +1,204 @@
+#include "object_file.h"
+
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+#include "diagnostics.h"
+
+// Section header indices, .rela.text shifts the rest along when present.
+enum {
+  SECTION_NULL,
+  SECTION_TEXT,
+};
+
+static const char section_names[] =
+    "\0.symtab\0.strtab\0.shstrtab\0.rela.text\0.data\0.bss";
+
+static uint32_t SectionName(const char* name) {
+  // .text shares its name with the end of .rela.text.
+  if (strcmp(name, ".text") == 0) {
+    return SectionName(".rela.text") + 5;
+  }
+  for (uint32_t i = 1; i < sizeof(section_names); ++i) {
+    if (section_names[i - 1] == '\0' && strcmp(section_names + i, name) == 0) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+static size_t Align(size_t offset, size_t alignment) {
+  return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+// Pads with zeros up to `offset`, returns the new position.
+static size_t PadTo(FILE* out, size_t position, size_t offset) {
+  for (; position < offset; ++position) {
+    fputc(0, out);
+  }
+  return position;
+}
+
+bool WriteElfObject(const ObjectFile* object, FILE* out) {
+  bool has_relocs = object->reloc_count > 0;
+  int rela_section = has_relocs ? SECTION_TEXT + 1 : 0;
+  int data_section = SECTION_TEXT + 1 + has_relocs;
+  int bss_section = data_section + 1;
+  int symtab_section = bss_section + 1;
+  int strtab_section = symtab_section + 1;
+  int shstrtab_section = strtab_section + 1;
+  int section_count = shstrtab_section + 1;
+
+  // The symbol table wants every local before the first global. The null
+  // symbol and one per section come first, as gas writes them.
+  int sym_count = 4 + object->symbol_count;
+  Elf64_Sym* syms = calloc(sym_count, sizeof(Elf64_Sym));
+  uint32_t* order = malloc(sizeof(uint32_t) * (object->symbol_count + 1));
+  size_t strtab_size = 1;
+  for (int i = 0; i < object->symbol_count; ++i) {
+    strtab_size += strlen(object->symbols[i].name) + 1;
+  }
+  char* strtab = calloc(strtab_size, 1);
+  if (syms == NULL || order == NULL || strtab == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  int sections[] = {SECTION_TEXT, data_section, bss_section};
+  for (int i = 0; i < 3; ++i) {
+    syms[1 + i] = (Elf64_Sym) {
+        .st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION),
+        .st_shndx = sections[i],
+    };
+  }
+  int next = 4;
+  int first_global = 0;
+  size_t name_offset = 1;
+  for (int pass = 0; pass < 2; ++pass) {
+    if (pass == 1) {
+      first_global = next;
+    }
+    for (int i = 0; i < object->symbol_count; ++i) {
+      const ObjectSymbol* symbol = &object->symbols[i];
+      bool global = symbol->global || !symbol->defined;
+      if (global != (pass == 1)) {
+        continue;
+      }
+      size_t length = strlen(symbol->name);
+      memcpy(strtab + name_offset, symbol->name, length);
+      syms[next] = (Elf64_Sym) {
+          .st_name = name_offset,
+          .st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, STT_NOTYPE),
+          .st_shndx = symbol->defined ? SECTION_TEXT : SHN_UNDEF,
+          .st_value = symbol->value,
+      };
+      name_offset += length + 1;
+      order[i] = next++;
+    }
+  }
+
+  size_t text_offset = sizeof(Elf64_Ehdr);
+  size_t rela_offset = Align(text_offset + object->text_size, 8);
+  size_t rela_size = sizeof(Elf64_Rela) * object->reloc_count;
+  size_t symtab_offset = Align(rela_offset + rela_size, 8);
+  size_t symtab_size = sizeof(Elf64_Sym) * sym_count;
+  size_t strtab_offset = symtab_offset + symtab_size;
+  size_t shstrtab_offset = strtab_offset + strtab_size;
+  size_t headers_offset = Align(shstrtab_offset + sizeof(section_names), 8);
+
+  Elf64_Shdr headers[8];
+  memset(headers, 0, sizeof(headers));
+  headers[SECTION_TEXT] = (Elf64_Shdr) {
+      .sh_name = SectionName(".text"),
+      .sh_type = SHT_PROGBITS,
+      .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
+      .sh_offset = text_offset,
+      .sh_size = object->text_size,
+      .sh_addralign = 4,
+  };
+  if (has_relocs) {
+    headers[rela_section] = (Elf64_Shdr) {
+        .sh_name = SectionName(".rela.text"),
+        .sh_type = SHT_RELA,
+        .sh_flags = SHF_INFO_LINK,
+        .sh_offset = rela_offset,
+        .sh_size = rela_size,
+        .sh_link = symtab_section,
+        .sh_info = SECTION_TEXT,
+        .sh_addralign = 8,
+        .sh_entsize = sizeof(Elf64_Rela),
+    };
+  }
+  headers[data_section] = (Elf64_Shdr) {
+      .sh_name = SectionName(".data"),
+      .sh_type = SHT_PROGBITS,
+      .sh_flags = SHF_WRITE | SHF_ALLOC,
+      .sh_offset = rela_offset,
+      .sh_addralign = 1,
+  };
+  headers[bss_section] = (Elf64_Shdr) {
+      .sh_name = SectionName(".bss"),
+      .sh_type = SHT_NOBITS,
+      .sh_flags = SHF_WRITE | SHF_ALLOC,
+      .sh_offset = rela_offset,
+      .sh_addralign = 1,
+  };
+  headers[symtab_section] = (Elf64_Shdr) {
+      .sh_name = SectionName(".symtab"),
+      .sh_type = SHT_SYMTAB,
+      .sh_offset = symtab_offset,
+      .sh_size = symtab_size,
+      .sh_link = strtab_section,
+      .sh_info = first_global,
+      .sh_addralign = 8,
+      .sh_entsize = sizeof(Elf64_Sym),
+  };
+  headers[strtab_section] = (Elf64_Shdr) {
+      .sh_name = SectionName(".strtab"),
+      .sh_type = SHT_STRTAB,
+      .sh_offset = strtab_offset,
+      .sh_size = strtab_size,
+      .sh_addralign = 1,
+  };
+  headers[shstrtab_section] = (Elf64_Shdr) {
+      .sh_name = SectionName(".shstrtab"),
+      .sh_type = SHT_STRTAB,
+      .sh_offset = shstrtab_offset,
+      .sh_size = sizeof(section_names),
+      .sh_addralign = 1,
+  };
+
+  Elf64_Ehdr header = {
+      .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB,
+                  EV_CURRENT, ELFOSABI_NONE},
+      .e_type = ET_REL,
+      .e_machine = EM_AARCH64,
+      .e_version = EV_CURRENT,
+      .e_shoff = headers_offset,
+      .e_ehsize = sizeof(Elf64_Ehdr),
+      .e_shentsize = sizeof(Elf64_Shdr),
+      .e_shnum = section_count,
+      .e_shstrndx = shstrtab_section,
+  };
+  fwrite(&header, sizeof(header), 1, out);
+  fwrite(object->text, 1, object->text_size, out);
+  size_t position = PadTo(out, text_offset + object->text_size, rela_offset);
+  for (int i = 0; i < object->reloc_count; ++i) {
+    const ObjectReloc* reloc = &object->relocs[i];
+    Elf64_Rela rela = {
+        .r_offset = reloc->offset,
+        .r_info = ELF64_R_INFO(order[reloc->symbol], reloc->type),
+        .r_addend = reloc->addend,
+    };
+    fwrite(&rela, sizeof(rela), 1, out);
+  }
+  PadTo(out, position + rela_size, symtab_offset);
+  fwrite(syms, sizeof(Elf64_Sym), sym_count, out);
+  fwrite(strtab, 1, strtab_size, out);
+  fwrite(section_names, 1, sizeof(section_names), out);
+  PadTo(out, shstrtab_offset + sizeof(section_names), headers_offset);
+  fwrite(headers, sizeof(Elf64_Shdr), section_count, out);
+  free(syms);
+  free(order);
+  free(strtab);
+  return !ferror(out);
+}
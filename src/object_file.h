@@ -0,0 +1,41 @@
+#ifndef BCC_SRC_OBJECT_FILE_H
+#define BCC_SRC_OBJECT_FILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A relocatable object with all of its code in one .text section, laid out
+// the way gas lays one out: .text, .rela.text when there are relocations,
+// empty .data and .bss, then the symbol and string tables.
+
+typedef struct {
+  const char* name;
+  uint64_t value;
+  // undefined symbols are always global.
+  bool defined;
+  bool global;
+} ObjectSymbol;
+
+typedef struct {
+  uint64_t offset;
+  // index into the object's symbols.
+  uint32_t symbol;
+  uint32_t type;
+  int64_t addend;
+} ObjectReloc;
+
+typedef struct {
+  const uint8_t* text;
+  size_t text_size;
+  const ObjectSymbol* symbols;
+  int symbol_count;
+  const ObjectReloc* relocs;
+  int reloc_count;
+} ObjectFile;
+
+// Writes `object` as an AArch64 ELF64 object, false if writing failed.
+bool WriteElfObject(const ObjectFile* object, FILE* out);
+
+#endif //BCC_SRC_OBJECT_FILE_H
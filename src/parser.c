@@ -4,15 +4,16 @@
 #include "arena.h"
 #include "parser.h"
 #include "lexer.h"
+#include "diagnostics.h"
 
-Exp* ParseFactor(Arena* arena, TokenList* list);
-Exp* ParseExp(Arena* arena, TokenList* list, int min_precedence);
+Exp* ParseFactor(Arena* arena, TokenStream* stream);
+Exp* ParseExp(Arena* arena, TokenStream* stream, int min_precedence);
 
 void ExpectTokenType(Token token, TokenType type) {
   if (token.type != type) {
-    fprintf(stderr, "Expected type %s but got type %s", TokenTypeStr(type),
+    fprintf(Diagnostics(), "Expected type %s but got type %s", TokenTypeStr(type),
             TokenTypeStr(token.type));
-    exit(2);
+    Fail();
   }
 }
 
@@ -25,13 +26,13 @@ UnaryOp GetOp(TokenType type) {
     case tLogicalNot:
       return LOGICAL_NOT;
     default:
-      fprintf(stderr, "encountered bad unary op");
-      exit(1);
+      fprintf(Diagnostics(), "encountered bad unary op");
+      Fail();
   }
 }
 
-Exp* ParseFactorInner(Arena* arena, TokenList* list) {
-  Token token = DequeueToken(list);
+Exp* ParseFactorInner(Arena* arena, TokenStream* stream) {
+  Token token = DequeueToken(stream);
   Exp* e;
   switch (token.type) {
     case tTilde:
@@ -40,23 +41,23 @@ Exp* ParseFactorInner(Arena* arena, TokenList* list) {
       e = arena_alloc(arena, sizeof(Exp));
       e->type = eUnaryExp;
       e->unary_exp.op_type = GetOp(token.type);
-      e->unary_exp.exp = ParseFactor(arena, list);
+      e->unary_exp.exp = ParseFactor(arena, stream);
       return e;
     case tOpenParen:
-      e = ParseExp(arena, list, 0);
-      ExpectTokenType(DequeueToken(list), tCloseParen);
+      e = ParseExp(arena, stream, 0);
+      ExpectTokenType(DequeueToken(stream), tCloseParen);
       return e;
     default:
       e = arena_alloc(arena, sizeof(Exp));
       ExpectTokenType(token, tConstant);
-      // TODO: use more proper parsing here. Or store const ints as ints.
-      e->const_val = atoi(token.value);
+      e->type = eConst;
+      e->const_val = token.value;
       return e;
   }
 }
 
-Exp* ParseFactor(Arena* arena, TokenList* list) {
-  return ParseFactorInner(arena, list);
+Exp* ParseFactor(Arena* arena, TokenStream* stream) {
+  return ParseFactorInner(arena, stream);
 }
 
 BinaryOp ParseBinop(Token token) {
@@ -98,9 +99,9 @@ BinaryOp ParseBinop(Token token) {
     case tGreaterOrEqual:
       return GREATER_OR_EQUAL;
     default:
-      fprintf(stderr, "Expected binary op or got type: %s\n",
+      fprintf(Diagnostics(), "Expected binary op or got type: %s\n",
               TokenTypeStr(token.type));
-      exit(2);
+      Fail();
   }
 }
 
@@ -161,19 +162,19 @@ int Precedence(TokenType t) {
     case tLogicalOr:
       return 5;
     default:
-      fprintf(stderr, "Expected +,-,/,%%, or * got type: %s\n",
+      fprintf(Diagnostics(), "Expected +,-,/,%%, or * got type: %s\n",
               TokenTypeStr(t));
-      exit(2);
+      Fail();
   }
 }
 
-Exp* ParseExp(Arena* arena, TokenList* list, int min_precedence) {
-  Exp* left = ParseFactor(arena, list);
-  Token* next_token = &list->tokens[0];
-  while (IsBinaryOp(next_token->type) &&
-      Precedence(next_token->type) >= min_precedence) {
-    BinaryOp op = ParseBinop(DequeueToken(list));
-    Exp* right = ParseExp(arena, list, Precedence(next_token->type) + 1);
+Exp* ParseExp(Arena* arena, TokenStream* stream, int min_precedence) {
+  Exp* left = ParseFactor(arena, stream);
+  Token next_token = PeekToken(stream, 0);
+  while (IsBinaryOp(next_token.type) &&
+      Precedence(next_token.type) >= min_precedence) {
+    BinaryOp op = ParseBinop(DequeueToken(stream));
+    Exp* right = ParseExp(arena, stream, Precedence(next_token.type) + 1);
     Exp* binexp = arena_alloc(arena, sizeof(Exp));
     *binexp = (Exp) {
         .type = eBinaryExp,
@@ -184,41 +185,58 @@ Exp* ParseExp(Arena* arena, TokenList* list, int min_precedence) {
         }
     };
     left = binexp;
-    next_token = &list->tokens[0];
+    next_token = PeekToken(stream, 0);
   }
   return left;
 }
 
-Statement* ParseStatement(Arena* arena, TokenList* list) {
+Statement* ParseStatement(Arena* arena, TokenStream* stream) {
   Statement* s = arena_alloc(arena, sizeof(Statement));
   s->type = S_RETURN;
-  ExpectTokenType(DequeueToken(list), tReturn);
-  s->exp = ParseExp(arena, list, 0);
-  ExpectTokenType(DequeueToken(list), tSemicolin);
+  ExpectTokenType(DequeueToken(stream), tReturn);
+  s->exp = ParseExp(arena, stream, 0);
+  ExpectTokenType(DequeueToken(stream), tSemicolin);
   return s;
 }
 
 // Expect <function> ::= "int" <identifier> "(" "void" ")" "{" <statement> "}"
-Function* ParseFunction(Arena* arena, TokenList* list) {
+Function* ParseFunction(Arena* arena, TokenStream* stream) {
   Function* f = arena_alloc(arena, sizeof(Function));
-  Token token = DequeueToken(list);
+  Token token = DequeueToken(stream);
   ExpectTokenType(token, tInt);
-  token = DequeueToken(list);
+  token = DequeueToken(stream);
   ExpectTokenType(token, tIdentifier);
-  f->name = arena_alloc(arena, strlen(token.value) + 1);
-  strcpy(f->name, token.value);
-  ExpectTokenType(DequeueToken(list), tOpenParen);
-  ExpectTokenType(DequeueToken(list), tVoid);
-  ExpectTokenType(DequeueToken(list), tCloseParen);
-  ExpectTokenType(DequeueToken(list), tOpenBrace);
-  f->statement = ParseStatement(arena, list);
-  ExpectTokenType(DequeueToken(list), tCloseBrace);
+  f->name = token.symbol;
+  ExpectTokenType(DequeueToken(stream), tOpenParen);
+  ExpectTokenType(DequeueToken(stream), tVoid);
+  ExpectTokenType(DequeueToken(stream), tCloseParen);
+  ExpectTokenType(DequeueToken(stream), tOpenBrace);
+  f->statement = ParseStatement(arena, stream);
+  ExpectTokenType(DequeueToken(stream), tCloseBrace);
   return f;
 }
 
-Program* ParseTokens(Arena* arena, TokenList list) {
-  Program* program = arena_alloc(arena, sizeof(program));
-  program->function = ParseFunction(arena, &list);
-  ExpectTokenType(DequeueToken(&list), tEof);
+Program* ParseTokens(Arena* arena, TokenStream* stream) {
+  Program* program = arena_alloc(arena, sizeof(Program));
+  program->symbols = stream->symbols;
+  program->function = ParseFunction(arena, stream);
+  ExpectTokenType(DequeueToken(stream), tEof);
   return program;
 }
+
+static size_t CountExpNodes(const Exp* exp) {
+  switch (exp->type) {
+    case eUnaryExp:
+      return 1 + CountExpNodes(exp->unary_exp.exp);
+    case eBinaryExp:
+      return 1 + CountExpNodes(exp->binary_exp.left) +
+             CountExpNodes(exp->binary_exp.right);
+    default:
+      return 1;
+  }
+}
+
+size_t CountAstNodes(const Program* program) {
+  // the function, its statement and then the expression tree.
+  return 2 + CountExpNodes(program->function->statement->exp);
+}
@@ -24,6 +24,7 @@
 #ifndef BCC_SRC_PARSER_H
 #define BCC_SRC_PARSER_H
 #include "arena.h"
+#include "intern.h"
 #include "lexer.h"
 
 typedef enum {
@@ -90,13 +91,17 @@ typedef struct {
 } Statement;
 
 typedef struct {
-  char* name;
+  Symbol name;
   Statement* statement;
 } Function;
 
 typedef struct {
   Function* function;
+  // names in the program are symbols in this table.
+  Interner* symbols;
 } Program;
 
-Program* ParseTokens(Arena* arena, TokenList list);
+Program* ParseTokens(Arena* arena, TokenStream* stream);
+// Expressions, statements and functions in the program, for reporting.
+size_t CountAstNodes(const Program* program);
 #endif // BCC_SRC_PARSER_H
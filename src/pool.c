@@ -0,0 +1,65 @@
+#include "pool.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static int SizeClass(size_t size_in_bytes) {
+  int size_class = 0;
+  size_t class_size = (size_t) 1 << POOL_MIN_SHIFT;
+  while (class_size < size_in_bytes) {
+    class_size <<= 1;
+    ++size_class;
+  }
+  if (size_class >= POOL_CLASSES) {
+    fprintf(stderr, "pool allocation too large: %zu bytes\n", size_in_bytes);
+    exit(2);
+  }
+  return size_class;
+}
+
+static size_t ClassSize(int size_class) {
+  return (size_t) 1 << (size_class + POOL_MIN_SHIFT);
+}
+
+Pool create_pool(Arena* arena) {
+  Pool pool = {.arena = arena};
+  return pool;
+}
+
+void* pool_alloc(Pool* pool, size_t size_in_bytes) {
+  int size_class = SizeClass(size_in_bytes);
+  void* block = pool->free_lists[size_class];
+  if (block != NULL) {
+    // the first word of a free block links to the next one.
+    pool->free_lists[size_class] = *(void**) block;
+    return block;
+  }
+  return arena_alloc(pool->arena, ClassSize(size_class));
+}
+
+void pool_free(Pool* pool, void* ptr, size_t size_in_bytes) {
+  if (ptr == NULL) {
+    return;
+  }
+  // catches blocks from another pool, not arena_alloc blocks, see pool.h.
+  assert(arena_owns(pool->arena, ptr));
+  int size_class = SizeClass(size_in_bytes);
+  *(void**) ptr = pool->free_lists[size_class];
+  pool->free_lists[size_class] = ptr;
+}
+
+void* pool_realloc(Pool* pool, void* ptr, size_t old_size, size_t new_size) {
+  if (ptr != NULL && SizeClass(new_size) == SizeClass(old_size)) {
+    return ptr;
+  }
+  void* ret = pool_alloc(pool, new_size);
+  if (ptr != NULL) {
+    memcpy(ret, ptr, old_size < new_size ? old_size : new_size);
+    pool_free(pool, ptr, old_size);
+  }
+  return ret;
+}
+
+void pool_reset(Pool* pool) {
+  memset(pool->free_lists, 0, sizeof(pool->free_lists));
+}
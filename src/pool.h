@@ -0,0 +1,33 @@
+#ifndef BCC_SRC_POOL_H
+#define BCC_SRC_POOL_H
+
+#include <stddef.h>
+#include "arena.h"
+
+// Power of two size classes starting at 16 bytes, the last class is big
+// enough for anything an arena could hand out.
+#define POOL_MIN_SHIFT 4
+#define POOL_CLASSES 40
+
+// A recycling allocator layered on an arena. Freed blocks go on a free list
+// for their size class and are handed out again before the arena is touched,
+// so passes that rewrite IR keep memory proportional to the live IR.
+typedef struct {
+  Arena* arena;
+  void* free_lists[POOL_CLASSES];
+} Pool;
+
+Pool create_pool(Arena* arena);
+void* pool_alloc(Pool* pool, size_t size_in_bytes);
+// `ptr` must have come from pool_alloc or pool_realloc on this pool, and
+// `size_in_bytes` must be the size it was allocated with. A block from
+// arena_alloc won't do even on the same arena: it is only as big as was
+// asked for, and the free list would hand it out as a whole size class.
+// Neither can be told from the block itself, debug builds only check it is
+// in the pool's arena. pool_realloc takes the same kind of block.
+void pool_free(Pool* pool, void* ptr, size_t size_in_bytes);
+void* pool_realloc(Pool* pool, void* ptr, size_t old_size, size_t new_size);
+// Forgets every free block, needed after the backing arena is rewound.
+void pool_reset(Pool* pool);
+
+#endif // BCC_SRC_POOL_H
@@ -0,0 +1,1875 @@
+#define _GNU_SOURCE
+#include "preprocessor.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "char_class.h"
+#include "diagnostics.h"
+#include "intern.h"
+
+#define MAX_INCLUDE_DEPTH 200
+#define MAX_MACRO_PARAMS 256
+#define INITIAL_OUTPUT (64 * 1024)
+
+// Same order as gcc, the compiler's own headers, then Debian style multiarch
+// headers between the two system directories.
+static const char *include_dirs[] = {
+#ifdef COMPILER_INCLUDE_DIR
+    COMPILER_INCLUDE_DIR,
+#endif
+    "/usr/local/include",
+#if defined(__x86_64__)
+    "/usr/include/x86_64-linux-gnu",
+#elif defined(__aarch64__)
+    "/usr/include/aarch64-linux-gnu",
+#endif
+    "/usr/include",
+};
+#define INCLUDE_DIR_COUNT (sizeof(include_dirs) / sizeof(include_dirs[0]))
+
+// Seen before the main file. Only the plain standard macros, programs that
+// test for gcc's own need --external-cpp.
+static const char builtin_defines[] =
+    "#define __STDC__ 1\n"
+    "#define __STDC_VERSION__ 201112L\n"
+    "#define __STDC_HOSTED__ 1\n"
+    "#define __bcc__ 1\n"
+    "#define __linux__ 1\n"
+    "#define __unix__ 1\n"
+    "#define __LP64__ 1\n"
+    "#define _LP64 1\n"
+    "#define __CHAR_BIT__ 8\n"
+// The host's headers are the ones found, so describe the host to them.
+#if defined(__x86_64__)
+    "#define __x86_64__ 1\n"
+#elif defined(__aarch64__)
+    "#define __aarch64__ 1\n"
+#endif
+    ;
+
+typedef enum {
+  PP_IDENT,
+  PP_NUMBER,
+  PP_STRING,
+  PP_CHAR,
+  PP_PUNCT,
+  // a stray character, passed through for the lexer to complain about.
+  PP_OTHER,
+  PP_EOF
+} PPKind;
+
+// A file as read from disk, kept for the life of the process.
+typedef struct {
+  const char *path;
+  // NUL terminated with line continuations already spliced, NULL if the file
+  // couldn't be read.
+  char *contents;
+  size_t length;
+  // stat results the contents were read with, rechecked once per run.
+  // Timestamps go to the nanosecond and the ctime and inode are compared
+  // too, so an edit within the same second that keeps the size is seen.
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  struct timespec ctime;
+  uint32_t checked_run;
+  // the macro the whole file is wrapped in, if it is.
+  const char *guard;
+  bool guard_checked;
+  // the path's symbol in the cache, a dense id for per run tables.
+  Symbol id;
+} SourceFile;
+
+typedef struct Hideset Hideset;
+struct Hideset {
+  Hideset *next;
+  Symbol name;
+};
+
+typedef struct PPToken PPToken;
+struct PPToken {
+  PPToken *next;
+  const char *text;
+  uint32_t length;
+  uint32_t line;
+  uint8_t kind;
+  // first token on its line, directives are only recognised there.
+  bool at_bol;
+  // whitespace before it, kept in the output.
+  bool space;
+  uint16_t depth;
+  // identifiers only.
+  Symbol name;
+  SourceFile *file;
+  // macros this token came out of, it must not be expanded by them again.
+  Hideset *hideset;
+};
+
+typedef struct Preprocessor Preprocessor;
+// Builtins like __LINE__ produce their expansion in code.
+typedef PPToken *(*MacroHandler)(Preprocessor *pp, PPToken *tok);
+
+typedef struct {
+  Symbol name;
+  // replacement list, ends in an EOF token.
+  PPToken *body;
+  Symbol *params;
+  int param_count;
+  bool function_like;
+  // takes a trailing ..., named __VA_ARGS__ unless the macro names it.
+  bool variadic;
+  Symbol va_name;
+  MacroHandler handler;
+} Macro;
+
+typedef struct {
+  Symbol name;
+  PPToken *tokens;
+  // fully expanded copy, made the first time the body needs it.
+  PPToken *expanded;
+} MacroArg;
+
+typedef enum {
+  IN_THEN,
+  IN_ELIF,
+  IN_ELSE
+} CondContext;
+
+typedef struct CondIncl CondIncl;
+struct CondIncl {
+  CondIncl *next;
+  CondContext context;
+  PPToken *tok;
+  // some branch of this #if has been taken already.
+  bool included;
+};
+
+struct Preprocessor {
+  Arena *arena;
+  Interner names;
+  // indexed by symbol, NULL where the name is not a macro.
+  Macro **macros;
+  uint32_t macro_capacity;
+  CondIncl *cond;
+  // indexed by SourceFile id, files that said #pragma once in this run.
+  bool *once;
+  uint32_t once_capacity;
+  uint32_t run;
+  int counter;
+  Symbol defined;
+  Symbol va_args;
+  Symbol va_opt;
+  char *out;
+  size_t length;
+  size_t capacity;
+  // what was written last, to tell when two tokens need a space between them.
+  uint8_t last_kind;
+  char last_char;
+  const char *last_end;
+};
+
+// The include cache, process wide and shared by every thread preprocessing.
+// Paths are interned so a lookup is one hash, the symbol indexes
+// `cache_files`. Anything in here is only touched with cache_lock held.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static Arena cache_arena;
+static Interner cache_paths;
+static SourceFile **cache_files;
+static uint32_t cache_capacity;
+static bool cache_ready = false;
+static uint32_t run_count = 0;
+
+static void ErrorAt(const SourceFile *file, uint32_t line, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  fprintf(Diagnostics(), "%s:%u: error: ", file->path, line);
+  vfprintf(Diagnostics(), fmt, args);
+  fprintf(Diagnostics(), "\n");
+  va_end(args);
+  Fail();
+}
+
+#define Error(tok, ...) ErrorAt((tok)->file, (tok)->line, __VA_ARGS__)
+
+// Reading files
+
+// Splices lines ending in a backslash and drops carriage returns. The
+// newlines that were spliced out go back after the joined line so line
+// numbers stay right.
+static size_t SpliceLines(char *text, size_t length) {
+  size_t out = 0;
+  int pending = 0;
+  for (size_t i = 0; i < length; ++i) {
+    if (text[i] == '\\' && i + 1 < length && text[i + 1] == '\n') {
+      i++;
+      pending++;
+    } else if (text[i] == '\\' && i + 2 < length && text[i + 1] == '\r' &&
+        text[i + 2] == '\n') {
+      i += 2;
+      pending++;
+    } else if (text[i] == '\r' && i + 1 < length && text[i + 1] == '\n') {
+      continue;
+    } else if (text[i] == '\n') {
+      text[out++] = '\n';
+      for (; pending > 0; --pending) {
+        text[out++] = '\n';
+      }
+    } else {
+      text[out++] = text[i];
+    }
+  }
+  for (; pending > 0; --pending) {
+    text[out++] = '\n';
+  }
+  return out;
+}
+
+// A file that changed is read again. The old contents are leaked rather than
+// freed, another run may still have tokens pointing into them.
+static bool ReadSourceFile(SourceFile *file) {
+  file->contents = NULL;
+  int fd = open(file->path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return false;
+  }
+  // room for a missing final newline and the NUL.
+  char *text = malloc(st.st_size + 2);
+  if (text == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  size_t length = 0;
+  while (length < (size_t) st.st_size) {
+    ssize_t n = read(fd, text + length, st.st_size - length);
+    if (n <= 0) {
+      break;
+    }
+    length += n;
+  }
+  close(fd);
+  length = SpliceLines(text, length);
+  if (length == 0 || text[length - 1] != '\n') {
+    text[length++] = '\n';
+  }
+  text[length] = '\0';
+  file->contents = text;
+  file->length = length;
+  file->dev = st.st_dev;
+  file->ino = st.st_ino;
+  file->size = st.st_size;
+  file->mtime = st.st_mtim;
+  file->ctime = st.st_ctim;
+  file->guard = NULL;
+  file->guard_checked = false;
+  return true;
+}
+
+static bool SameTime(struct timespec a, struct timespec b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static bool Unchanged(const SourceFile *file, const struct stat *st) {
+  return st->st_dev == file->dev && st->st_ino == file->ino &&
+      st->st_size == file->size && SameTime(st->st_mtim, file->mtime) &&
+      SameTime(st->st_ctim, file->ctime);
+}
+
+// The path's number in the cache, every file a run sees gets one so the per
+// run tables can be indexed by it. Called with cache_lock held.
+static Symbol CacheSymbol(const char *path) {
+  if (!cache_ready) {
+    cache_arena = allocate_arena(64 * 1024);
+    cache_paths = NewInterner(&cache_arena);
+    cache_ready = true;
+  }
+  return Intern(&cache_paths, path, strlen(path));
+}
+
+// Finds `path` in the cache, reading it on first use. The first lookup in a
+// run also checks the file hasn't changed since it was read. Returns NULL if
+// the file can't be read.
+static SourceFile *LoadFile(uint32_t run, const char *path) {
+  pthread_mutex_lock(&cache_lock);
+  Symbol symbol = CacheSymbol(path);
+  if (symbol >= cache_capacity) {
+    uint32_t capacity = cache_capacity == 0 ? 64 : cache_capacity * 2;
+    while (capacity <= symbol) {
+      capacity *= 2;
+    }
+    cache_files = arena_realloc(&cache_arena, cache_files,
+                                sizeof(SourceFile *) * cache_capacity,
+                                sizeof(SourceFile *) * capacity);
+    memset(cache_files + cache_capacity, 0,
+           sizeof(SourceFile *) * (capacity - cache_capacity));
+    cache_capacity = capacity;
+  }
+  SourceFile *file = cache_files[symbol];
+  if (file == NULL) {
+    file = arena_alloc(&cache_arena, sizeof(SourceFile));
+    memset(file, 0, sizeof(SourceFile));
+    file->path = SymbolText(&cache_paths, symbol);
+    file->id = symbol;
+    cache_files[symbol] = file;
+    ReadSourceFile(file);
+    file->checked_run = run;
+  } else if (file->checked_run != run) {
+    struct stat st;
+    bool exists = stat(path, &st) == 0;
+    if (exists != (file->contents != NULL) || (exists && !Unchanged(file, &st))) {
+      ReadSourceFile(file);
+    }
+    file->checked_run = run;
+  }
+  bool found = file->contents != NULL;
+  pthread_mutex_unlock(&cache_lock);
+  return found ? file : NULL;
+}
+
+// Tokens
+
+static const char *punctuators[] = {
+    "<<=", ">>=", "...", "==", "!=", "<=", ">=", "->", "+=", "-=", "*=",
+    "/=", "++", "--", "%=", "&=", "|=", "^=", "&&", "||", "<<", ">>", "##",
+};
+
+static int PunctLength(const char *p) {
+  for (size_t i = 0; i < sizeof(punctuators) / sizeof(punctuators[0]); ++i) {
+    size_t n = strlen(punctuators[i]);
+    if (strncmp(p, punctuators[i], n) == 0) {
+      return n;
+    }
+  }
+  return ispunct((unsigned char) *p) ? 1 : 0;
+}
+
+static bool IsIdentStart(char c) {
+  return isalpha((unsigned char) c) || c == '_' || c == '$';
+}
+
+static bool IsIdentChar(char c) {
+  return isalnum((unsigned char) c) || c == '_' || c == '$';
+}
+
+// Length of an L, u, U or u8 prefix when a string or character literal
+// follows it, otherwise zero.
+static int LiteralPrefix(const char *p) {
+  if (p[0] == 'u' && p[1] == '8' && (p[2] == '"' || p[2] == '\'')) {
+    return 2;
+  }
+  if ((p[0] == 'L' || p[0] == 'u' || p[0] == 'U') && (p[1] == '"' || p[1] == '\'')) {
+    return 1;
+  }
+  return 0;
+}
+
+// Returns the end of the literal opening at `p`, or NULL if it runs off the
+// end of the line.
+static const char *SkipLiteral(const char *p) {
+  char quote = *p++;
+  while (*p != quote) {
+    if (*p == '\n' || *p == '\0') {
+      return NULL;
+    }
+    if (*p == '\\' && p[1] != '\n' && p[1] != '\0') {
+      p++;
+    }
+    p++;
+  }
+  return p + 1;
+}
+
+static PPToken *NewToken(Preprocessor *pp, uint8_t kind, const char *text,
+                         uint32_t length, const PPToken *tmpl) {
+  PPToken *tok = arena_alloc(pp->arena, sizeof(PPToken));
+  *tok = *tmpl;
+  tok->next = NULL;
+  tok->kind = kind;
+  tok->text = text;
+  tok->length = length;
+  return tok;
+}
+
+static PPToken *Tokenize(Preprocessor *pp, const char *p, SourceFile *file,
+                         uint32_t line, uint16_t depth) {
+  PPToken head = {.next = NULL};
+  PPToken *cur = &head;
+  bool at_bol = true;
+  bool space = false;
+  while (*p != '\0') {
+    if (p[0] == '/' && p[1] == '/') {
+      while (*p != '\n' && *p != '\0') {
+        p++;
+      }
+      space = true;
+      continue;
+    }
+    if (p[0] == '/' && p[1] == '*') {
+      const char *end = strstr(p + 2, "*/");
+      if (end == NULL) {
+        ErrorAt(file, line, "unterminated comment");
+      }
+      for (; p < end; ++p) {
+        line += *p == '\n';
+      }
+      p = end + 2;
+      space = true;
+      continue;
+    }
+    if (*p == '\n') {
+      p++;
+      line++;
+      at_bol = true;
+      space = false;
+      continue;
+    }
+    if (isspace((unsigned char) *p)) {
+      p++;
+      space = true;
+      continue;
+    }
+    const char *start = p;
+    uint8_t kind;
+    int prefix = LiteralPrefix(p);
+    if (isdigit((unsigned char) *p) || (*p == '.' && isdigit((unsigned char) p[1]))) {
+      p++;
+      for (;;) {
+        if ((*p == 'e' || *p == 'E' || *p == 'p' || *p == 'P') &&
+            (p[1] == '+' || p[1] == '-')) {
+          p += 2;
+        } else if (IsIdentChar(*p) || *p == '.') {
+          p++;
+        } else {
+          break;
+        }
+      }
+      kind = PP_NUMBER;
+    } else if (*p == '"' || *p == '\'' || prefix != 0) {
+      const char *end = SkipLiteral(p + prefix);
+      if (end != NULL) {
+        kind = p[prefix] == '"' ? PP_STRING : PP_CHAR;
+        p = end;
+      } else {
+        // a lone quote, fine in a skipped group and an error anywhere else,
+        // which the lexer will report.
+        kind = PP_OTHER;
+        p += prefix + 1;
+      }
+    } else if (IsIdentStart(*p)) {
+      while (IsIdentChar(*p)) {
+        p++;
+      }
+      kind = PP_IDENT;
+    } else if (PunctLength(p) != 0) {
+      p += PunctLength(p);
+      kind = PP_PUNCT;
+    } else {
+      p++;
+      kind = PP_OTHER;
+    }
+    PPToken *tok = arena_alloc(pp->arena, sizeof(PPToken));
+    *tok = (PPToken) {
+        .text = start,
+        .length = p - start,
+        .line = line,
+        .kind = kind,
+        .at_bol = at_bol,
+        .space = space,
+        .depth = depth,
+        .file = file,
+    };
+    if (kind == PP_IDENT) {
+      tok->name = Intern(&pp->names, start, tok->length);
+    }
+    cur = cur->next = tok;
+    at_bol = false;
+    space = false;
+  }
+  PPToken *eof = arena_alloc(pp->arena, sizeof(PPToken));
+  *eof = (PPToken) {
+      .text = p,
+      .line = line,
+      .kind = PP_EOF,
+      .at_bol = true,
+      .depth = depth,
+      .file = file,
+  };
+  cur->next = eof;
+  return head.next;
+}
+
+static bool Equal(const PPToken *tok, const char *text) {
+  return tok->kind != PP_EOF && strlen(text) == tok->length &&
+      memcmp(tok->text, text, tok->length) == 0;
+}
+
+// Only a # from the source starts a directive, one a macro expanded to at the
+// start of a line doesn't (C11 6.10.3.4). Expanded tokens all have a hideset.
+static bool IsHash(const PPToken *tok) {
+  return tok->at_bol && tok->hideset == NULL && Equal(tok, "#");
+}
+
+// The directive name after a `#`, which must be on the same line.
+static bool IsDirective(const PPToken *tok, const char *name) {
+  return !tok->at_bol && Equal(tok, name);
+}
+
+static PPToken *CopyToken(Preprocessor *pp, const PPToken *tok) {
+  PPToken *copy = arena_alloc(pp->arena, sizeof(PPToken));
+  *copy = *tok;
+  copy->next = NULL;
+  return copy;
+}
+
+static PPToken *NewEof(Preprocessor *pp, const PPToken *tok) {
+  PPToken *eof = CopyToken(pp, tok);
+  eof->kind = PP_EOF;
+  eof->length = 0;
+  return eof;
+}
+
+// Copies the tokens up to the end of the line into their own list.
+static PPToken *CopyLine(Preprocessor *pp, PPToken **rest, PPToken *tok) {
+  PPToken head = {.next = NULL};
+  PPToken *cur = &head;
+  for (; !tok->at_bol; tok = tok->next) {
+    cur = cur->next = CopyToken(pp, tok);
+  }
+  cur->next = NewEof(pp, tok);
+  *rest = tok;
+  return head.next;
+}
+
+static PPToken *SkipLine(PPToken *tok) {
+  while (!tok->at_bol) {
+    tok = tok->next;
+  }
+  return tok;
+}
+
+// Copies `tok` in front of `rest`, dropping its EOF.
+static PPToken *Append(Preprocessor *pp, PPToken *tok, PPToken *rest) {
+  PPToken head = {.next = NULL};
+  PPToken *cur = &head;
+  for (; tok->kind != PP_EOF; tok = tok->next) {
+    cur = cur->next = CopyToken(pp, tok);
+  }
+  cur->next = rest;
+  return head.next;
+}
+
+static char *JoinTokens(Preprocessor *pp, const PPToken *tok, const PPToken *end) {
+  size_t length = 0;
+  for (const PPToken *t = tok; t != end && t->kind != PP_EOF; t = t->next) {
+    length += t->length + 1;
+  }
+  char *text = arena_alloc(pp->arena, length + 1);
+  size_t pos = 0;
+  for (const PPToken *t = tok; t != end && t->kind != PP_EOF; t = t->next) {
+    if (t != tok && t->space) {
+      text[pos++] = ' ';
+    }
+    memcpy(text + pos, t->text, t->length);
+    pos += t->length;
+  }
+  text[pos] = '\0';
+  return text;
+}
+
+static PPToken *NewStringToken(Preprocessor *pp, const char *str, const PPToken *tmpl) {
+  size_t length = 2;
+  for (const char *s = str; *s != '\0'; ++s) {
+    length += (*s == '\\' || *s == '"') ? 2 : 1;
+  }
+  char *text = arena_alloc(pp->arena, length + 1);
+  size_t pos = 0;
+  text[pos++] = '"';
+  for (const char *s = str; *s != '\0'; ++s) {
+    if (*s == '\\' || *s == '"') {
+      text[pos++] = '\\';
+    }
+    text[pos++] = *s;
+  }
+  text[pos++] = '"';
+  text[pos] = '\0';
+  return NewToken(pp, PP_STRING, text, pos, tmpl);
+}
+
+static PPToken *NewNumberToken(Preprocessor *pp, long value, const PPToken *tmpl) {
+  char *text = arena_alloc(pp->arena, 24);
+  int length = snprintf(text, 24, "%ld", value);
+  return NewToken(pp, PP_NUMBER, text, length, tmpl);
+}
+
+// Hidesets
+
+static Hideset *NewHideset(Preprocessor *pp, Symbol name) {
+  Hideset *hs = arena_alloc(pp->arena, sizeof(Hideset));
+  hs->next = NULL;
+  hs->name = name;
+  return hs;
+}
+
+static bool HidesetContains(const Hideset *hs, Symbol name) {
+  for (; hs != NULL; hs = hs->next) {
+    if (hs->name == name) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static Hideset *HidesetUnion(Preprocessor *pp, const Hideset *a, Hideset *b) {
+  Hideset head = {.next = NULL};
+  Hideset *cur = &head;
+  for (; a != NULL; a = a->next) {
+    cur = cur->next = NewHideset(pp, a->name);
+  }
+  cur->next = b;
+  return head.next;
+}
+
+static Hideset *HidesetIntersection(Preprocessor *pp, const Hideset *a, const Hideset *b) {
+  Hideset head = {.next = NULL};
+  Hideset *cur = &head;
+  for (; a != NULL; a = a->next) {
+    if (HidesetContains(b, a->name)) {
+      cur = cur->next = NewHideset(pp, a->name);
+    }
+  }
+  return head.next;
+}
+
+static PPToken *AddHideset(Preprocessor *pp, PPToken *tok, Hideset *hs) {
+  PPToken head = {.next = NULL};
+  PPToken *cur = &head;
+  for (; tok != NULL; tok = tok->next) {
+    PPToken *copy = CopyToken(pp, tok);
+    copy->hideset = HidesetUnion(pp, copy->hideset, hs);
+    cur = cur->next = copy;
+  }
+  return head.next;
+}
+
+// Macros
+
+static Macro *FindMacro(Preprocessor *pp, const PPToken *tok) {
+  if (tok->kind != PP_IDENT || tok->name >= pp->macro_capacity) {
+    return NULL;
+  }
+  return pp->macros[tok->name];
+}
+
+static Macro *AddMacro(Preprocessor *pp, Symbol name) {
+  if (name >= pp->macro_capacity) {
+    uint32_t capacity = pp->macro_capacity == 0 ? 256 : pp->macro_capacity * 2;
+    while (capacity <= name) {
+      capacity *= 2;
+    }
+    pp->macros = arena_realloc(pp->arena, pp->macros,
+                               sizeof(Macro *) * pp->macro_capacity,
+                               sizeof(Macro *) * capacity);
+    memset(pp->macros + pp->macro_capacity, 0,
+           sizeof(Macro *) * (capacity - pp->macro_capacity));
+    pp->macro_capacity = capacity;
+  }
+  Macro *macro = arena_alloc(pp->arena, sizeof(Macro));
+  memset(macro, 0, sizeof(Macro));
+  macro->name = name;
+  pp->macros[name] = macro;
+  return macro;
+}
+
+static bool IsDefined(Preprocessor *pp, const char *name) {
+  Symbol symbol = Intern(&pp->names, name, strlen(name));
+  return symbol < pp->macro_capacity && pp->macros[symbol] != NULL;
+}
+
+static void ReadMacroDefinition(Preprocessor *pp, PPToken **rest, PPToken *tok) {
+  if (tok->kind != PP_IDENT) {
+    Error(tok, "macro names must be identifiers");
+  }
+  Macro *macro = AddMacro(pp, tok->name);
+  tok = tok->next;
+  // a function like macro has its ( right against the name.
+  if (!tok->at_bol && !tok->space && Equal(tok, "(")) {
+    macro->function_like = true;
+    Symbol params[MAX_MACRO_PARAMS];
+    int count = 0;
+    tok = tok->next;
+    while (!Equal(tok, ")")) {
+      if (tok->at_bol) {
+        Error(tok, "missing ')' in macro parameter list");
+      }
+      if (count > 0 || macro->variadic) {
+        if (!Equal(tok, ",") || macro->variadic) {
+          Error(tok, "expected ',' or ')' in macro parameter list");
+        }
+        tok = tok->next;
+      }
+      if (Equal(tok, "...")) {
+        macro->variadic = true;
+        macro->va_name = pp->va_args;
+        tok = tok->next;
+        continue;
+      }
+      if (tok->kind != PP_IDENT) {
+        Error(tok, "expected a parameter name");
+      }
+      if (Equal(tok->next, "...")) {
+        // gcc's named variadic parameter, `args...`.
+        macro->variadic = true;
+        macro->va_name = tok->name;
+        tok = tok->next->next;
+        continue;
+      }
+      if (count == MAX_MACRO_PARAMS) {
+        Error(tok, "too many macro parameters");
+      }
+      params[count++] = tok->name;
+      tok = tok->next;
+    }
+    if (tok->at_bol) {
+      Error(tok, "missing ')' in macro parameter list");
+    }
+    tok = tok->next;
+    macro->params = arena_alloc(pp->arena, sizeof(Symbol) * (count + 1));
+    memcpy(macro->params, params, sizeof(Symbol) * count);
+    macro->param_count = count;
+  }
+  macro->body = CopyLine(pp, rest, tok);
+  if (macro->body->kind != PP_EOF) {
+    macro->body->space = false;
+  }
+}
+
+// Reads one argument, or with `read_rest` everything up to the closing
+// paren for the variadic part.
+static PPToken *ReadMacroArg(Preprocessor *pp, PPToken **rest, PPToken *tok,
+                             bool read_rest) {
+  PPToken head = {.next = NULL};
+  PPToken *cur = &head;
+  int level = 0;
+  for (;;) {
+    if (level == 0 && Equal(tok, ")")) {
+      break;
+    }
+    if (level == 0 && !read_rest && Equal(tok, ",")) {
+      break;
+    }
+    if (tok->kind == PP_EOF) {
+      Error(tok, "unterminated argument list invoking macro");
+    }
+    if (Equal(tok, "(")) {
+      level++;
+    } else if (Equal(tok, ")")) {
+      level--;
+    }
+    cur = cur->next = CopyToken(pp, tok);
+    tok = tok->next;
+  }
+  cur->next = NewEof(pp, tok);
+  if (head.next->kind != PP_EOF) {
+    head.next->space = false;
+  }
+  *rest = tok;
+  return head.next;
+}
+
+// Reads the arguments of `macro` invoked at `tok`, leaving `rest` at the
+// closing paren.
+static MacroArg *ReadMacroArgs(Preprocessor *pp, PPToken **rest, PPToken *tok,
+                               const Macro *macro) {
+  PPToken *start = tok;
+  tok = tok->next->next;
+  int count = macro->param_count + macro->variadic;
+  MacroArg *args = arena_alloc(pp->arena, sizeof(MacroArg) * (count + 1));
+  for (int i = 0; i < macro->param_count; ++i) {
+    if (i > 0) {
+      if (!Equal(tok, ",")) {
+        Error(start, "macro \"%.*s\" requires %d arguments",
+              start->length, start->text, macro->param_count);
+      }
+      tok = tok->next;
+    }
+    args[i] = (MacroArg) {.name = macro->params[i]};
+    args[i].tokens = ReadMacroArg(pp, &tok, tok, false);
+  }
+  if (macro->variadic) {
+    MacroArg *va = &args[macro->param_count];
+    *va = (MacroArg) {.name = macro->va_name};
+    if (Equal(tok, ")")) {
+      va->tokens = NewEof(pp, tok);
+    } else {
+      if (macro->param_count > 0) {
+        if (!Equal(tok, ",")) {
+          Error(start, "macro \"%.*s\" requires at least %d arguments",
+                start->length, start->text, macro->param_count);
+        }
+        tok = tok->next;
+      }
+      va->tokens = ReadMacroArg(pp, &tok, tok, true);
+    }
+  }
+  if (!Equal(tok, ")")) {
+    Error(start, "too many arguments for macro \"%.*s\"", start->length, start->text);
+  }
+  *rest = tok;
+  return args;
+}
+
+static MacroArg *FindArg(MacroArg *args, int count, const PPToken *tok) {
+  if (tok->kind != PP_IDENT) {
+    return NULL;
+  }
+  for (int i = 0; i < count; ++i) {
+    if (args[i].name == tok->name) {
+      return &args[i];
+    }
+  }
+  return NULL;
+}
+
+// The # operator. As in C11 6.10.3.2, any run of whitespace between tokens,
+// newlines included, becomes one space, and only the \ and " inside string
+// and character literals are escaped.
+static PPToken *Stringize(Preprocessor *pp, const PPToken *hash, const PPToken *arg) {
+  size_t length = 2;
+  for (const PPToken *t = arg; t->kind != PP_EOF; t = t->next) {
+    length += 2 * t->length + 1;
+  }
+  char *text = arena_alloc(pp->arena, length + 1);
+  size_t pos = 0;
+  text[pos++] = '"';
+  for (const PPToken *t = arg; t->kind != PP_EOF; t = t->next) {
+    if (t != arg && (t->space || t->at_bol)) {
+      text[pos++] = ' ';
+    }
+    bool literal = t->kind == PP_STRING || t->kind == PP_CHAR;
+    for (uint32_t i = 0; i < t->length; ++i) {
+      if (literal && (t->text[i] == '\\' || t->text[i] == '"')) {
+        text[pos++] = '\\';
+      }
+      text[pos++] = t->text[i];
+    }
+  }
+  text[pos++] = '"';
+  text[pos] = '\0';
+  return NewToken(pp, PP_STRING, text, pos, hash);
+}
+
+// Glues two tokens together for ##, the result has to be a single token.
+static PPToken *Paste(Preprocessor *pp, const PPToken *lhs, const PPToken *rhs) {
+  char *text = arena_alloc(pp->arena, lhs->length + rhs->length + 1);
+  memcpy(text, lhs->text, lhs->length);
+  memcpy(text + lhs->length, rhs->text, rhs->length);
+  text[lhs->length + rhs->length] = '\0';
+  PPToken *tok = Tokenize(pp, text, lhs->file, lhs->line, lhs->depth);
+  if (tok->kind == PP_EOF || tok->next->kind != PP_EOF) {
+    Error(lhs, "pasting \"%.*s\" and \"%.*s\" does not give a valid preprocessing token",
+          lhs->length, lhs->text, rhs->length, rhs->text);
+  }
+  tok->at_bol = lhs->at_bol;
+  tok->space = lhs->space;
+  tok->hideset = lhs->hideset;
+  return tok;
+}
+
+static PPToken *ExpandTokens(Preprocessor *pp, PPToken *tok);
+
+static PPToken *ExpandArg(Preprocessor *pp, MacroArg *arg) {
+  if (arg->expanded == NULL) {
+    arg->expanded = ExpandTokens(pp, arg->tokens);
+  }
+  return arg->expanded;
+}
+
+static bool HasVarargs(const Macro *macro, const MacroArg *args) {
+  return macro->variadic && args[macro->param_count].tokens->kind != PP_EOF;
+}
+
+// Replaces the parameters in a macro body with the arguments and applies # and
+// ##. An object-like macro has no `args`, only its ## does anything and a #
+// is kept as it is.
+static PPToken *Subst(Preprocessor *pp, PPToken *tok, const Macro *macro, MacroArg *args) {
+  int count = macro->function_like ? macro->param_count + macro->variadic : 0;
+  PPToken head = {.next = NULL};
+  PPToken *cur = &head;
+  while (tok->kind != PP_EOF) {
+    if (macro->function_like && Equal(tok, "#")) {
+      MacroArg *arg = FindArg(args, count, tok->next);
+      if (arg == NULL) {
+        Error(tok, "'#' is not followed by a macro parameter");
+      }
+      cur = cur->next = Stringize(pp, tok, arg->tokens);
+      tok = tok->next->next;
+      continue;
+    }
+    // gcc's `, ## __VA_ARGS__` drops the comma when there are no varargs.
+    if (Equal(tok, ",") && Equal(tok->next, "##") && macro->variadic &&
+        tok->next->next->kind == PP_IDENT && tok->next->next->name == macro->va_name) {
+      if (HasVarargs(macro, args)) {
+        cur = cur->next = CopyToken(pp, tok);
+        tok = tok->next->next;
+      } else {
+        tok = tok->next->next->next;
+      }
+      continue;
+    }
+    if (Equal(tok, "##")) {
+      if (cur == &head) {
+        Error(tok, "'##' cannot appear at either end of a macro expansion");
+      }
+      if (tok->next->kind == PP_EOF) {
+        Error(tok, "'##' cannot appear at either end of a macro expansion");
+      }
+      MacroArg *arg = FindArg(args, count, tok->next);
+      if (arg != NULL) {
+        if (arg->tokens->kind != PP_EOF) {
+          PPToken *pasted = Paste(pp, cur, arg->tokens);
+          pasted->next = NULL;
+          *cur = *pasted;
+          for (PPToken *t = arg->tokens->next; t->kind != PP_EOF; t = t->next) {
+            cur = cur->next = CopyToken(pp, t);
+          }
+        }
+        tok = tok->next->next;
+        continue;
+      }
+      PPToken *pasted = Paste(pp, cur, tok->next);
+      pasted->next = NULL;
+      *cur = *pasted;
+      tok = tok->next->next;
+      continue;
+    }
+    MacroArg *arg = FindArg(args, count, tok);
+    if (arg != NULL && Equal(tok->next, "##")) {
+      PPToken *rhs = tok->next->next;
+      if (arg->tokens->kind == PP_EOF) {
+        // an empty left side pastes to just the right side.
+        MacroArg *arg2 = FindArg(args, count, rhs);
+        if (arg2 != NULL) {
+          for (PPToken *t = arg2->tokens; t->kind != PP_EOF; t = t->next) {
+            cur = cur->next = CopyToken(pp, t);
+          }
+        } else {
+          cur = cur->next = CopyToken(pp, rhs);
+        }
+        tok = rhs->next;
+        continue;
+      }
+      for (PPToken *t = arg->tokens; t->kind != PP_EOF; t = t->next) {
+        cur = cur->next = CopyToken(pp, t);
+      }
+      tok = tok->next;
+      continue;
+    }
+    if (macro->function_like && tok->kind == PP_IDENT && tok->name == pp->va_opt &&
+        Equal(tok->next, "(")) {
+      PPToken *opt = ReadMacroArg(pp, &tok, tok->next->next, true);
+      if (HasVarargs(macro, args)) {
+        for (PPToken *t = Subst(pp, opt, macro, args); t->kind != PP_EOF; t = t->next) {
+          cur = cur->next = t;
+        }
+      }
+      tok = tok->next;
+      continue;
+    }
+    if (arg != NULL) {
+      PPToken *t = ExpandArg(pp, arg);
+      if (t->kind != PP_EOF) {
+        PPToken *first = CopyToken(pp, t);
+        first->space = tok->space;
+        cur = cur->next = first;
+        for (t = t->next; t->kind != PP_EOF; t = t->next) {
+          cur = cur->next = CopyToken(pp, t);
+        }
+      }
+      tok = tok->next;
+      continue;
+    }
+    cur = cur->next = CopyToken(pp, tok);
+    tok = tok->next;
+  }
+  cur->next = tok;
+  return head.next;
+}
+
+// Expands the macro named by `tok` if there is one, leaving the expansion at
+// the front of `rest`. Returns false when `tok` is not a macro invocation.
+static bool ExpandMacro(Preprocessor *pp, PPToken **rest, PPToken *tok) {
+  if (tok->kind != PP_IDENT || HidesetContains(tok->hideset, tok->name)) {
+    return false;
+  }
+  Macro *macro = FindMacro(pp, tok);
+  if (macro == NULL) {
+    return false;
+  }
+  if (macro->handler != NULL) {
+    *rest = macro->handler(pp, tok);
+    (*rest)->next = tok->next;
+    return true;
+  }
+  PPToken *body;
+  PPToken *after;
+  if (!macro->function_like) {
+    Hideset *hs = HidesetUnion(pp, tok->hideset, NewHideset(pp, macro->name));
+    body = AddHideset(pp, Subst(pp, macro->body, macro, NULL), hs);
+    after = tok->next;
+  } else {
+    if (!Equal(tok->next, "(")) {
+      return false;
+    }
+    PPToken *rparen;
+    MacroArg *args = ReadMacroArgs(pp, &rparen, tok, macro);
+    // Prosser's algorithm, the expansion is hidden from the macro itself and
+    // from whatever both the name and the closing paren were hidden from.
+    Hideset *hs = HidesetIntersection(pp, tok->hideset, rparen->hideset);
+    hs = HidesetUnion(pp, hs, NewHideset(pp, macro->name));
+    body = AddHideset(pp, Subst(pp, macro->body, macro, args), hs);
+    after = rparen->next;
+  }
+  if (body->kind == PP_EOF) {
+    // expanded to nothing, keep the spacing but never start a new line, that
+    // could turn a following # into a directive.
+    if (after->kind != PP_EOF && tok->space && !after->space) {
+      PPToken *copy = CopyToken(pp, after);
+      copy->next = after->next;
+      copy->space = true;
+      after = copy;
+    }
+    *rest = after;
+    return true;
+  }
+  body->at_bol = tok->at_bol;
+  body->space = tok->space;
+  *rest = Append(pp, body, after);
+  return true;
+}
+
+// Fully expands a list that holds no directives, like a macro argument or the
+// expression of an #if.
+static PPToken *ExpandTokens(Preprocessor *pp, PPToken *tok) {
+  PPToken head = {.next = NULL};
+  PPToken *cur = &head;
+  while (tok->kind != PP_EOF) {
+    if (ExpandMacro(pp, &tok, tok)) {
+      continue;
+    }
+    cur = cur->next = CopyToken(pp, tok);
+    tok = tok->next;
+  }
+  cur->next = tok;
+  return head.next;
+}
+
+static PPToken *FileMacro(Preprocessor *pp, PPToken *tok) {
+  return NewStringToken(pp, tok->file->path, tok);
+}
+
+static PPToken *LineMacro(Preprocessor *pp, PPToken *tok) {
+  return NewNumberToken(pp, tok->line, tok);
+}
+
+static PPToken *CounterMacro(Preprocessor *pp, PPToken *tok) {
+  return NewNumberToken(pp, pp->counter++, tok);
+}
+
+static void AddBuiltin(Preprocessor *pp, const char *name, MacroHandler handler) {
+  AddMacro(pp, InternStr(&pp->names, name))->handler = handler;
+}
+
+// Conditionals
+
+static void PushCond(Preprocessor *pp, PPToken *tok, bool included) {
+  CondIncl *cond = arena_alloc(pp->arena, sizeof(CondIncl));
+  cond->next = pp->cond;
+  cond->context = IN_THEN;
+  cond->tok = tok;
+  cond->included = included;
+  pp->cond = cond;
+}
+
+static bool StartsCond(const PPToken *tok) {
+  return IsDirective(tok, "if") || IsDirective(tok, "ifdef") ||
+      IsDirective(tok, "ifndef");
+}
+
+// Skips a whole nested #if group, returning what follows its #endif.
+static PPToken *SkipNestedCond(PPToken *tok) {
+  while (tok->kind != PP_EOF) {
+    if (IsHash(tok) && StartsCond(tok->next)) {
+      tok = SkipNestedCond(tok->next->next);
+      continue;
+    }
+    if (IsHash(tok) && IsDirective(tok->next, "endif")) {
+      return tok->next->next;
+    }
+    tok = tok->next;
+  }
+  return tok;
+}
+
+// Skips a group that isn't included, stopping at the # of the #elif, #else or
+// #endif that ends it.
+static PPToken *SkipCond(PPToken *tok) {
+  while (tok->kind != PP_EOF) {
+    if (IsHash(tok) && StartsCond(tok->next)) {
+      tok = SkipNestedCond(tok->next->next);
+      continue;
+    }
+    if (IsHash(tok) && (IsDirective(tok->next, "elif") ||
+        IsDirective(tok->next, "else") || IsDirective(tok->next, "endif"))) {
+      break;
+    }
+    tok = tok->next;
+  }
+  return tok;
+}
+
+// #if expressions, evaluated in intmax_t. Unsigned arithmetic is not told
+// apart, which only matters for expressions that overflow.
+
+static int64_t EvalExpr(Preprocessor *pp, PPToken **tok, bool live);
+
+static int64_t ParseNumber(const PPToken *tok) {
+  char text[64];
+  if (tok->length >= sizeof(text)) {
+    Error(tok, "integer constant is too large");
+  }
+  memcpy(text, tok->text, tok->length);
+  text[tok->length] = '\0';
+  char *end;
+  uint64_t value;
+  if (text[0] == '0' && (text[1] == 'b' || text[1] == 'B')) {
+    value = strtoull(text + 2, &end, 2);
+  } else {
+    value = strtoull(text, &end, 0);
+  }
+  while (*end == 'u' || *end == 'U' || *end == 'l' || *end == 'L') {
+    end++;
+  }
+  if (*end != '\0') {
+    Error(tok, "invalid integer constant in #if: %s", text);
+  }
+  return (int64_t) value;
+}
+
+static int64_t ParseChar(const PPToken *tok) {
+  const char *p = tok->text;
+  while (*p != '\'') {
+    p++;
+  }
+  p++;
+  if (*p != '\\') {
+    return (signed char) *p;
+  }
+  p++;
+  switch (*p) {
+    case 'n': return '\n';
+    case 't': return '\t';
+    case 'r': return '\r';
+    case 'a': return '\a';
+    case 'b': return '\b';
+    case 'f': return '\f';
+    case 'v': return '\v';
+    case 'x': return (signed char) strtol(p + 1, NULL, 16);
+    case '0' ... '7': return (signed char) strtol(p, NULL, 8);
+    default: return *p;
+  }
+}
+
+static int64_t EvalPrimary(Preprocessor *pp, PPToken **tok, bool live) {
+  PPToken *t = *tok;
+  if (Equal(t, "(")) {
+    *tok = t->next;
+    int64_t value = EvalExpr(pp, tok, live);
+    if (!Equal(*tok, ")")) {
+      Error(*tok, "missing ')' in expression");
+    }
+    *tok = (*tok)->next;
+    return value;
+  }
+  *tok = t->next;
+  if (t->kind == PP_NUMBER) {
+    return ParseNumber(t);
+  }
+  if (t->kind == PP_CHAR) {
+    return ParseChar(t);
+  }
+  Error(t, "token \"%.*s\" is not valid in preprocessor expressions",
+        t->length, t->text);
+  return 0;
+}
+
+static int64_t EvalUnary(Preprocessor *pp, PPToken **tok, bool live) {
+  PPToken *t = *tok;
+  if (Equal(t, "+")) {
+    *tok = t->next;
+    return EvalUnary(pp, tok, live);
+  }
+  if (Equal(t, "-")) {
+    *tok = t->next;
+    return (int64_t) -(uint64_t) EvalUnary(pp, tok, live);
+  }
+  if (Equal(t, "~")) {
+    *tok = t->next;
+    return ~EvalUnary(pp, tok, live);
+  }
+  if (Equal(t, "!")) {
+    *tok = t->next;
+    return !EvalUnary(pp, tok, live);
+  }
+  return EvalPrimary(pp, tok, live);
+}
+
+static int BinaryPrecedence(const PPToken *tok) {
+  static const struct {
+    const char *op;
+    int precedence;
+  } ops[] = {
+      {"||", 1}, {"&&", 2}, {"|", 3}, {"^", 4}, {"&", 5},
+      {"==", 6}, {"!=", 6}, {"<", 7}, {">", 7}, {"<=", 7}, {">=", 7},
+      {"<<", 8}, {">>", 8}, {"+", 9}, {"-", 9}, {"*", 10}, {"/", 10}, {"%", 10},
+  };
+  if (tok->kind != PP_PUNCT) {
+    return 0;
+  }
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); ++i) {
+    if (Equal(tok, ops[i].op)) {
+      return ops[i].precedence;
+    }
+  }
+  return 0;
+}
+
+static int64_t ApplyBinary(const PPToken *op, int64_t lhs, int64_t rhs, bool live) {
+  uint64_t l = lhs;
+  uint64_t r = rhs;
+  if (Equal(op, "/") || Equal(op, "%")) {
+    if (rhs == 0) {
+      if (live) {
+        Error(op, "division by zero in #if");
+      }
+      return 0;
+    }
+    if (lhs == INT64_MIN && rhs == -1) {
+      return Equal(op, "/") ? lhs : 0;
+    }
+    return Equal(op, "/") ? lhs / rhs : lhs % rhs;
+  }
+  if (Equal(op, "||")) return lhs || rhs;
+  if (Equal(op, "&&")) return lhs && rhs;
+  if (Equal(op, "|")) return l | r;
+  if (Equal(op, "^")) return l ^ r;
+  if (Equal(op, "&")) return l & r;
+  if (Equal(op, "==")) return lhs == rhs;
+  if (Equal(op, "!=")) return lhs != rhs;
+  if (Equal(op, "<")) return lhs < rhs;
+  if (Equal(op, ">")) return lhs > rhs;
+  if (Equal(op, "<=")) return lhs <= rhs;
+  if (Equal(op, ">=")) return lhs >= rhs;
+  if (Equal(op, "<<")) return (int64_t) (l << (r & 63));
+  if (Equal(op, ">>")) return lhs >> (r & 63);
+  if (Equal(op, "+")) return (int64_t) (l + r);
+  if (Equal(op, "-")) return (int64_t) (l - r);
+  return (int64_t) (l * r);
+}
+
+// Precedence climbing. `live` is false on the side of && and || that is
+// short circuited, where dividing by zero is not an error.
+static int64_t EvalBinary(Preprocessor *pp, PPToken **tok, int min_precedence, bool live) {
+  int64_t lhs = EvalUnary(pp, tok, live);
+  for (;;) {
+    PPToken *op = *tok;
+    int precedence = BinaryPrecedence(op);
+    if (precedence == 0 || precedence < min_precedence) {
+      return lhs;
+    }
+    *tok = op->next;
+    bool rhs_live = live && !(Equal(op, "&&") && lhs == 0) && !(Equal(op, "||") && lhs != 0);
+    int64_t rhs = EvalBinary(pp, tok, precedence + 1, rhs_live);
+    lhs = ApplyBinary(op, lhs, rhs, rhs_live);
+  }
+}
+
+static int64_t EvalConditional(Preprocessor *pp, PPToken **tok, bool live) {
+  int64_t cond = EvalBinary(pp, tok, 1, live);
+  if (!Equal(*tok, "?")) {
+    return cond;
+  }
+  *tok = (*tok)->next;
+  int64_t then = EvalExpr(pp, tok, live && cond != 0);
+  if (!Equal(*tok, ":")) {
+    Error(*tok, "expected ':' in expression");
+  }
+  *tok = (*tok)->next;
+  int64_t otherwise = EvalConditional(pp, tok, live && cond == 0);
+  return cond != 0 ? then : otherwise;
+}
+
+static int64_t EvalExpr(Preprocessor *pp, PPToken **tok, bool live) {
+  int64_t value = EvalConditional(pp, tok, live);
+  while (Equal(*tok, ",")) {
+    *tok = (*tok)->next;
+    value = EvalConditional(pp, tok, live);
+  }
+  return value;
+}
+
+// Reads the expression after #if or #elif, resolving `defined` before macros
+// are expanded and turning any identifier left afterwards into 0.
+static bool EvalCondition(Preprocessor *pp, PPToken **rest, PPToken *tok) {
+  PPToken *directive = tok;
+  PPToken *line = CopyLine(pp, rest, tok->next);
+  PPToken head = {.next = NULL};
+  PPToken *cur = &head;
+  while (line->kind != PP_EOF) {
+    if (line->kind == PP_IDENT && line->name == pp->defined) {
+      PPToken *start = line;
+      line = line->next;
+      bool paren = Equal(line, "(");
+      if (paren) {
+        line = line->next;
+      }
+      if (line->kind != PP_IDENT) {
+        Error(start, "macro names must be identifiers");
+      }
+      bool defined = FindMacro(pp, line) != NULL;
+      line = line->next;
+      if (paren) {
+        if (!Equal(line, ")")) {
+          Error(start, "missing ')' after \"defined\"");
+        }
+        line = line->next;
+      }
+      cur = cur->next = NewNumberToken(pp, defined, start);
+      continue;
+    }
+    cur = cur->next = line;
+    line = line->next;
+  }
+  cur->next = line;
+  PPToken *expr = ExpandTokens(pp, head.next);
+  for (PPToken *t = expr; t->kind != PP_EOF; t = t->next) {
+    if (t->kind == PP_IDENT) {
+      t->kind = PP_NUMBER;
+      t->text = "0";
+      t->length = 1;
+    }
+  }
+  if (expr->kind == PP_EOF) {
+    Error(directive, "#%.*s with no expression", directive->length, directive->text);
+  }
+  PPToken *end = expr;
+  int64_t value = EvalExpr(pp, &end, true);
+  if (end->kind != PP_EOF) {
+    Error(end, "missing binary operator before token \"%.*s\"", end->length, end->text);
+  }
+  return value != 0;
+}
+
+// Includes
+
+// The whole file inside #ifndef X / #define X ... #endif makes X its guard.
+// Once X is defined the file can be skipped without even tokenizing it.
+// Returns the X token.
+static PPToken *DetectGuard(PPToken *tok) {
+  if (!IsHash(tok) || !IsDirective(tok->next, "ifndef")) {
+    return NULL;
+  }
+  PPToken *name = tok->next->next;
+  if (name->kind != PP_IDENT || !name->next->at_bol) {
+    return NULL;
+  }
+  tok = name->next;
+  if (!IsHash(tok) || !IsDirective(tok->next, "define") ||
+      tok->next->next->kind != PP_IDENT || tok->next->next->name != name->name) {
+    return NULL;
+  }
+  while (tok->kind != PP_EOF) {
+    if (!IsHash(tok)) {
+      tok = tok->next;
+      continue;
+    }
+    if (StartsCond(tok->next)) {
+      tok = SkipNestedCond(tok->next->next);
+      continue;
+    }
+    if (IsDirective(tok->next, "endif")) {
+      if (tok->next->next->kind != PP_EOF) {
+        return NULL;
+      }
+      return name;
+    }
+    // an #else or #elif of the guard itself.
+    if (IsDirective(tok->next, "else") || IsDirective(tok->next, "elif")) {
+      return NULL;
+    }
+    tok = tok->next;
+  }
+  return NULL;
+}
+
+static void MarkOnce(Preprocessor *pp, const SourceFile *file) {
+  if (file->id >= pp->once_capacity) {
+    uint32_t capacity = pp->once_capacity == 0 ? 64 : pp->once_capacity;
+    while (capacity <= file->id) {
+      capacity *= 2;
+    }
+    pp->once = arena_realloc(pp->arena, pp->once, pp->once_capacity, capacity);
+    memset(pp->once + pp->once_capacity, 0, capacity - pp->once_capacity);
+    pp->once_capacity = capacity;
+  }
+  pp->once[file->id] = true;
+}
+
+static PPToken *IncludeFile(Preprocessor *pp, PPToken *rest, SourceFile *file,
+                            const PPToken *from) {
+  if (file->id < pp->once_capacity && pp->once[file->id]) {
+    return rest;
+  }
+  pthread_mutex_lock(&cache_lock);
+  const char *guard = file->guard;
+  bool guard_checked = file->guard_checked;
+  const char *contents = file->contents;
+  pthread_mutex_unlock(&cache_lock);
+  if (guard != NULL && IsDefined(pp, guard)) {
+    return rest;
+  }
+  if (from->depth + 1 > MAX_INCLUDE_DEPTH) {
+    Error(from, "#include nested depth %d exceeds maximum of %d",
+          from->depth + 1, MAX_INCLUDE_DEPTH);
+  }
+  PPToken *tok = Tokenize(pp, contents, file, 1, from->depth + 1);
+  if (!guard_checked) {
+    PPToken *name = DetectGuard(tok);
+    pthread_mutex_lock(&cache_lock);
+    // Another thread may have read the file again since we took `contents`,
+    // the guard only goes with the contents it was found in. Tokenizing
+    // stays outside the lock, an error in it exits and the server's exit
+    // handler takes this lock too.
+    if (file->contents == contents && !file->guard_checked) {
+      if (name != NULL) {
+        file->guard = arena_strndup(&cache_arena, name->text, name->length);
+      }
+      file->guard_checked = true;
+    }
+    pthread_mutex_unlock(&cache_lock);
+  }
+  if (tok->kind == PP_EOF) {
+    return rest;
+  }
+  // the list is fresh, so link it in rather than copy it.
+  PPToken *last = tok;
+  while (last->next->kind != PP_EOF) {
+    last = last->next;
+  }
+  last->next = rest;
+  return tok;
+}
+
+// Looks for `name` next to the including file for a "quoted" include, then
+// in the include directories. #include_next starts after the directory the
+// including file was found in.
+static SourceFile *FindInclude(Preprocessor *pp, const SourceFile *from,
+                               const char *name, bool quoted, bool next) {
+  char path[PATH_MAX];
+  if (name[0] == '/') {
+    return LoadFile(pp->run, name);
+  }
+  size_t first = 0;
+  if (next) {
+    for (size_t i = 0; i < INCLUDE_DIR_COUNT; ++i) {
+      size_t length = strlen(include_dirs[i]);
+      if (strncmp(from->path, include_dirs[i], length) == 0 && from->path[length] == '/') {
+        first = i + 1;
+      }
+    }
+  } else if (quoted) {
+    const char *slash = strrchr(from->path, '/');
+    if (slash == NULL) {
+      snprintf(path, sizeof(path), "%s", name);
+    } else {
+      snprintf(path, sizeof(path), "%.*s/%s", (int) (slash - from->path), from->path, name);
+    }
+    SourceFile *file = LoadFile(pp->run, path);
+    if (file != NULL) {
+      return file;
+    }
+  }
+  for (size_t i = first; i < INCLUDE_DIR_COUNT; ++i) {
+    snprintf(path, sizeof(path), "%s/%s", include_dirs[i], name);
+    SourceFile *file = LoadFile(pp->run, path);
+    if (file != NULL) {
+      return file;
+    }
+  }
+  return NULL;
+}
+
+// Reads "name", <name> or a macro that expands to one of them.
+static char *ReadIncludeName(Preprocessor *pp, PPToken **rest, PPToken *tok,
+                             bool *quoted, bool expanded) {
+  if (!tok->at_bol && tok->kind == PP_STRING && tok->text[0] == '"') {
+    *quoted = true;
+    *rest = SkipLine(tok->next);
+    return arena_strndup(pp->arena, tok->text + 1, tok->length - 2);
+  }
+  if (!tok->at_bol && Equal(tok, "<")) {
+    PPToken *end = tok->next;
+    while (!Equal(end, ">")) {
+      if (end->at_bol || end->kind == PP_EOF) {
+        Error(tok, "missing terminating > character");
+      }
+      end = end->next;
+    }
+    *quoted = false;
+    *rest = SkipLine(end->next);
+    return JoinTokens(pp, tok->next, end);
+  }
+  if (!expanded && !tok->at_bol && tok->kind == PP_IDENT) {
+    PPToken *line = ExpandTokens(pp, CopyLine(pp, rest, tok));
+    if (line->kind != PP_EOF) {
+      line->at_bol = false;
+      PPToken *ignored;
+      return ReadIncludeName(pp, &ignored, line, quoted, true);
+    }
+  }
+  Error(tok, "#include expects \"FILENAME\" or <FILENAME>");
+  return NULL;
+}
+
+// Output
+
+static void Reserve(Preprocessor *pp, size_t length) {
+  if (pp->length + length + 1 <= pp->capacity) {
+    return;
+  }
+  size_t capacity = pp->capacity * 2;
+  while (capacity < pp->length + length + 1) {
+    capacity *= 2;
+  }
+  pp->out = realloc(pp->out, capacity);
+  if (pp->out == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  pp->capacity = capacity;
+}
+
+// Two tokens written next to each other must not read back as one, e.g. the
+// expansion of -X with X defined as -1. Tokens that were next to each other
+// in the source already read back as they are, like gcc those are never
+// split, so f(vers2.h) stays vers2.h.
+static bool WouldPaste(const Preprocessor *pp, const PPToken *tok) {
+  if (tok->text == pp->last_end) {
+    return false;
+  }
+  uint8_t last = pp->last_kind;
+  if ((last == PP_IDENT || last == PP_NUMBER) &&
+      (tok->kind == PP_IDENT || tok->kind == PP_NUMBER ||
+          tok->kind == PP_STRING || tok->kind == PP_CHAR)) {
+    return true;
+  }
+  // a pp-number takes in a following . and the sign after an exponent.
+  if (last == PP_NUMBER && tok->kind == PP_PUNCT &&
+      (tok->text[0] == '.' || tok->text[0] == '+' || tok->text[0] == '-')) {
+    return true;
+  }
+  if (last == PP_PUNCT && pp->last_char == '.' && tok->kind == PP_NUMBER) {
+    return true;
+  }
+  if (last == PP_PUNCT && tok->kind == PP_PUNCT) {
+    char pair[3] = {pp->last_char, tok->text[0], '\0'};
+    return PunctLength(pair) == 2 || strcmp(pair, "//") == 0 ||
+        strcmp(pair, "/*") == 0 || strcmp(pair, "..") == 0;
+  }
+  return false;
+}
+
+static void Emit(Preprocessor *pp, const PPToken *tok) {
+  Reserve(pp, tok->length + 2);
+  if (pp->length > 0) {
+    if (tok->at_bol) {
+      pp->out[pp->length++] = '\n';
+    } else if (tok->space || WouldPaste(pp, tok)) {
+      pp->out[pp->length++] = ' ';
+    }
+  }
+  // a macro's # at the start of a line, kept off column 0 so the output
+  // doesn't read back as a directive.
+  if (tok->at_bol && Equal(tok, "#")) {
+    pp->out[pp->length++] = ' ';
+  }
+  memcpy(pp->out + pp->length, tok->text, tok->length);
+  pp->length += tok->length;
+  pp->last_kind = tok->kind;
+  pp->last_char = tok->text[tok->length - 1];
+  pp->last_end = tok->text + tok->length;
+}
+
+static void ReportDirective(PPToken *start, PPToken *tok, const char *kind) {
+  const PPToken *end = SkipLine(tok);
+  const char *from = tok->text;
+  const char *to = from;
+  for (const PPToken *t = tok; t != end; t = t->next) {
+    to = t->text + t->length;
+  }
+  fprintf(Diagnostics(), "%s:%u: %s: #%.*s\n", start->file->path, start->line, kind,
+          (int) (to - from), from);
+}
+
+static void PreprocessTokens(Preprocessor *pp, PPToken *tok) {
+  while (tok->kind != PP_EOF) {
+    if (ExpandMacro(pp, &tok, tok)) {
+      continue;
+    }
+    if (!IsHash(tok)) {
+      Emit(pp, tok);
+      tok = tok->next;
+      continue;
+    }
+    PPToken *start = tok;
+    tok = tok->next;
+    // a lone # is the null directive.
+    if (tok->at_bol) {
+      continue;
+    }
+    if (IsDirective(tok, "include") || IsDirective(tok, "include_next")) {
+      bool next = IsDirective(tok, "include_next");
+      bool quoted;
+      char *name = ReadIncludeName(pp, &tok, tok->next, &quoted, false);
+      SourceFile *file = FindInclude(pp, start->file, name, quoted, next);
+      if (file == NULL) {
+        Error(start, "%s: No such file or directory", name);
+      }
+      tok = IncludeFile(pp, tok, file, start);
+      continue;
+    }
+    if (IsDirective(tok, "define")) {
+      ReadMacroDefinition(pp, &tok, tok->next);
+      continue;
+    }
+    if (IsDirective(tok, "undef")) {
+      tok = tok->next;
+      if (tok->kind != PP_IDENT || tok->at_bol) {
+        Error(start, "macro names must be identifiers");
+      }
+      if (FindMacro(pp, tok) != NULL) {
+        pp->macros[tok->name] = NULL;
+      }
+      tok = SkipLine(tok->next);
+      continue;
+    }
+    if (IsDirective(tok, "if")) {
+      bool value = EvalCondition(pp, &tok, tok);
+      PushCond(pp, start, value);
+      if (!value) {
+        tok = SkipCond(tok);
+      }
+      continue;
+    }
+    if (IsDirective(tok, "ifdef") || IsDirective(tok, "ifndef")) {
+      bool negate = IsDirective(tok, "ifndef");
+      tok = tok->next;
+      if (tok->kind != PP_IDENT || tok->at_bol) {
+        Error(start, "macro names must be identifiers");
+      }
+      bool value = (FindMacro(pp, tok) != NULL) != negate;
+      PushCond(pp, start, value);
+      tok = SkipLine(tok->next);
+      if (!value) {
+        tok = SkipCond(tok);
+      }
+      continue;
+    }
+    if (IsDirective(tok, "elif")) {
+      if (pp->cond == NULL || pp->cond->context == IN_ELSE) {
+        Error(start, "#elif without #if");
+      }
+      pp->cond->context = IN_ELIF;
+      if (!pp->cond->included && EvalCondition(pp, &tok, tok)) {
+        pp->cond->included = true;
+      } else {
+        tok = SkipCond(tok);
+      }
+      continue;
+    }
+    if (IsDirective(tok, "else")) {
+      if (pp->cond == NULL || pp->cond->context == IN_ELSE) {
+        Error(start, "#else without #if");
+      }
+      pp->cond->context = IN_ELSE;
+      tok = SkipLine(tok->next);
+      if (pp->cond->included) {
+        tok = SkipCond(tok);
+      }
+      continue;
+    }
+    if (IsDirective(tok, "endif")) {
+      if (pp->cond == NULL) {
+        Error(start, "#endif without #if");
+      }
+      pp->cond = pp->cond->next;
+      tok = SkipLine(tok->next);
+      continue;
+    }
+    if (IsDirective(tok, "pragma")) {
+      if (IsDirective(tok->next, "once")) {
+        MarkOnce(pp, start->file);
+      }
+      // anything else is for a compiler we are not, drop it.
+      tok = SkipLine(tok);
+      continue;
+    }
+    if (IsDirective(tok, "error")) {
+      ReportDirective(start, tok, "error");
+      Fail();
+    }
+    if (IsDirective(tok, "warning")) {
+      ReportDirective(start, tok, "warning");
+      tok = SkipLine(tok);
+      continue;
+    }
+    // #line and gcc's `# 12 "file"` markers only matter for diagnostics.
+    if (IsDirective(tok, "line") || IsDirective(tok, "ident") ||
+        IsDirective(tok, "sccs") || tok->kind == PP_NUMBER) {
+      tok = SkipLine(tok);
+      continue;
+    }
+    Error(tok, "invalid preprocessing directive #%.*s", tok->length, tok->text);
+  }
+}
+
+char *PreprocessFile(Arena *scratch, const char *file_name, size_t *length) {
+  ArenaMark mark = arena_mark(scratch);
+  Preprocessor pp = {
+      .arena = scratch,
+      .names = NewInterner(scratch),
+      .macros = NULL,
+      .macro_capacity = 0,
+      .cond = NULL,
+      .run = __atomic_add_fetch(&run_count, 1, __ATOMIC_RELAXED),
+      .counter = 0,
+      .out = malloc(INITIAL_OUTPUT),
+      .length = 0,
+      .capacity = INITIAL_OUTPUT,
+  };
+  if (pp.out == NULL) {
+    fprintf(Diagnostics(), "failed to allocate memory");
+    Fail();
+  }
+  pp.defined = InternStr(&pp.names, "defined");
+  pp.va_args = InternStr(&pp.names, "__VA_ARGS__");
+  pp.va_opt = InternStr(&pp.names, "__VA_OPT__");
+  AddBuiltin(&pp, "__FILE__", FileMacro);
+  AddBuiltin(&pp, "__LINE__", LineMacro);
+  AddBuiltin(&pp, "__COUNTER__", CounterMacro);
+  static SourceFile builtin = {.path = "<built-in>", .contents = (char *) builtin_defines};
+  PreprocessTokens(&pp, Tokenize(&pp, builtin.contents, &builtin, 1, 0));
+
+  // The file being compiled is read for this run only, the cache is for what
+  // it includes. It still gets a number in the cache, #pragma once and an
+  // #include of itself go by that.
+  SourceFile *file = arena_alloc(scratch, sizeof(SourceFile));
+  memset(file, 0, sizeof(SourceFile));
+  pthread_mutex_lock(&cache_lock);
+  file->id = CacheSymbol(file_name);
+  file->path = SymbolText(&cache_paths, file->id);
+  pthread_mutex_unlock(&cache_lock);
+  if (!ReadSourceFile(file)) {
+    fprintf(Diagnostics(), "Failed to read %s", file_name);
+    Fail();
+  }
+  PreprocessTokens(&pp, Tokenize(&pp, file->contents, file, 1, 0));
+  if (pp.cond != NULL) {
+    Error(pp.cond->tok, "unterminated conditional directive");
+  }
+  Reserve(&pp, 1);
+  if (pp.length > 0) {
+    pp.out[pp.length++] = '\n';
+  }
+  pp.out[pp.length] = '\0';
+  free(file->contents);
+  arena_rewind(scratch, mark);
+  *length = pp.length;
+  return pp.out;
+}
+
+// Whether `word` appears in [source, end) as an identifier of its own.
+static bool HasWord(const char *source, const char *end, const char *word) {
+  size_t length = strlen(word);
+  for (const char *p = source;
+       (p = memmem(p, end - p, word, length)) != NULL; p += length) {
+    if ((p == source || !IsIdentChar(p[-1])) &&
+        (p + length == end || !IsIdentChar(p[length]))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool NeedsPreprocessing(const char *source, const char *end) {
+  // gcc -E predefines these two without any underscores, which the scan
+  // below wouldn't catch.
+  if (HasWord(source, end, "linux") || HasWord(source, end, "unix")) {
+    return true;
+  }
+  for (const char *p = source; p < end; ++p) {
+    if (!IsClass(*p, CC_PP)) {
+      continue;
+    }
+    char next = p + 1 < end ? p[1] : '\0';
+    switch (*p) {
+      case '#':
+      case '\\':
+        return true;
+      case '/':
+        if (next == '/' || next == '*') {
+          return true;
+        }
+        break;
+      case '%':
+        // %: is the digraph for #.
+        if (next == ':') {
+          return true;
+        }
+        break;
+      case '_':
+        if (next == '_' || (end - p >= 7 && memcmp(p, "_Pragma", 7) == 0)) {
+          return true;
+        }
+        break;
+    }
+  }
+  return false;
+}
+
+void WarmIncludeCache(const char *path) {
+  LoadFile(__atomic_add_fetch(&run_count, 1, __ATOMIC_RELAXED), path);
+}
+
+void WriteCachedPaths(FILE *out) {
+  pthread_mutex_lock(&cache_lock);
+  for (uint32_t i = 0; i < cache_capacity; ++i) {
+    if (cache_files[i] != NULL && cache_files[i]->contents != NULL) {
+      fprintf(out, "%s\n", cache_files[i]->path);
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
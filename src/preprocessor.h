@@ -0,0 +1,31 @@
+#ifndef BCC_SRC_PREPROCESSOR_H
+#define BCC_SRC_PREPROCESSOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include "arena.h"
+
+// Runs the C preprocessor over `file_name` in process and returns the result
+// as a malloced, NUL terminated buffer ready for OpenSourceBuffer, with its
+// length in `length`. Like gcc -E -P there are no line markers in the output.
+// Working memory comes from `scratch` and is rewound before returning.
+//
+// Files read by #include are cached for the life of the process along with
+// whether they are wrapped in an include guard, so a header is read and
+// scanned once however often it is included.
+char *PreprocessFile(Arena *scratch, const char *file_name, size_t *length);
+
+// Reads `path` into the include cache ahead of any run that needs it, a
+// missing file is ignored.
+void WarmIncludeCache(const char *path);
+// Lists every file in the include cache, one path a line.
+void WriteCachedPaths(FILE *out);
+
+// False when preprocessing [source, end) could not change what the lexer sees,
+// in process or with gcc -E: no directives, comments, line splices, _Pragma,
+// __ names or gcc's linux and unix, any of which might be predefined macros.
+// Errs towards true, a # in a string still counts.
+bool NeedsPreprocessing(const char *source, const char *end);
+
+#endif //BCC_SRC_PREPROCESSOR_H
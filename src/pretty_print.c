@@ -4,9 +4,23 @@
 #include "parser.h"
 #include "ir_gen.h"
 #include "codegen.h"
+#include "diagnostics.h"
 
 void PrintExpression(Exp* exp, int padding);
 
+// symbol table of the program currently being printed.
+static _Thread_local const Interner* symbols;
+// where this thread prints to, stdout unless set.
+static _Thread_local FILE* out;
+
+static FILE* Out() {
+  return out != NULL ? out : stdout;
+}
+
+void SetPrettyPrintOutput(FILE* file) {
+  out = file;
+}
+
 char* BinaryOpStr(BinaryOp op) {
   switch (op) {
     case ADD:
@@ -46,14 +60,14 @@ char* BinaryOpStr(BinaryOp op) {
     case LESS_OR_EQUAL:
       return "LessOrEqual";
     default:
-      fprintf(stderr, "uh oh, unexpected binary op, code:%d", op);
-      exit(2);
+      fprintf(Diagnostics(), "uh oh, unexpected binary op, code:%d", op);
+      Fail();
   }
 }
 
 void PrintBinary(BinaryExp exp, int padding) {
   char* op = BinaryOpStr(exp.op);
-  printf("%*s%s, \n", padding, "", op);
+  fprintf(Out(), "%*s%s, \n", padding, "", op);
   PrintExpression(exp.left, padding);
   PrintExpression(exp.right, padding);
 }
@@ -71,25 +85,25 @@ void PrintUnary(UnaryExp unary_exp, int padding) {
       op = "Not";
       break;
   }
-  printf("%*s%s,\n", padding, "", op);
+  fprintf(Out(), "%*s%s,\n", padding, "", op);
   PrintExpression(unary_exp.exp, padding);
 }
 
 void PrintExpression(Exp* exp, int padding) {
   switch (exp->type) {
     case eConst:
-      printf("%*sConstant(%d)\n", padding, "", exp->const_val);
+      fprintf(Out(), "%*sConstant(%d)\n", padding, "", exp->const_val);
       return;
     case eUnaryExp: {
-      printf("%*sUnary(\n", padding, "");
+      fprintf(Out(), "%*sUnary(\n", padding, "");
       PrintUnary(exp->unary_exp, padding + 2);
-      printf("%*s)\n", padding, "");
+      fprintf(Out(), "%*s)\n", padding, "");
       return;
     }
     case eBinaryExp:
-      printf("%*sBinary(\n", padding, "");
+      fprintf(Out(), "%*sBinary(\n", padding, "");
       PrintBinary(exp->binary_exp, padding + 2);
-      printf("%*s)\n", padding, "");
+      fprintf(Out(), "%*s)\n", padding, "");
       return;
   }
 }
@@ -99,26 +113,27 @@ void PrintStatement(Statement* statement, int padding) {
 }
 
 void PrintFunction(Function* function, int padding) {
-  printf("%*sname = \"%s\"\n", padding, "", function->name);
-  printf("%*sbody = Return(\n", padding, "");
+  fprintf(Out(), "%*sname = \"%s\"\n", padding, "", SymbolText(symbols, function->name));
+  fprintf(Out(), "%*sbody = Return(\n", padding, "");
   PrintStatement(function->statement, padding + 2);
-  printf("%*s)\n", padding, "");
+  fprintf(Out(), "%*s)\n", padding, "");
 }
 
 void PrettyPrintAST(Program* program) {
-  printf("Program(\n");
-  printf("  Function(\n");
+  symbols = program->symbols;
+  fprintf(Out(), "Program(\n");
+  fprintf(Out(), "  Function(\n");
   PrintFunction(program->function, 4);
-  printf("  )\n)\n");
+  fprintf(Out(), "  )\n)\n");
 }
 
 void PrintTackyVal(TackyVal val) {
   switch (val.type) {
     case TACKY_CONST:
-      printf("%d", val.const_val);
+      fprintf(Out(), "%d", val.const_val);
       return;
     case TACKY_VAR:
-      printf("%s", val.identifier);
+      fprintf(Out(), "%s", SymbolText(symbols, val.identifier));
       return;
   }
 }
@@ -126,10 +141,10 @@ void PrintTackyVal(TackyVal val) {
 void PrintTackyReturn(TackyVal val, int padding) {
   switch (val.type) {
     case TACKY_CONST:
-      printf("%*sReturn(%d),\n", padding, "", val.const_val);
+      fprintf(Out(), "%*sReturn(%d),\n", padding, "", val.const_val);
       return;
     case TACKY_VAR:
-      printf("%*sReturn(%s),\n", padding, "", val.identifier);
+      fprintf(Out(), "%*sReturn(%s),\n", padding, "", SymbolText(symbols, val.identifier));
       return;
   }
 }
@@ -137,22 +152,22 @@ void PrintTackyReturn(TackyVal val, int padding) {
 void PrintTackyUnary(TackyUnary unary, int padding) {
   switch (unary.op) {
     case TACKY_COMPLEMENT:
-      printf("%*sUnary(Complement, ", padding, "");
+      fprintf(Out(), "%*sUnary(Complement, ", padding, "");
       break;
     case TACKY_NEGATE:
-      printf("%*sUnary(Negate, ", padding, "");
+      fprintf(Out(), "%*sUnary(Negate, ", padding, "");
       break;
     case TACKY_L_NOT:
-      printf("%*sUnary(LogicalNot, ", padding, "");
+      fprintf(Out(), "%*sUnary(LogicalNot, ", padding, "");
       break;
     default:
-      fprintf(stderr, "Invalid Unary Op\n");
-      exit(2);
+      fprintf(Diagnostics(), "Invalid Unary Op\n");
+      Fail();
   }
   PrintTackyVal(unary.src);
-  printf(", ");
+  fprintf(Out(), ", ");
   PrintTackyVal(unary.dst);
-  printf("),\n");
+  fprintf(Out(), "),\n");
 }
 
 char* GetBinaryOpStr(TackyBinaryOp op) {
@@ -190,26 +205,26 @@ char* GetBinaryOpStr(TackyBinaryOp op) {
     case TACKY_GE_EQUAL:
       return "GreaterOrEqual";
     default:
-      fprintf(stderr, "encounterd unexpected binary op");
-      exit(2);
+      fprintf(Diagnostics(), "encounterd unexpected binary op");
+      Fail();
   }
 }
 
 void PrintTackyBinary(TackyBinary binary, int padding) {
   char* op = GetBinaryOpStr(binary.op);
 
-  printf("%*sBinary(%s, ", padding, "", op);
+  fprintf(Out(), "%*sBinary(%s, ", padding, "", op);
   PrintTackyVal(binary.left);
-  printf(", ");
+  fprintf(Out(), ", ");
   PrintTackyVal(binary.right);
-  printf(", ");
+  fprintf(Out(), ", ");
   PrintTackyVal(binary.dst);
-  printf("),\n");
+  fprintf(Out(), "),\n");
 }
 
 void PrintTackyJmpCC(JumpCond jc, int padding) {
   PrintTackyVal(jc.val);
-  printf(", %s)\n", jc.target);
+  fprintf(Out(), ", %s)\n", SymbolText(symbols, jc.target));
 }
 
 void PrintTackyInstruction(TackyInstruction* instr, int padding) {
@@ -224,66 +239,68 @@ void PrintTackyInstruction(TackyInstruction* instr, int padding) {
       PrintTackyBinary(instr->binary, padding);
       return;
     case TACKY_LABEL:
-      printf("%*sLabel(%s)\n", padding, "", instr->label);
+      fprintf(Out(), "%*sLabel(%s)\n", padding, "", SymbolText(symbols, instr->label));
       return;
     case TACKY_JMP:
-      printf("%*sJMP(%s)\n", padding, "", instr->jump_cond.target);
+      fprintf(Out(), "%*sJMP(%s)\n", padding, "",
+             SymbolText(symbols, instr->jump_cond.target));
       return;
     case TACKY_JMP_NZ:
-      printf("%*sJMP_NZ(", padding, "");
+      fprintf(Out(), "%*sJMP_NZ(", padding, "");
       PrintTackyJmpCC(instr->jump_cond, padding);
       return;
     case TACKY_JMP_Z:
-       printf("%*sJMP_Z(", padding, "");
+       fprintf(Out(), "%*sJMP_Z(", padding, "");
       PrintTackyJmpCC(instr->jump_cond, padding);
       return;
     case TACKY_COPY:
-      printf("%*sCOPY(");
+      fprintf(Out(), "%*sCOPY(", padding, "");
       PrintTackyVal(instr->copy.src);
-      printf(" , ");
+      fprintf(Out(), " , ");
       PrintTackyVal(instr->copy.dst);
-      printf(")\n");
+      fprintf(Out(), ")\n");
       return;
     default:
-      fprintf(stderr, "Encountered unexpected tacky instr type");
-      exit(2);
+      fprintf(Diagnostics(), "Encountered unexpected tacky instr type");
+      Fail();
   }
 }
 
 void PrintTackyFunction(TackyFunction* tf, int padding) {
-  printf("%*sidentifier =  \"%s\"\n", padding, "", tf->identifier);
-  printf("%*sinstructions = [\n", padding, "");
+  fprintf(Out(), "%*sidentifier =  \"%s\"\n", padding, "", SymbolText(symbols, tf->identifier));
+  fprintf(Out(), "%*sinstructions = [\n", padding, "");
   padding += 2;
   for (int i = 0; i < tf->instr_length; ++i) {
     PrintTackyInstruction(tf->instructions + i, padding);
   }
   padding -= 2;
-  printf("%*s]\n", padding, "");
+  fprintf(Out(), "%*s]\n", padding, "");
 }
 
 void PrettyPrintTacky(TackyProgram* tacky_program) {
-  printf("Program(\n");
-  printf("  Function(\n");
+  symbols = tacky_program->symbols;
+  fprintf(Out(), "Program(\n");
+  fprintf(Out(), "  Function(\n");
   PrintTackyFunction(tacky_program->function_def, 4);
-  printf("  )\n)\n");
+  fprintf(Out(), "  )\n)\n");
 }
 
 void PrintRegister(Register reg) {
   switch (reg) {
     case W0:
-      printf("W0");
+      fprintf(Out(), "W0");
       return;
     case W10:
-      printf("W10");
+      fprintf(Out(), "W10");
       return;
     case W11:
-      printf("W11");
+      fprintf(Out(), "W11");
       return;
     case W12:
-      printf("W12");
+      fprintf(Out(), "W12");
       return;
     case W13:
-      printf("W13");
+      fprintf(Out(), "W13");
       return;
   }
 }
@@ -294,13 +311,13 @@ void PrintOperand(Operand op) {
       PrintRegister(op.reg);
       return;
     case IMM:
-      printf("%d", op.imm);
+      fprintf(Out(), "%d", op.imm);
       return;
     case PSEUDO:
-      printf("%s", op.identifier);
+      fprintf(Out(), "%s", SymbolText(symbols, op.identifier));
       return;
     case STACK:
-      printf("Stack(%d)", op.stack_location);
+      fprintf(Out(), "Stack(%d)", op.stack_location);
       return;
   }
 }
@@ -308,10 +325,10 @@ void PrintOperand(Operand op) {
 void PrintArmUnaryOp(UnaryOperator op) {
   switch (op) {
     case NEG:
-      printf("NEG");
+      fprintf(Out(), "NEG");
       return;
     case NOT:
-      printf("NOT");
+      fprintf(Out(), "NOT");
       return;
   }
 }
@@ -319,48 +336,48 @@ void PrintArmUnaryOp(UnaryOperator op) {
 void PrintArmBinaryOp(BinaryOperator op) {
   switch (op) {
     case A_ADD:
-      printf("ADD");
+      fprintf(Out(), "ADD");
       return;
     case A_SUBTRACT:
-      printf("SUB");
+      fprintf(Out(), "SUB");
       return;
     case A_MULTIPLY:
-      printf("MUL");
+      fprintf(Out(), "MUL");
       return;
     case A_DIVIDE:
-      printf("DIV");
+      fprintf(Out(), "DIV");
       return;
     case A_OR:
-      printf("OR");
+      fprintf(Out(), "OR");
       return;
     case A_AND:
-      printf("AND");
+      fprintf(Out(), "AND");
       return;
     case A_XOR:
-      printf("XOR");
+      fprintf(Out(), "XOR");
       return;
     case A_RSHIFT:
-      printf("ASR");
+      fprintf(Out(), "ASR");
       return;
     case A_LSHIFT:
-      printf("LSL");
+      fprintf(Out(), "LSL");
       return;
     case A_CMP:
-      printf("CMP");
+      fprintf(Out(), "CMP");
       return;
   }
 }
 
 void PrintArmUnary(ArmUnary unary, int padding) {
-  printf("%*sUnary(", padding, "");
+  fprintf(Out(), "%*sUnary(", padding, "");
   PrintArmUnaryOp(unary.op);
-  printf(", ");
+  fprintf(Out(), ", ");
   PrintRegister(unary.reg);
-  printf(")\n");
+  fprintf(Out(), ")\n");
 }
 
 void PrintArmBinary(ArmBinary binary, int padding) {
-  printf("%*sBinary(%s, %s, %s, %s)\n", padding, "",
+  fprintf(Out(), "%*sBinary(%s, %s, %s, %s)\n", padding, "",
          ToBinaryOpStr(binary.op),
          GetRegisterStr(binary.left), GetRegisterStr(binary.right),
          GetRegisterStr(binary.dst));
@@ -368,21 +385,21 @@ void PrintArmBinary(ArmBinary binary, int padding) {
 
 void PrintTwoAddress(Operand src, Operand dst) {
   PrintOperand(src);
-  printf(", ");
+  fprintf(Out(), ", ");
   PrintOperand(dst);
-  printf("),\n");
+  fprintf(Out(), "),\n");
 }
 
 void PrintArmMsub(ArmMsub arm_msub, int padding) {
-  printf("%*sMsub(", padding, "");
+  fprintf(Out(), "%*sMsub(", padding, "");
   PrintRegister(arm_msub.left);
-  printf(", ");
+  fprintf(Out(), ", ");
   PrintRegister(arm_msub.right);
-  printf(", ");
+  fprintf(Out(), ", ");
   PrintRegister(arm_msub.m);
-  printf(", ");
+  fprintf(Out(), ", ");
   PrintRegister(arm_msub.dst);
-  printf(")\n");
+  fprintf(Out(), ")\n");
 }
 
 void PrintArmInstruction(Instruction* instr, int padding) {
@@ -397,50 +414,52 @@ void PrintArmInstruction(Instruction* instr, int padding) {
       PrintArmMsub(instr->msub, padding);
       return;
     case LDR:
-      printf("%*sLDR(", padding, "");
+      fprintf(Out(), "%*sLDR(", padding, "");
       PrintTwoAddress(instr->mov.src, instr->mov.dst);
       return;
     case STR:
-      printf("%*sSTR(", padding, "");
+      fprintf(Out(), "%*sSTR(", padding, "");
       PrintTwoAddress(instr->mov.src, instr->mov.dst);
       return;
     case MOV:
-      printf("%*sMOV(", padding, "");
+      fprintf(Out(), "%*sMOV(", padding, "");
       PrintTwoAddress(instr->mov.src, instr->mov.dst);
       return;
     case RET:
-      printf("%*sRET,\n", padding, "");
+      fprintf(Out(), "%*sRET,\n", padding, "");
       return;
     case ALLOC_STACK:
-      printf("%*sAllocStack(%d)\n", padding, "", instr->alloc_stack.size);
+      fprintf(Out(), "%*sAllocStack(%d)\n", padding, "", instr->alloc_stack.size);
       return;
     case DEALLOC_STACK:
-      printf("%*sDeallocStack(%d)\n", padding, "", instr->alloc_stack.size);
+      fprintf(Out(), "%*sDeallocStack(%d)\n", padding, "", instr->alloc_stack.size);
       return;
     case SET_CC:
-      printf("%*sCSET(%s, %s)\n", padding, "", GetCcStr(instr->set_cc.cc), GetRegisterStr(instr->set_cc.reg));
+      fprintf(Out(), "%*sCSET(%s, %s)\n", padding, "", GetCcStr(instr->set_cc.cc), GetRegisterStr(instr->set_cc.reg));
       return;
     case LABEL:
-      printf("%*sLabel(%s)\n", padding, "", instr->label.identifier);
+      fprintf(Out(), "%*sLabel(%s)\n", padding, "",
+             SymbolText(symbols, instr->label.identifier));
       return;
   }
 }
 
 void PrintArmFunc(ArmFunction* f, int padding) {
-  printf("%*sidentifier = \"%s\"\n", padding, "", f->name);
-  printf("%*sinstructions = [\n", padding, "");
+  fprintf(Out(), "%*sidentifier = \"%s\"\n", padding, "", SymbolText(symbols, f->name));
+  fprintf(Out(), "%*sinstructions = [\n", padding, "");
   padding += 2;
   for (int i = 0; i < f->length; ++i) {
     PrintArmInstruction(f->instructions + i, padding);
   }
   padding -= 2;
-  printf("%*s]\n", padding, "");
+  fprintf(Out(), "%*s]\n", padding, "");
 }
 
 void PrettyPrintAssemblyAST(ArmProgram* arm_program) {
-  printf("ArmProgram(\n");
-  printf("  Function(\n");
+  symbols = arm_program->symbols;
+  fprintf(Out(), "ArmProgram(\n");
+  fprintf(Out(), "  Function(\n");
   PrintArmFunc(arm_program->function_def, 4);
-  printf("  )\n)\n");
+  fprintf(Out(), "  )\n)\n");
 }
 
@@ -6,6 +6,9 @@
 #include "ir_gen.h"
 #include "codegen.h"
 
+// Sends this thread's printing to `file`, NULL for stdout.
+void SetPrettyPrintOutput(FILE* file);
+
 void PrettyPrintAST(Program* program);
 
 void PrettyPrintTacky(TackyProgram* program);
@@ -0,0 +1,540 @@
+#define _GNU_SOURCE
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "driver.h"
+#include "preprocessor.h"
+
+// The protocol, numbers are little endian uint32_t and strings are a length
+// and then the bytes.
+//   request:  version, argc, cwd, argc strings
+//   response: exit status, stdout, stderr
+// Both ends check lengths against these before allocating anything.
+#define PROTOCOL_VERSION 2
+#define MAX_REQUEST (4u << 20)
+#define MAX_ARGUMENTS (1u << 16)
+#define MAX_MESSAGE_STRING (64u << 20)
+// How long a job waits for its request and the server for a client to take
+// its response, so a client that stalls can't hold either up for good.
+#define CLIENT_TIMEOUT_SECONDS 30
+
+// A job runs until its process exits, 0 from then on, and is then replied
+// to over the non blocking client socket as fast as the client reads.
+typedef struct {
+  pid_t pid;
+  int client;
+  // memfds the job's stdout and stderr go to, and where it lists the files
+  // in its include cache when it exits. -1 once the job has exited.
+  int out;
+  int err;
+  int report;
+  char *reply;
+  size_t reply_length;
+  size_t sent;
+  time_t deadline;
+} Job;
+
+static int child_pipe[2];
+static volatile sig_atomic_t stopping = 0;
+static int report_fd = -1;
+
+// Only we can put a socket in here, or get at one that is.
+static bool PrivateDirectory(const char *dir) {
+  struct stat st;
+  return lstat(dir, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid() &&
+         (st.st_mode & 077) == 0;
+}
+
+// $XDG_RUNTIME_DIR when there is one, otherwise a directory of our own in
+// /tmp. NULL if that directory turns out to be someone else's.
+const char *DefaultSocketPath(void) {
+  static char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+  if (path[0] != '\0') {
+    return path;
+  }
+  char dir[sizeof(path)];
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  int n = runtime != NULL && runtime[0] == '/'
+              ? snprintf(dir, sizeof(dir), "%s", runtime)
+              : snprintf(dir, sizeof(dir), "/tmp/bcc-%u", (unsigned) getuid());
+  if (n < 0 || (size_t) n >= sizeof(dir)) {
+    return NULL;
+  }
+  mkdir(dir, 0700);
+  n = snprintf(path, sizeof(path), "%s/bcc.sock", dir);
+  if (!PrivateDirectory(dir) || n < 0 || (size_t) n >= sizeof(path)) {
+    path[0] = '\0';
+    return NULL;
+  }
+  return path;
+}
+
+static bool WriteAll(int fd, const void *data, size_t length) {
+  const char *p = data;
+  while (length > 0) {
+    ssize_t n = write(fd, p, length);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+static bool ReadAll(int fd, void *data, size_t length) {
+  char *p = data;
+  while (length > 0) {
+    ssize_t n = read(fd, p, length);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+static void PutNumber(uint8_t *bytes, uint32_t value) {
+  bytes[0] = value;
+  bytes[1] = value >> 8;
+  bytes[2] = value >> 16;
+  bytes[3] = value >> 24;
+}
+
+static bool WriteNumber(int fd, uint32_t value) {
+  uint8_t bytes[4];
+  PutNumber(bytes, value);
+  return WriteAll(fd, bytes, sizeof(bytes));
+}
+
+static bool ReadNumber(int fd, uint32_t *value) {
+  uint8_t bytes[4];
+  if (!ReadAll(fd, bytes, sizeof(bytes))) {
+    return false;
+  }
+  *value = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+  return true;
+}
+
+static bool WriteString(int fd, const char *text, uint32_t length) {
+  return WriteNumber(fd, length) && WriteAll(fd, text, length);
+}
+
+// Returns a malloced, NUL terminated copy, or NULL if the other end went away
+// or the string is longer than what is left of `budget`.
+static char *ReadString(int fd, uint32_t *length, uint32_t *budget) {
+  uint32_t n;
+  if (!ReadNumber(fd, &n) || n > *budget) {
+    return NULL;
+  }
+  *budget -= n;
+  char *text = malloc(n + 1);
+  if (text == NULL || !ReadAll(fd, text, n)) {
+    free(text);
+    return NULL;
+  }
+  text[n] = '\0';
+  if (length != NULL) {
+    *length = n;
+  }
+  return text;
+}
+
+// The whole of a memfd a job wrote to, malloced.
+static char *ReadMemfd(int fd, uint32_t *length) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size > MAX_MESSAGE_STRING) {
+    *length = 0;
+    return NULL;
+  }
+  char *text = malloc(st.st_size + 1);
+  if (text == NULL) {
+    *length = 0;
+    return NULL;
+  }
+  ssize_t n = pread(fd, text, st.st_size, 0);
+  *length = n < 0 ? 0 : n;
+  text[*length] = '\0';
+  return text;
+}
+
+// Whether the other end of a connection runs as our user. Anyone else could
+// have us write files as them, or be sent our command lines.
+static bool PeerIsUs(int fd) {
+  struct ucred peer;
+  socklen_t length = sizeof(peer);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0 &&
+         peer.uid == getuid();
+}
+
+static int ConnectTo(const char *socket_path, bool listening) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s", socket_path);
+    exit(1);
+  }
+  strcpy(addr.sun_path, socket_path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (!listening) {
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        !PeerIsUs(fd)) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+  // Only a socket of ours left behind by a server that is gone is cleared
+  // away, anything else at the path stays and we don't listen.
+  struct stat st;
+  if (lstat(socket_path, &st) == 0) {
+    int live = -1;
+    if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid() ||
+        (live = ConnectTo(socket_path, false)) >= 0) {
+      if (live >= 0) {
+        close(live);
+      }
+      close(fd);
+      return -1;
+    }
+    unlink(socket_path);
+  }
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+      listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Server
+
+static void OnChild(int sig) {
+  (void) sig;
+  int saved = errno;
+  char c = 0;
+  write(child_pipe[1], &c, 1);
+  errno = saved;
+}
+
+static void OnStop(int sig) {
+  (void) sig;
+  stopping = 1;
+}
+
+static void ReportCache(void) {
+  if (report_fd >= 0) {
+    FILE *out = fdopen(report_fd, "w");
+    if (out != NULL) {
+      WriteCachedPaths(out);
+      fclose(out);
+    }
+  }
+}
+
+// In the forked child. Reads the job off the socket, runs it from the
+// client's directory and exits with its status.
+static void RunJob(const Job *job, CompilerMain compile) {
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  uint32_t version, argc;
+  uint32_t budget = MAX_REQUEST;
+  if (!ReadNumber(job->client, &version) || version != PROTOCOL_VERSION ||
+      !ReadNumber(job->client, &argc) || argc == 0 || argc > MAX_ARGUMENTS) {
+    _exit(1);
+  }
+  char *cwd = ReadString(job->client, NULL, &budget);
+  char **argv = calloc(argc + 1, sizeof(char *));
+  if (cwd == NULL || argv == NULL) {
+    _exit(1);
+  }
+  for (uint32_t i = 0; i < argc; ++i) {
+    argv[i] = ReadString(job->client, NULL, &budget);
+    if (argv[i] == NULL) {
+      _exit(1);
+    }
+  }
+  close(job->client);
+  dup2(job->out, STDOUT_FILENO);
+  dup2(job->err, STDERR_FILENO);
+  report_fd = job->report;
+  atexit(ReportCache);
+  if (chdir(cwd) != 0) {
+    fprintf(stderr, "Failed to change to %s", cwd);
+    exit(1);
+  }
+  exit(compile((int) argc, argv));
+}
+
+static void CloseJob(Job *job) {
+  close(job->client);
+  if (job->out >= 0) {
+    close(job->out);
+    close(job->err);
+    close(job->report);
+  }
+  free(job->reply);
+}
+
+// Starts jobs[count], which holds everything the others had open too.
+static void StartJob(Job *jobs, int count, int client, int server,
+                     CompilerMain compile) {
+  Job *job = &jobs[count];
+  *job = (Job) {
+      .client = client,
+      .out = memfd_create("bcc-stdout", MFD_CLOEXEC),
+      .err = memfd_create("bcc-stderr", MFD_CLOEXEC),
+      .report = memfd_create("bcc-report", MFD_CLOEXEC),
+  };
+  if (job->out < 0 || job->err < 0 || job->report < 0) {
+    fprintf(stderr, "Failed to create job output");
+    exit(2);
+  }
+  job->pid = fork();
+  if (job->pid < 0) {
+    fprintf(stderr, "Failed to fork a job");
+    exit(2);
+  }
+  if (job->pid == 0) {
+    close(server);
+    close(child_pipe[0]);
+    close(child_pipe[1]);
+    for (int i = 0; i < count; ++i) {
+      CloseJob(&jobs[i]);
+    }
+    RunJob(job, compile);
+  }
+}
+
+// Turns the job's output into its reply and takes in the headers it read.
+// The reply is only sent from the poll loop, so a client that is slow to
+// read holds up nobody else.
+static void FinishJob(Job *job, int status) {
+  uint32_t code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                    : 128 + WTERMSIG(status);
+  uint32_t out_length, err_length;
+  char *out = ReadMemfd(job->out, &out_length);
+  char *err = ReadMemfd(job->err, &err_length);
+  job->reply_length = 12 + (size_t) out_length + err_length;
+  uint8_t *reply = malloc(job->reply_length);
+  if (reply == NULL) {
+    fprintf(stderr, "failed to allocate memory");
+    exit(2);
+  }
+  PutNumber(reply, code);
+  PutNumber(reply + 4, out_length);
+  memcpy(reply + 8, out, out_length);
+  PutNumber(reply + 8 + out_length, err_length);
+  memcpy(reply + 12 + out_length, err, err_length);
+  job->reply = (char *) reply;
+  job->sent = 0;
+  job->deadline = time(NULL) + CLIENT_TIMEOUT_SECONDS;
+  job->pid = 0;
+  free(out);
+  free(err);
+  uint32_t length;
+  char *paths = ReadMemfd(job->report, &length);
+  for (char *line = paths; line != NULL && *line != '\0';) {
+    char *end = strchr(line, '\n');
+    if (end == NULL) {
+      break;
+    }
+    *end = '\0';
+    WarmIncludeCache(line);
+    line = end + 1;
+  }
+  free(paths);
+  close(job->out);
+  close(job->err);
+  close(job->report);
+  job->out = job->err = job->report = -1;
+  // the job is done with the socket, nothing else shares its flags now.
+  fcntl(job->client, F_SETFL, fcntl(job->client, F_GETFL) | O_NONBLOCK);
+}
+
+// Sends what the client will take without waiting. True once the job is
+// done with, whether the reply went or the client gave up on it.
+static bool SendReply(Job *job) {
+  while (job->sent < job->reply_length) {
+    ssize_t n = send(job->client, job->reply + job->sent,
+                     job->reply_length - job->sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return time(NULL) >= job->deadline;
+    }
+    if (n <= 0) {
+      return true;
+    }
+    job->sent += n;
+  }
+  return true;
+}
+
+void RunServer(const char *socket_path, CompilerMain compile) {
+  if (socket_path == NULL) {
+    fprintf(stderr, "No private directory for the socket, use --server=PATH");
+    exit(2);
+  }
+  int server = ConnectTo(socket_path, true);
+  if (server < 0) {
+    fprintf(stderr, "Failed to listen on %s", socket_path);
+    exit(2);
+  }
+  if (pipe2(child_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+    fprintf(stderr, "Failed to start the server");
+    exit(2);
+  }
+  struct sigaction child_action = {.sa_handler = OnChild, .sa_flags = SA_RESTART};
+  sigaction(SIGCHLD, &child_action, NULL);
+  struct sigaction stop_action = {.sa_handler = OnStop};
+  sigaction(SIGINT, &stop_action, NULL);
+  sigaction(SIGTERM, &stop_action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  WarmUp();
+
+  Job *jobs = NULL;
+  int job_count = 0;
+  int job_capacity = 0;
+  // the server, the child pipe, then a client per job being replied to.
+  struct pollfd *fds = NULL;
+  Job **replying = NULL;
+  while (!stopping) {
+    if (job_count == job_capacity) {
+      job_capacity = job_capacity == 0 ? 16 : job_capacity * 2;
+      jobs = realloc(jobs, sizeof(Job) * job_capacity);
+      fds = realloc(fds, sizeof(struct pollfd) * (job_capacity + 2));
+      replying = realloc(replying, sizeof(Job *) * job_capacity);
+      if (jobs == NULL || fds == NULL || replying == NULL) {
+        fprintf(stderr, "failed to allocate memory");
+        exit(2);
+      }
+    }
+    fds[0] = (struct pollfd) {.fd = server, .events = POLLIN};
+    fds[1] = (struct pollfd) {.fd = child_pipe[0], .events = POLLIN};
+    int count = 0;
+    for (int i = 0; i < job_count; ++i) {
+      if (jobs[i].pid == 0) {
+        fds[2 + count] = (struct pollfd) {.fd = jobs[i].client,
+                                          .events = POLLOUT};
+        replying[count++] = &jobs[i];
+      }
+    }
+    // a second at a time while replies wait, so stalled clients time out.
+    if (poll(fds, 2 + count, count > 0 ? 1000 : -1) < 0) {
+      continue;
+    }
+    // replies first, the indexes into jobs shift once any are removed.
+    for (int i = 0; i < count; ++i) {
+      if ((fds[2 + i].revents != 0 || time(NULL) >= replying[i]->deadline) &&
+          SendReply(replying[i])) {
+        CloseJob(replying[i]);
+        replying[i]->client = -1;
+      }
+    }
+    for (int i = 0; i < job_count;) {
+      if (jobs[i].client < 0) {
+        jobs[i] = jobs[--job_count];
+      } else {
+        ++i;
+      }
+    }
+    if (fds[1].revents & POLLIN) {
+      char drain[64];
+      while (read(child_pipe[0], drain, sizeof(drain)) > 0) {
+      }
+      int status;
+      pid_t pid;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < job_count; ++i) {
+          if (jobs[i].pid == pid) {
+            FinishJob(&jobs[i], status);
+            break;
+          }
+        }
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      int client = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+      if (client < 0) {
+        continue;
+      }
+      struct timeval timeout = {.tv_sec = CLIENT_TIMEOUT_SECONDS};
+      if (!PeerIsUs(client) ||
+          setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                     sizeof(timeout)) != 0) {
+        close(client);
+        continue;
+      }
+      StartJob(jobs, job_count++, client, server, compile);
+    }
+  }
+  close(server);
+  unlink(socket_path);
+  free(jobs);
+  free(fds);
+  free(replying);
+}
+
+// Client
+
+int RunClient(const char *socket_path, int argc, char **argv) {
+  int fd = socket_path != NULL ? ConnectTo(socket_path, false) : -1;
+  if (fd < 0) {
+    return -1;
+  }
+  char *cwd = getcwd(NULL, 0);
+  uint32_t count = argc;
+  bool sent = cwd != NULL && WriteNumber(fd, PROTOCOL_VERSION) &&
+              WriteNumber(fd, count) &&
+              WriteString(fd, cwd, strlen(cwd));
+  for (int i = 0; sent && i < argc; ++i) {
+    sent = WriteString(fd, argv[i], strlen(argv[i]));
+  }
+  free(cwd);
+  uint32_t code;
+  uint32_t out_length, err_length;
+  uint32_t budget = 2 * MAX_MESSAGE_STRING;
+  char *out = NULL;
+  char *err = NULL;
+  if (!sent || !ReadNumber(fd, &code) ||
+      (out = ReadString(fd, &out_length, &budget)) == NULL ||
+      (err = ReadString(fd, &err_length, &budget)) == NULL) {
+    fprintf(stderr, "Lost the connection to the server at %s", socket_path);
+    exit(2);
+  }
+  close(fd);
+  fwrite(out, 1, out_length, stdout);
+  fwrite(err, 1, err_length, stderr);
+  free(out);
+  free(err);
+  return (int) code;
+}
@@ -0,0 +1,25 @@
+#ifndef BCC_SRC_SERVER_H
+#define BCC_SRC_SERVER_H
+
+// Runs one compile from command line arguments, argv[0] being the program.
+typedef int (*CompilerMain)(int argc, char **argv);
+
+// Socket used when --server or --connect isn't given a path, in a directory
+// only this user can get into. NULL if there's no such directory.
+const char *DefaultSocketPath(void);
+
+// Serves compiles on a Unix socket until interrupted, to clients running as
+// the same user only. The server holds what carries over between jobs,
+// the arena reservations, the scanner picked for the CPU and the include
+// cache, and forks a copy of itself per job so a failing compile can't take
+// it down. Headers read by a job are added to the server's cache after it.
+// Replies are sent without blocking, so a client slow to read one holds up
+// no other.
+void RunServer(const char *socket_path, CompilerMain compile);
+
+// Sends the arguments and the current directory to the server, relays what
+// the compile printed and returns its exit status. Returns -1 without
+// printing anything if no server is listening, or it isn't running as us.
+int RunClient(const char *socket_path, int argc, char **argv);
+
+#endif //BCC_SRC_SERVER_H
@@ -0,0 +1,303 @@
+#include "time_report.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include "diagnostics.h"
+
+static const char *phase_names[PHASE_COUNT] = {
+    [PHASE_PREPROCESS] = "preprocess",
+    [PHASE_LEX] = "lex",
+    [PHASE_PARSE] = "parse",
+    [PHASE_TACKY] = "tacky",
+    [PHASE_TRANSLATE] = "translate",
+    [PHASE_PSEUDO_REGISTERS] = "pseudo registers",
+    [PHASE_FIX_UP] = "fix up",
+    [PHASE_EMIT] = "emit",
+    [PHASE_ASSEMBLE] = "assemble",
+    [PHASE_LINK] = "link",
+};
+
+typedef struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} CounterEvent;
+
+#define CACHE_READ_MISS(cache) \
+  ((cache) | PERF_COUNT_HW_CACHE_OP_READ << 8 | \
+   PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+static const CounterEvent counter_events[COUNTER_COUNT] = {
+    [COUNTER_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [COUNTER_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE,
+                              PERF_COUNT_HW_INSTRUCTIONS},
+    [COUNTER_BRANCH_MISSES] = {"branch misses", PERF_TYPE_HARDWARE,
+                               PERF_COUNT_HW_BRANCH_MISSES},
+    [COUNTER_L1D_MISSES] = {"L1d misses", PERF_TYPE_HW_CACHE,
+                            CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    [COUNTER_LLC_MISSES] = {"LLC misses", PERF_TYPE_HW_CACHE,
+                            CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL)},
+};
+
+const char *PhaseName(Phase phase) {
+  return phase_names[phase];
+}
+
+static double Seconds(const struct timespec *from, const struct timespec *to) {
+  return (double) (to->tv_sec - from->tv_sec) +
+         (double) (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static int OpenCounter(const CounterEvent *event, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = event->type;
+  attr.config = event->config;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+  // user space only, which is all a paranoid kernel lets us count anyway.
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.disabled = group == -1;
+  return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group,
+                       PERF_FLAG_FD_CLOEXEC);
+}
+
+// Counts this thread only, so compiles in a batch don't see each other.
+static void OpenCounters(TimeReport *report) {
+  int leader = OpenCounter(&counter_events[COUNTER_CYCLES], -1);
+  // Said for every compile, in a batch it goes with each file's report.
+  if (leader < 0) {
+    fprintf(Diagnostics(), "perf counters unavailable (%s), reporting times only\n",
+            strerror(errno));
+    return;
+  }
+  report->counter_fds[COUNTER_CYCLES] = leader;
+  for (int i = 0; i < COUNTER_COUNT; ++i) {
+    if (i != COUNTER_CYCLES) {
+      report->counter_fds[i] = OpenCounter(&counter_events[i], leader);
+    }
+  }
+  for (int i = 0; i < COUNTER_COUNT; ++i) {
+    if (report->counter_fds[i] >= 0 &&
+        ioctl(report->counter_fds[i], PERF_EVENT_IOC_ID,
+              &report->counter_ids[i]) != 0) {
+      close(report->counter_fds[i]);
+      report->counter_fds[i] = -1;
+    }
+  }
+  ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+static bool HasCounters(const TimeReport *report) {
+  return report->counter_fds[COUNTER_CYCLES] >= 0;
+}
+
+// One read gets the whole group, as (value, id) pairs after a count.
+static void ReadCounters(const TimeReport *report,
+                         uint64_t values[COUNTER_COUNT]) {
+  uint64_t data[1 + 2 * COUNTER_COUNT];
+  memset(values, 0, sizeof(uint64_t) * COUNTER_COUNT);
+  if (read(report->counter_fds[COUNTER_CYCLES], data, sizeof(data)) <= 0) {
+    return;
+  }
+  for (uint64_t n = 0; n < data[0] && n < COUNTER_COUNT; ++n) {
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+      if (report->counter_fds[i] >= 0 &&
+          report->counter_ids[i] == data[2 + 2 * n]) {
+        values[i] = data[1 + 2 * n];
+      }
+    }
+  }
+}
+
+void StartReport(TimeReport *report, const char *file_name, Arena *arena,
+                 Arena *scratch, bool perf_counters) {
+  *report = (TimeReport) {
+      .file_name = file_name,
+      .arena = arena,
+      .scratch = scratch,
+  };
+  for (int i = 0; i < COUNTER_COUNT; ++i) {
+    report->counter_fds[i] = -1;
+  }
+  if (perf_counters) {
+    OpenCounters(report);
+  }
+}
+
+void StopReport(TimeReport *report) {
+  for (int i = 0; i < COUNTER_COUNT; ++i) {
+    if (report->counter_fds[i] >= 0) {
+      close(report->counter_fds[i]);
+      report->counter_fds[i] = -1;
+    }
+  }
+}
+
+void StartPhase(TimeReport *report) {
+  arena_reset_peak(report->arena);
+  arena_reset_peak(report->scratch);
+  clock_gettime(CLOCK_MONOTONIC, &report->wall_start);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &report->cpu_start);
+  // last, so the phase's counts start as close to it as they can.
+  if (HasCounters(report)) {
+    ReadCounters(report, report->counter_start);
+  }
+}
+
+// A phase can run more than once, say when a pass is split, so times add up
+// and the peak is the largest seen.
+void EndPhase(TimeReport *report, Phase phase) {
+  PhaseStats *stats = &report->phases[phase];
+  if (HasCounters(report)) {
+    uint64_t end[COUNTER_COUNT];
+    ReadCounters(report, end);
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+      stats->counters[i] += end[i] - report->counter_start[i];
+    }
+  }
+  struct timespec wall, cpu;
+  clock_gettime(CLOCK_MONOTONIC, &wall);
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+  stats->ran = true;
+  stats->wall_seconds += Seconds(&report->wall_start, &wall);
+  stats->cpu_seconds += Seconds(&report->cpu_start, &cpu);
+  stats->used = arena_used(report->arena) + arena_used(report->scratch);
+  size_t peak = arena_peak(report->arena) + arena_peak(report->scratch);
+  if (peak > stats->peak) {
+    stats->peak = peak;
+  }
+}
+
+static double PerSecond(size_t count, double seconds) {
+  return seconds > 0 ? count / seconds : 0;
+}
+
+static double Ipc(const PhaseStats *stats) {
+  uint64_t cycles = stats->counters[COUNTER_CYCLES];
+  return cycles > 0 ? (double) stats->counters[COUNTER_INSTRUCTIONS] / cycles : 0;
+}
+
+static void PrintCounters(const TimeReport *report, FILE *out) {
+  fprintf(out, "  %-18s", "phase");
+  for (int i = 0; i < COUNTER_COUNT; ++i) {
+    if (report->counter_fds[i] >= 0) {
+      fprintf(out, " %14s", counter_events[i].name);
+    }
+    if (i == COUNTER_INSTRUCTIONS && report->counter_fds[i] >= 0) {
+      fprintf(out, " %6s", "IPC");
+    }
+  }
+  fputc('\n', out);
+  for (int p = 0; p < PHASE_COUNT; ++p) {
+    const PhaseStats *stats = &report->phases[p];
+    if (!stats->ran) {
+      continue;
+    }
+    fprintf(out, "  %-18s", phase_names[p]);
+    for (int i = 0; i < COUNTER_COUNT; ++i) {
+      if (report->counter_fds[i] >= 0) {
+        fprintf(out, " %14llu", (unsigned long long) stats->counters[i]);
+      }
+      if (i == COUNTER_INSTRUCTIONS && report->counter_fds[i] >= 0) {
+        fprintf(out, " %6.2f", Ipc(stats));
+      }
+    }
+    fputc('\n', out);
+  }
+}
+
+static void PrintText(const TimeReport *report, FILE *out) {
+  double wall = 0, cpu = 0;
+  size_t peak = 0;
+  fprintf(out, "time report for %s\n", report->file_name);
+  fprintf(out, "  %-18s %10s %10s %12s %12s\n", "phase", "wall ms", "cpu ms",
+          "arena used", "arena peak");
+  for (int i = 0; i < PHASE_COUNT; ++i) {
+    const PhaseStats *stats = &report->phases[i];
+    if (!stats->ran) {
+      continue;
+    }
+    fprintf(out, "  %-18s %10.3f %10.3f %12zu %12zu\n", phase_names[i],
+            stats->wall_seconds * 1e3, stats->cpu_seconds * 1e3, stats->used,
+            stats->peak);
+    wall += stats->wall_seconds;
+    cpu += stats->cpu_seconds;
+    peak = stats->peak > peak ? stats->peak : peak;
+  }
+  fprintf(out, "  %-18s %10.3f %10.3f %12s %12zu\n", "total", wall * 1e3,
+          cpu * 1e3, "", peak);
+  double lex = report->phases[PHASE_LEX].wall_seconds;
+  fprintf(out, "  source bytes       %zu\n", report->source_bytes);
+  fprintf(out, "  tokens             %zu (%.0f/s)\n", report->tokens,
+          PerSecond(report->tokens, lex));
+  fprintf(out, "  ast nodes          %zu\n", report->ast_nodes);
+  fprintf(out, "  tacky instructions %zu\n", report->tacky_instructions);
+  fprintf(out, "  arm instructions   %zu\n", report->arm_instructions);
+  if (HasCounters(report)) {
+    PrintCounters(report, out);
+  }
+}
+
+static void PrintJson(const TimeReport *report, FILE *out) {
+  fprintf(out, "{\"file\": \"");
+  for (const char *p = report->file_name; *p != '\0'; ++p) {
+    if (*p == '"' || *p == '\\') {
+      fputc('\\', out);
+    }
+    fputc(*p, out);
+  }
+  fprintf(out, "\", \"phases\": [");
+  bool first = true;
+  for (int i = 0; i < PHASE_COUNT; ++i) {
+    const PhaseStats *stats = &report->phases[i];
+    if (!stats->ran) {
+      continue;
+    }
+    fprintf(out,
+            "%s{\"name\": \"%s\", \"wall_ms\": %.3f, \"cpu_ms\": %.3f, "
+            "\"arena_used\": %zu, \"arena_peak\": %zu",
+            first ? "" : ", ", phase_names[i], stats->wall_seconds * 1e3,
+            stats->cpu_seconds * 1e3, stats->used, stats->peak);
+    if (HasCounters(report)) {
+      fprintf(out, ", \"counters\": {");
+      for (int c = 0; c < COUNTER_COUNT; ++c) {
+        if (report->counter_fds[c] >= 0) {
+          fprintf(out, "%s\"%s\": %llu", c == 0 ? "" : ", ",
+                  counter_events[c].name,
+                  (unsigned long long) stats->counters[c]);
+        }
+        if (c == COUNTER_INSTRUCTIONS && report->counter_fds[c] >= 0) {
+          fprintf(out, ", \"IPC\": %.3f", Ipc(stats));
+        }
+      }
+      fputc('}', out);
+    }
+    fputc('}', out);
+    first = false;
+  }
+  double lex = report->phases[PHASE_LEX].wall_seconds;
+  fprintf(out,
+          "], \"source_bytes\": %zu, \"tokens\": %zu, \"tokens_per_second\": %.0f, "
+          "\"ast_nodes\": %zu, \"tacky_instructions\": %zu, "
+          "\"arm_instructions\": %zu}\n",
+          report->source_bytes, report->tokens, PerSecond(report->tokens, lex),
+          report->ast_nodes, report->tacky_instructions,
+          report->arm_instructions);
+}
+
+// Held locked so reports from a batch don't interleave.
+void PrintTimeReport(const TimeReport *report, FILE *out, bool json) {
+  flockfile(out);
+  if (json) {
+    PrintJson(report, out);
+  } else {
+    PrintText(report, out);
+  }
+  funlockfile(out);
+}
@@ -0,0 +1,78 @@
+#ifndef BCC_SRC_TIME_REPORT_H
+#define BCC_SRC_TIME_REPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "arena.h"
+
+typedef enum {
+  PHASE_PREPROCESS,
+  PHASE_LEX,
+  PHASE_PARSE,
+  PHASE_TACKY,
+  PHASE_TRANSLATE,
+  PHASE_PSEUDO_REGISTERS,
+  PHASE_FIX_UP,
+  PHASE_EMIT,
+  PHASE_ASSEMBLE,
+  PHASE_LINK,
+  PHASE_COUNT
+} Phase;
+
+// Hardware counters read around each phase with --perf-counters.
+typedef enum {
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_BRANCH_MISSES,
+  COUNTER_L1D_MISSES,
+  COUNTER_LLC_MISSES,
+  COUNTER_COUNT
+} Counter;
+
+typedef struct {
+  bool ran;
+  double wall_seconds;
+  double cpu_seconds;
+  // arena and scratch together, in use when the phase ended and the most
+  // that was in use at once during it.
+  size_t used;
+  size_t peak;
+  uint64_t counters[COUNTER_COUNT];
+} PhaseStats;
+
+// What --time-report prints for one compile. Everything is measured at phase
+// boundaries only, a compile without a report never touches one.
+typedef struct {
+  const char *file_name;
+  PhaseStats phases[PHASE_COUNT];
+  size_t source_bytes;
+  size_t tokens;
+  size_t ast_nodes;
+  size_t tacky_instructions;
+  size_t arm_instructions;
+  // the phase being timed.
+  struct timespec wall_start;
+  struct timespec cpu_start;
+  Arena *arena;
+  Arena *scratch;
+  // one perf event group for this thread, the cycle counter leads it. A
+  // counter the kernel or CPU won't give us is -1 and left out of the report,
+  // with no group at all only times are reported.
+  int counter_fds[COUNTER_COUNT];
+  uint64_t counter_ids[COUNTER_COUNT];
+  uint64_t counter_start[COUNTER_COUNT];
+} TimeReport;
+
+const char *PhaseName(Phase phase);
+void StartReport(TimeReport *report, const char *file_name, Arena *arena,
+                 Arena *scratch, bool perf_counters);
+// Closes the counters, after printing.
+void StopReport(TimeReport *report);
+void StartPhase(TimeReport *report);
+void EndPhase(TimeReport *report, Phase phase);
+void PrintTimeReport(const TimeReport *report, FILE *out, bool json);
+
+#endif //BCC_SRC_TIME_REPORT_H
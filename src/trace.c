@@ -0,0 +1,205 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+bool tracing = false;
+
+typedef struct {
+  // 'B' or 'E' as in the trace format.
+  char phase;
+  // set for spans on a child process's track.
+  bool child;
+  const char *name;
+  char *detail;
+  double timestamp;
+  pid_t pid;
+} TraceEvent;
+
+// Events are kept per thread, the lock is only ever contended by the exit
+// handler writing the trace out.
+typedef struct TraceBuffer TraceBuffer;
+struct TraceBuffer {
+  pthread_mutex_t lock;
+  TraceEvent *events;
+  size_t length;
+  size_t capacity;
+  // spans begun and not yet ended, only touched by the owning thread.
+  int open;
+  pid_t tid;
+  char name[32];
+  TraceBuffer *next;
+};
+
+static char *trace_path;
+static struct timespec origin;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceBuffer *buffers;
+static _Thread_local TraceBuffer *buffer;
+
+// Microseconds since tracing started, which is what the format wants.
+static double Now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double) (now.tv_sec - origin.tv_sec) * 1e6 +
+         (double) (now.tv_nsec - origin.tv_nsec) / 1e3;
+}
+
+static TraceBuffer *ThreadBuffer(void) {
+  if (buffer != NULL) {
+    return buffer;
+  }
+  buffer = calloc(1, sizeof(TraceBuffer));
+  if (buffer == NULL) {
+    fprintf(stderr, "failed to allocate memory");
+    exit(2);
+  }
+  pthread_mutex_init(&buffer->lock, NULL);
+  buffer->tid = (pid_t) syscall(SYS_gettid);
+  snprintf(buffer->name, sizeof(buffer->name), "%s",
+           buffer->tid == getpid() ? "main" : "thread");
+  pthread_mutex_lock(&buffers_lock);
+  buffer->next = buffers;
+  buffers = buffer;
+  pthread_mutex_unlock(&buffers_lock);
+  return buffer;
+}
+
+static void Record(TraceEvent event) {
+  TraceBuffer *b = ThreadBuffer();
+  pthread_mutex_lock(&b->lock);
+  if (b->length == b->capacity) {
+    b->capacity = b->capacity == 0 ? 256 : b->capacity * 2;
+    b->events = realloc(b->events, sizeof(TraceEvent) * b->capacity);
+    if (b->events == NULL) {
+      fprintf(stderr, "failed to allocate memory");
+      exit(2);
+    }
+  }
+  b->events[b->length++] = event;
+  pthread_mutex_unlock(&b->lock);
+}
+
+void NameTraceThread(const char *name, int index) {
+  if (tracing) {
+    TraceBuffer *b = ThreadBuffer();
+    snprintf(b->name, sizeof(b->name), "%s %d", name, index);
+  }
+}
+
+void TraceBeginEvent(const char *name, const char *detail) {
+  Record((TraceEvent) {
+      .phase = 'B',
+      .name = name,
+      .detail = detail != NULL ? strdup(detail) : NULL,
+      .timestamp = Now(),
+      .pid = getpid(),
+  });
+  ++buffer->open;
+}
+
+void TraceEndEvent(void) {
+  Record((TraceEvent) {.phase = 'E', .timestamp = Now(), .pid = getpid()});
+  --buffer->open;
+}
+
+int TraceDepth(void) {
+  return buffer != NULL ? buffer->open : 0;
+}
+
+void TraceSpawnEvent(pid_t pid, const char *name) {
+  if (tracing) {
+    Record((TraceEvent) {
+        .phase = 'B', .child = true, .name = name, .timestamp = Now(), .pid = pid});
+  }
+}
+
+void TraceReapEvent(pid_t pid) {
+  if (tracing) {
+    Record((TraceEvent) {
+        .phase = 'E', .child = true, .timestamp = Now(), .pid = pid});
+  }
+}
+
+static void WriteString(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s != '\0'; ++s) {
+    if (*s == '"' || *s == '\\') {
+      fputc('\\', out);
+      fputc(*s, out);
+    } else if ((unsigned char) *s < 0x20) {
+      fprintf(out, "\\u%04x", *s);
+    } else {
+      fputc(*s, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void WriteEvent(FILE *out, const TraceBuffer *b, const TraceEvent *e) {
+  pid_t tid = e->child ? e->pid : b->tid;
+  fprintf(out, ",\n{\"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d",
+          e->phase, e->timestamp, (int) e->pid, (int) tid);
+  if (e->name != NULL) {
+    fprintf(out, ", \"name\": ");
+    WriteString(out, e->name);
+  }
+  if (e->detail != NULL) {
+    fprintf(out, ", \"args\": {\"file\": ");
+    WriteString(out, e->detail);
+    fputc('}', out);
+  }
+  fputc('}', out);
+  // child processes are named after what they were started for.
+  if (e->child && e->phase == 'B') {
+    fprintf(out, ",\n{\"ph\": \"M\", \"pid\": %d, \"name\": \"process_name\", "
+                 "\"args\": {\"name\": ",
+            (int) e->pid);
+    WriteString(out, e->name);
+    fprintf(out, "}}");
+  }
+}
+
+// Runs at exit. Every buffer is left locked so threads still compiling
+// can't add to one while it is being written.
+static void WriteTrace(void) {
+  FILE *out = fopen(trace_path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Failed to write %s", trace_path);
+    return;
+  }
+  pthread_mutex_lock(&buffers_lock);
+  fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+  fprintf(out, "\n{\"ph\": \"M\", \"pid\": %d, \"name\": \"process_name\", "
+               "\"args\": {\"name\": \"bcc\"}}",
+          (int) getpid());
+  for (TraceBuffer *b = buffers; b != NULL; b = b->next) {
+    pthread_mutex_lock(&b->lock);
+    fprintf(out, ",\n{\"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                 "\"name\": \"thread_name\", \"args\": {\"name\": ",
+            (int) getpid(), (int) b->tid);
+    WriteString(out, b->name);
+    fprintf(out, "}}");
+    for (size_t i = 0; i < b->length; ++i) {
+      WriteEvent(out, b, &b->events[i]);
+    }
+  }
+  fprintf(out, "\n]}\n");
+  fclose(out);
+}
+
+void StartTrace(const char *path) {
+  if (tracing) {
+    free(trace_path);
+  } else {
+    clock_gettime(CLOCK_MONOTONIC, &origin);
+    atexit(WriteTrace);
+  }
+  trace_path = strdup(path);
+  tracing = true;
+}
@@ -0,0 +1,42 @@
+#ifndef BCC_SRC_TRACE_H
+#define BCC_SRC_TRACE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+// Begin and end spans written out in Chrome's trace event format, for
+// Perfetto or chrome://tracing. Each thread gets its own track and so does
+// each gcc we start. Spans nest per thread, an end closes the latest begin.
+//
+// The trace is written when the process exits, however it exits, so a
+// compile that fails part way still leaves its timeline behind.
+
+extern bool tracing;
+
+// Turns tracing on for the rest of the process.
+void StartTrace(const char *path);
+void NameTraceThread(const char *name, int index);
+
+void TraceBeginEvent(const char *name, const char *detail);
+void TraceEndEvent(void);
+// Spans open on this thread, so a compile that fails part way can end the
+// ones it began.
+int TraceDepth(void);
+// Spans on the child's own track, from when it was started until we reaped it.
+void TraceSpawnEvent(pid_t pid, const char *name);
+void TraceReapEvent(pid_t pid);
+
+// `name` must outlive the process, `detail` is copied and may be NULL.
+static inline void TraceBegin(const char *name, const char *detail) {
+  if (tracing) {
+    TraceBeginEvent(name, detail);
+  }
+}
+
+static inline void TraceEnd(void) {
+  if (tracing) {
+    TraceEndEvent();
+  }
+}
+
+#endif //BCC_SRC_TRACE_H
@@ -0,0 +1,67 @@
+// The include cache must notice a header that changes between two runs in one
+// process, even in the same second and at the same size, and must not keep
+// the file being compiled.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/arena.h"
+#include "../src/preprocessor.h"
+
+static void WriteFile(const char *path, const char *text) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL || fputs(text, f) < 0 || fclose(f) != 0) {
+    fprintf(stderr, "can't write %s\n", path);
+    exit(2);
+  }
+}
+
+static int failed = 0;
+
+static void Expect(Arena *scratch, const char *file_name, const char *expected) {
+  size_t length;
+  char *text = PreprocessFile(scratch, file_name, &length);
+  if (strcmp(text, expected) != 0) {
+    fprintf(stderr, "FAIL: expected \"%s\", got \"%s\"\n", expected, text);
+    failed = 1;
+  }
+  free(text);
+}
+
+int main(void) {
+  char dir[] = "/tmp/bcc-include-cache-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 2;
+  }
+  char header[64];
+  char source[64];
+  snprintf(header, sizeof(header), "%s/h.h", dir);
+  snprintf(source, sizeof(source), "%s/t.c", dir);
+  Arena scratch = reserve_arena((size_t) 1 << 30, 0);
+
+  WriteFile(header, "int a;\n");
+  WriteFile(source, "#include \"h.h\"\n");
+  Expect(&scratch, source, "int a;\n");
+  // same size, and almost surely the same second.
+  WriteFile(header, "int b;\n");
+  Expect(&scratch, source, "int b;\n");
+
+  char *paths;
+  size_t paths_size;
+  FILE *out = open_memstream(&paths, &paths_size);
+  WriteCachedPaths(out);
+  fclose(out);
+  if (strstr(paths, header) == NULL || strstr(paths, source) != NULL) {
+    fprintf(stderr, "FAIL: the cache should hold %s and not %s, it has:\n%s",
+            header, source, paths);
+    failed = 1;
+  }
+  free(paths);
+
+  unlink(header);
+  unlink(source);
+  rmdir(dir);
+  return failed;
+}
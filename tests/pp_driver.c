@@ -0,0 +1,20 @@
+// Runs the in process preprocessor over a file and prints the result, so the
+// tests can compare it with what gcc -E -P prints.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../src/arena.h"
+#include "../src/preprocessor.h"
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s FILE\n", argv[0]);
+    return 1;
+  }
+  Arena scratch = reserve_arena((size_t) 1 << 30, 0);
+  size_t length;
+  char *text = PreprocessFile(&scratch, argv[1], &length);
+  fwrite(text, 1, length, stdout);
+  free(text);
+  return 0;
+}
@@ -0,0 +1,15 @@
+// ## in an object-like macro.
+#define AB 7
+#define CAT A ## B
+int x = CAT;
+
+// C11 6.10.3.3p4, a # in an object-like macro is just a #.
+#define hash_hash # ## #
+#define mkstr(a) # a
+#define in_between(a) mkstr(a)
+#define join(c, d) in_between(c hash_hash d)
+char p[] = join(x, y);
+
+// and a line it starts isn't a directive.
+#define HASH # x
+HASH
@@ -0,0 +1,16 @@
+// Tokens next to each other in the source stay that way, macro argument or
+// not, only tokens that meet through an expansion are split.
+#define f(x) x
+#define g(x, y) x y
+#define E
+#define N 1
+#define M -1
+#define D .
+#define I vers
+f(vers2.h)
+f(a.b) f(1.5) f(a+b) f(x->y)
+-M N+2 N.5 D N I.h I+1
+g(a,b) g(-,-) g(+,=) g(1,e) g(.,5)
+-E- +E+ a E b
+f(-)f(-)
+f(x)f(y)
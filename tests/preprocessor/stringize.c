@@ -0,0 +1,9 @@
+#define S(x) #x
+#define X(x) S(x)
+const char *a = S(a
+  b    c);
+const char *b = S(\n "a\b" '\'' x\y);
+const char *c = S(  p   "q"   'r'  );
+const char *d = X(__LINE__);
+const char *e = S(
+   leading);
@@ -0,0 +1,3 @@
+int main(void) {
+  return (~-3 * 7 / 2 % 5 + (4 < 5) - (6 >= 2) + (1 == 1) * (2 != 3)) - -(9 > 8);
+}
@@ -0,0 +1,3 @@
+int main(void) {
+  return 1 == 2 != 3 < 4 <= 5 > 6 >= 7 | 8 ^ 9 & 10 >> 1 / 2 % 3 + (7 << 2);
+}
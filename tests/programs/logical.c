@@ -0,0 +1,3 @@
+int main(void) {
+  return (0 && 1) || !(8 <= 9) && (10 > 3) || ((5 % 3 || 0) && !!4);
+}
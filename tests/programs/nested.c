@@ -0,0 +1,3 @@
+int main(void) {
+  return (((((8 + 60) << (24 >= 69)) || ((19 & 81) % (66 < 94))) + (!(-(34)) >= ((49 > 50) <= (17 != 12)))) - -((((38 > 64) < (68 > 74)) & ((3 << 7) | (41 || 73)))));
+}
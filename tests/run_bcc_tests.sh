@@ -0,0 +1,183 @@
+#!/bin/sh
+# End to end checks of the bcc binary, each run in a fresh scratch directory.
+# usage: run_bcc_tests.sh BCC [CHECK...]
+# Runs every check_* below when no checks are named. Programs the checks
+# compile are in tests/programs.
+
+bcc=$1
+shift
+tests=$(cd "$(dirname "$0")" && pwd)
+failed=0
+
+fail() {
+  echo "FAIL: $check: $*" >&2
+  touch "$marker"
+}
+
+skip() {
+  echo "skipped $check: $*" >&2
+}
+
+# A program that needs no preprocessing, padded with spaces to `size` bytes.
+write_padded() {
+  printf 'int main(void) {\n  return 2;\n}\n' > "$1"
+  pad=$(($2 - $(wc -c < "$1") - 1))
+  printf "%${pad}s\n" "" >> "$1"
+}
+
+# A file that ends exactly on a page boundary can't be mapped with a NUL after
+# it, it still skips the preprocessor.
+check_bypass_page_sized() {
+  write_padded p.c "$(getconf PAGESIZE)"
+  "$bcc" -v -S p.c > /dev/null 2> log || fail "compile failed"
+  grep -q "preprocessor skipped" log || fail "not skipped: $(cat log)"
+}
+
+# A file that fails in a batch is reported on its own, the files after it are
+# still compiled, and what they all print comes out in the order given.
+check_batch_keeps_going() {
+  for name in a c d; do
+    printf 'int main(void) {\n  return 2;\n}\n' > $name.c
+  done
+  printf '#error stop\n' > b.c
+  printf 'int main(void) {\n  return 2 +;\n}\n' > e.c
+  "$bcc" -v -j4 -S a.c b.c c.c e.c d.c > /dev/null 2> log
+  [ $? -eq 2 ] || fail "batch with failures didn't exit 2"
+  for name in a c d; do
+    [ -s $name.s ] || fail "$name.s not written"
+  done
+  sed -n 's/: failed to compile$//p' log > failed
+  [ "$(cat failed)" = "$(printf 'b.c\ne.c')" ] || fail "failures: $(cat failed)"
+  grep -v ': error: \|^Expected\|failed to compile' log | cut -d: -f1 > order
+  [ "$(cat order)" = "$(printf 'a.c\nb.c\nc.c\ne.c\nd.c')" ] ||
+    fail "out of order: $(cat log)"
+}
+
+# A client that sends a job and never reads the reply mustn't hold up the
+# server's other clients.
+check_server_slow_client() {
+  command -v python3 > /dev/null || { skip "no python3"; return; }
+  printf 'int main(void) {\n  return 2;\n}\n' > small.c
+  python3 -c "print('int main(void) {\n  return ' + '+'.join(['1'] * 3000) + ';\n}')" > big.c
+  "$bcc" --server="$PWD/sock" 2> /dev/null &
+  server=$!
+  for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S sock ] && break
+    sleep 0.1
+  done
+  python3 - "$PWD/sock" <<'EOF' &
+import os, socket, struct, sys, time
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+args = [b"bcc", b"-S", b"big.c"]
+cwd = os.getcwd().encode()
+message = struct.pack("<III", 2, len(args), len(cwd)) + cwd
+for arg in args:
+    message += struct.pack("<I", len(arg)) + arg
+s.sendall(message)
+time.sleep(6)
+EOF
+  staller=$!
+  sleep 1
+  timeout 3 "$bcc" --connect="$PWD/sock" -S small.c > /dev/null ||
+    fail "a stalled client held up another"
+  [ -s small.s ] || fail "small.s not written"
+  kill $staller $server
+  wait 2> /dev/null
+}
+
+# A cache hit skips the front end, it mustn't skip writing the IR asked for.
+check_cache_save_ir() {
+  printf 'int main(void) {\n  return 2;\n}\n' > a.c
+  "$bcc" --cache="$PWD/cache" -S a.c > /dev/null || fail "compile failed"
+  "$bcc" --cache="$PWD/cache" --save-ast --save-tacky -S a.c > /dev/null ||
+    fail "compile saving IR failed"
+  [ -s a.ast ] || fail "a.ast not written"
+  [ -s a.tacky ] || fail "a.tacky not written"
+}
+
+# Objects and assembly are stored under their own suffixes, and an entry
+# stored over is only counted once.
+check_cache_entries() {
+  printf 'int main(void) {\n  return 2;\n}\n' > a.c
+  "$bcc" --cache="$PWD/cache" -S a.c > /dev/null || fail "-S failed"
+  "$bcc" --cache="$PWD/cache" -c a.c > /dev/null || fail "-c failed"
+  [ "$(find cache -name '*.s' | wc -l)" -eq 1 ] || fail "no .s entry"
+  [ "$(find cache -name '*.o' | wc -l)" -eq 1 ] || fail "no .o entry"
+  # saving the AST stores without a lookup, over the entry already there.
+  "$bcc" --cache="$PWD/cache" --save-ast -S a.c > /dev/null
+  size=$(find cache -name '*.[so]' -exec cat {} + | wc -c)
+  "$bcc" --cache="$PWD/cache" --cache-stats > stats
+  grep -q "size: *$size bytes" stats || fail "size not $size: $(cat stats)"
+  grep -q "hits: *0" stats && grep -q "stores: *3" stats ||
+    fail "counts: $(cat stats)"
+}
+
+# The assembly, our objects and our linker all agree on what main is called,
+# so the gcc fallback finds it too.
+check_entry_symbol() {
+  printf 'int main(void) {\n  return 2;\n}\n' > a.c
+  "$bcc" -S a.c > /dev/null || fail "-S failed"
+  case $(uname) in
+    Darwin) grep -q '^_main:' a.s || fail "no _main in a.s" ;;
+    *) grep -q '^main:' a.s || fail "no main in a.s" ;;
+  esac
+  "$bcc" -v a.c > /dev/null 2> log || fail "link failed"
+  grep -q "linked in process" log || fail "not linked in process: $(cat log)"
+  command -v llvm-readelf > /dev/null || { skip "no llvm-readelf"; return; }
+  "$bcc" -c a.c > /dev/null || fail "-c failed"
+  llvm-readelf -s a.o | grep -q 'GLOBAL .* main$' || fail "no global main in a.o"
+}
+
+# The objects we encode hold the same .text, byte for byte, as llvm-mc
+# assembling our own assembly for the same program.
+check_text_matches_llvm_mc() {
+  for tool in llvm-mc llvm-objcopy; do
+    command -v $tool > /dev/null || { skip "no $tool"; return; }
+  done
+  for source in "$tests"/programs/*.c; do
+    name=$(basename "$source" .c)
+    cp "$source" "$name.c"
+    "$bcc" -S "$name.c" > /dev/null && "$bcc" -c "$name.c" > /dev/null ||
+      { fail "$name: compile failed"; continue; }
+    llvm-mc -triple=aarch64 -filetype=obj "$name.s" -o "$name.ref.o" ||
+      { fail "$name: llvm-mc rejected $name.s"; continue; }
+    llvm-objcopy -O binary --only-section=.text "$name.o" "$name.text"
+    llvm-objcopy -O binary --only-section=.text "$name.ref.o" "$name.ref.text"
+    cmp -s "$name.text" "$name.ref.text" || fail "$name: .text differs"
+  done
+}
+
+# Compiling from a saved AST or Tacky file gives the same assembly as
+# compiling the source, and a damaged one is turned away.
+check_ir_round_trip() {
+  for source in "$tests"/programs/*.c; do
+    name=$(basename "$source" .c)
+    cp "$source" "$name.c"
+    "$bcc" -S --save-ast --save-tacky "$name.c" > /dev/null ||
+      { fail "$name: compile failed"; continue; }
+    mv "$name.s" "$name.expected.s"
+    for ir in ast tacky; do
+      "$bcc" -S "$name.$ir" > /dev/null || fail "$name: compile from .$ir failed"
+      cmp -s "$name.s" "$name.expected.s" || fail "$name: .$ir gives other assembly"
+      rm -f "$name.s"
+    done
+  done
+  head -c 40 "$name.tacky" > short.tacky
+  "$bcc" -S short.tacky > /dev/null 2> log
+  [ $? -eq 2 ] && grep -q "not a valid bcc IR file" log ||
+    fail "truncated Tacky file: $(cat log)"
+}
+
+checks=${*:-$(sed -n 's/^check_\([a-z_0-9]*\)() {$/\1/p' "$0")}
+for check in $checks; do
+  dir=$(mktemp -d)
+  marker=$dir.failed
+  (cd "$dir" && "check_$check")
+  if [ -e "$marker" ]; then
+    failed=1
+    rm -f "$marker"
+  fi
+  rm -rf "$dir"
+done
+exit $failed
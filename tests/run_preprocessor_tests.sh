@@ -0,0 +1,16 @@
+#!/bin/sh
+# Preprocesses every tests/preprocessor/*.c with pp_driver and compares the
+# output with the .expected file next to it, which is what gcc -E -P prints.
+# usage: run_preprocessor_tests.sh PP_DRIVER TEST_DIR
+
+driver=$1
+dir=$2
+failed=0
+for source in "$dir"/*.c; do
+  expected=${source%.c}.expected
+  if ! "$driver" "$source" | diff -u "$expected" - >&2; then
+    echo "FAIL: $source" >&2
+    failed=1
+  fi
+done
+exit $failed